@@ -37,10 +37,17 @@
 extern apc_cache_t* apc_cache;
 extern apc_cache_t* apc_user_cache;
 
-extern int _apc_store(char *strkey, int strkey_len, const zval *val, const uint ttl, const int exclusive TSRMLS_DC); /* this is hacky */
+extern int _apc_store(char *strkey, int strkey_len, const zval *val, const uint ttl, const uint grace, const double beta, const int exclusive TSRMLS_DC); /* this is hacky */
 
 #define APC_BINDUMP_DEBUG 0
 
+/* chain i of a cache, those of the table a rehash is migrating counting after
+ * the others; they may hold slots a clear left behind, of older generations */
+#define BIN_CHAIN(cache, i) \
+    ((i) < (cache)->header->num_slots ? (cache)->header->slots[i] : (cache)->header->old_slots[(i) - (cache)->header->num_slots])
+#define BIN_NUM_CHAINS(cache) ((cache)->header->num_slots + (cache)->header->old_num_slots)
+#define BIN_LIVE(cache, sp) ((sp)->generation == (cache)->header->generation)
+
 #if APC_BINDUMP_DEBUG
 
 #define SWIZZLE(bd, ptr)  \
@@ -681,10 +688,18 @@ apc_bd_t* apc_bin_dump(HashTable *files, HashTable *user_vars TSRMLS_DC) {
     files = apc_flip_hash(files);
     user_vars = apc_flip_hash(user_vars);
 
+    /* the entry counts must not change between the two passes, and both caches
+     * have to be walked as a single table: lock them for the whole dump */
+    CACHE_LOCK(apc_user_cache);
+    CACHE_LOCK(apc_cache);
+
     /* get size and entry counts */
-    for(i=0; i < apc_user_cache->num_slots; i++) {
-        sp = apc_user_cache->slots[i];
+    for(i=0; i < BIN_NUM_CHAINS(apc_user_cache); i++) {
+        sp = BIN_CHAIN(apc_user_cache, i);
         for(; sp != NULL; sp = sp->next) {
+            if(!BIN_LIVE(apc_user_cache, sp)) {
+                continue;
+            }
             if(apc_bin_checkfilter(user_vars, sp->key.data.user.identifier, sp->key.data.user.identifier_len)) {
                 size += sizeof(apc_bd_entry_t*) + sizeof(apc_bd_entry_t);
                 size += sp->value->mem_size - (sizeof(apc_cache_entry_t) - sizeof(apc_cache_entry_value_t));
@@ -692,9 +707,12 @@ apc_bd_t* apc_bin_dump(HashTable *files, HashTable *user_vars TSRMLS_DC) {
             }
         }
     }
-    for(i=0; i < apc_cache->num_slots; i++) {
-        sp = apc_cache->slots[i];
+    for(i=0; i < BIN_NUM_CHAINS(apc_cache); i++) {
+        sp = BIN_CHAIN(apc_cache, i);
         for(; sp != NULL; sp = sp->next) {
+            if(!BIN_LIVE(apc_cache, sp)) {
+                continue;
+            }
             if(sp->key.type == APC_CACHE_KEY_FPFILE) {
                 if(apc_bin_checkfilter(files, sp->key.data.fpfile.fullpath, sp->key.data.fpfile.fullpath_len+1)) {
                     size += sizeof(apc_bd_entry_t*) + sizeof(apc_bd_entry_t);
@@ -715,6 +733,8 @@ apc_bd_t* apc_bin_dump(HashTable *files, HashTable *user_vars TSRMLS_DC) {
     apc_bd_alloc_ex(pool_ptr, sizeof(apc_pool) TSRMLS_CC);
     ctxt.pool = apc_pool_create(APC_UNPOOL, apc_bd_alloc, apc_bd_free, NULL, NULL TSRMLS_CC);  /* ideally the pool wouldn't be alloc'd as part of this */
     if (!ctxt.pool) { /* TODO need to cleanup */
+        CACHE_UNLOCK(apc_cache);
+        CACHE_UNLOCK(apc_user_cache);
         apc_warning("Unable to allocate memory for pool." TSRMLS_CC);
         return NULL;
     }
@@ -726,9 +746,12 @@ apc_bd_t* apc_bin_dump(HashTable *files, HashTable *user_vars TSRMLS_DC) {
     /* User entries */
     zend_hash_init(&APCG(copied_zvals), 0, NULL, NULL, 0);
     count = 0;
-    for(i=0; i < apc_user_cache->num_slots; i++) {
-        sp = apc_user_cache->slots[i];
+    for(i=0; i < BIN_NUM_CHAINS(apc_user_cache); i++) {
+        sp = BIN_CHAIN(apc_user_cache, i);
         for(; sp != NULL; sp = sp->next) {
+            if(!BIN_LIVE(apc_user_cache, sp)) {
+                continue;
+            }
             if(apc_bin_checkfilter(user_vars, sp->key.data.user.identifier, sp->key.data.user.identifier_len)) {
                 ep = &bd->entries[count];
                 ep->type = sp->value->type;
@@ -778,8 +801,11 @@ apc_bd_t* apc_bin_dump(HashTable *files, HashTable *user_vars TSRMLS_DC) {
     APCG(copied_zvals).nTableSize=0;
 
     /* File entries */
-    for(i=0; i < apc_cache->num_slots; i++) {
-        for(sp=apc_cache->slots[i]; sp != NULL; sp = sp->next) {
+    for(i=0; i < BIN_NUM_CHAINS(apc_cache); i++) {
+        for(sp=BIN_CHAIN(apc_cache, i); sp != NULL; sp = sp->next) {
+            if(!BIN_LIVE(apc_cache, sp)) {
+                continue;
+            }
             if(sp->key.type == APC_CACHE_KEY_FPFILE) {
                 if(apc_bin_checkfilter(files, sp->key.data.fpfile.fullpath, sp->key.data.fpfile.fullpath_len+1)) {
                     ep = &bd->entries[count];
@@ -848,6 +874,9 @@ apc_bd_t* apc_bin_dump(HashTable *files, HashTable *user_vars TSRMLS_DC) {
         }
     }
 
+    CACHE_UNLOCK(apc_cache);
+    CACHE_UNLOCK(apc_user_cache);
+
     /* append swizzle pointer list to bd */
     bd = apc_swizzle_bd(bd, &ll TSRMLS_CC);
     zend_llist_destroy(&ll);
@@ -1009,7 +1038,7 @@ int apc_bin_load(apc_bd_t *bd, int flags TSRMLS_DC) {
                         break;
                     }
                     ctxt.copy = APC_COPY_IN_USER;
-                    _apc_store(ep->val.user.info, ep->val.user.info_len, data, ep->val.user.ttl, 0 TSRMLS_CC);
+                    _apc_store(ep->val.user.info, ep->val.user.info_len, data, ep->val.user.ttl, 0, 0, 0 TSRMLS_CC);
                     if (use_copy) {
                         zval_ptr_dtor(&data);
                     }
@@ -0,0 +1,121 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+   This software was contributed to PHP by Community Connect Inc. in 2002
+   and revised in 2005 by Yahoo! Inc. to add support for PHP 5.1.
+   Future revisions and derivatives of this source code must acknowledge
+   Community Connect Inc. as the original contributor of this module by
+   leaving this note intact in the source code.
+
+   All other licensing and usage conditions are those of the PHP Group.
+
+ */
+
+/* $Id$ */
+
+#include "apc_bloom.h"
+#include "apc_sma.h"
+
+#define BLOOM_MIN_WIDTH   4096
+#define BLOOM_PER_ENTRY   8     /* counters per key, about 2% false positives with 4 hashes */
+
+/* {{{ bloom_pos
+ * The counter i of the key with hash h: double hashing over two halves of a
+ * mixed hash, the second one odd so that the counters are distinct. */
+static inline unsigned int bloom_pos(apc_bloom_t* bloom, unsigned long h, int i)
+{
+    unsigned int x = (unsigned int) (h ^ ((h >> 16) >> 16)) * 0x9e3779b1U;
+    unsigned int h1 = (x >> 16) ^ x;
+    unsigned int h2 = ((x << 7) ^ (x >> 11)) | 1;
+
+    return (h1 + i * h2) & (bloom->width - 1);
+}
+/* }}} */
+
+/* {{{ apc_bloom_create */
+apc_bloom_t* apc_bloom_create(unsigned int entries TSRMLS_DC)
+{
+    apc_bloom_t* bloom;
+    unsigned int width = BLOOM_MIN_WIDTH;
+
+    while (width < entries * BLOOM_PER_ENTRY && width < (1U << 26)) {
+        width <<= 1;
+    }
+
+    bloom = (apc_bloom_t*) apc_sma_malloc(sizeof(apc_bloom_t) + width TSRMLS_CC);
+    if (!bloom) {
+        return NULL;
+    }
+    bloom->width = width;
+    bloom->counters = (unsigned char*) (bloom + 1);
+    memset((void*) bloom->counters, 0, width);
+
+    return bloom;
+}
+/* }}} */
+
+/* {{{ apc_bloom_add */
+void apc_bloom_add(apc_bloom_t* bloom, unsigned long h)
+{
+    unsigned int pos;
+    int i;
+
+    for (i = 0; i < APC_BLOOM_HASHES; i++) {
+        pos = bloom_pos(bloom, h, i);
+        if (bloom->counters[pos] < APC_BLOOM_MAX) {
+            bloom->counters[pos]++;
+        }
+    }
+}
+/* }}} */
+
+/* {{{ apc_bloom_remove */
+void apc_bloom_remove(apc_bloom_t* bloom, unsigned long h)
+{
+    unsigned int pos;
+    int i;
+
+    for (i = 0; i < APC_BLOOM_HASHES; i++) {
+        pos = bloom_pos(bloom, h, i);
+        if (bloom->counters[pos] < APC_BLOOM_MAX) {
+            bloom->counters[pos]--;
+        }
+    }
+}
+/* }}} */
+
+/* {{{ apc_bloom_maybe */
+int apc_bloom_maybe(apc_bloom_t* bloom, unsigned long h)
+{
+    int i;
+
+    for (i = 0; i < APC_BLOOM_HASHES; i++) {
+        if (!bloom->counters[bloom_pos(bloom, h, i)]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+/* }}} */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
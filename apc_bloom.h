@@ -0,0 +1,86 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+   This software was contributed to PHP by Community Connect Inc. in 2002
+   and revised in 2005 by Yahoo! Inc. to add support for PHP 5.1.
+   Future revisions and derivatives of this source code must acknowledge
+   Community Connect Inc. as the original contributor of this module by
+   leaving this note intact in the source code.
+
+   All other licensing and usage conditions are those of the PHP Group.
+
+ */
+
+/* $Id$ */
+
+#ifndef APC_BLOOM_H
+#define APC_BLOOM_H
+
+/*
+ * A counting Bloom filter over the keys in the user cache, so that fetches
+ * of keys that were never stored can be answered without locks and without
+ * looking at the slot table. Each key hash selects APC_BLOOM_HASHES
+ * counters; a key whose counters aren't all set is definitely not in the
+ * cache. Counters are incremented when an entry gets its directory id and
+ * decremented when the id is given back, both under the header lock of the
+ * cache, so they never fall short. A counter that saturates stays set for
+ * good, which can only cost false positives.
+ *
+ * Readers don't take the lock: a key whose store hasn't completed yet may
+ * be reported missing, as it would have been a moment earlier.
+ */
+
+#include "apc.h"
+
+#define APC_BLOOM_HASHES 4
+#define APC_BLOOM_MAX    255    /* counters saturate */
+
+/* {{{ struct definition: apc_bloom_t */
+typedef struct apc_bloom_t apc_bloom_t;
+struct apc_bloom_t {
+    unsigned int width;             /* number of counters, a power of 2 */
+    volatile unsigned char* counters;
+};
+/* }}} */
+
+/*
+ * apc_bloom_create allocates a filter in shared memory, sized for a cache
+ * of about entries keys. Returns NULL if it doesn't fit.
+ */
+extern apc_bloom_t* apc_bloom_create(unsigned int entries TSRMLS_DC);
+
+/*
+ * apc_bloom_add and apc_bloom_remove count the key with hash h in and out.
+ * The caller serializes them.
+ */
+extern void apc_bloom_add(apc_bloom_t* bloom, unsigned long h);
+extern void apc_bloom_remove(apc_bloom_t* bloom, unsigned long h);
+
+/*
+ * apc_bloom_maybe returns 0 if the key with hash h is definitely not
+ * counted in, 1 if it may be.
+ */
+extern int apc_bloom_maybe(apc_bloom_t* bloom, unsigned long h);
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
@@ -37,8 +37,9 @@
 #include "SAPI.h"
 #include "TSRM.h"
 #include "ext/standard/md5.h"
+#include "ext/standard/php_lcg.h"
 
-/* TODO: rehash when load factor exceeds threshold */
+#include <math.h>
 
 #define CHECK(p) { if ((p) == NULL) return NULL; }
 
@@ -46,17 +47,27 @@
 #define key_equals(a, b) (a.inode==b.inode && a.device==b.device)
 /* }}} */
 
+static void reclaim_retired(apc_cache_t* cache, unsigned long min_epoch, time_t now TSRMLS_DC);
 static void apc_cache_expunge(apc_cache_t* cache, size_t size TSRMLS_DC);
 
-/* {{{ hash */
-static unsigned long hash(apc_cache_key_t key)
+/* {{{ hash_mix
+ * zend_inline_hash_func() runs over the terminating NUL of the key, so every
+ * hash is a multiple of 33. That was harmless with a prime number of slots, but
+ * the slot table is now a multiple of the stripe count and grows by doubling:
+ * spread the bits before they are reduced modulo the table size. */
+static inline unsigned long hash_mix(unsigned long h)
 {
-    return (unsigned long)(key.data.file.device + key.data.file.inode);
+    h ^= h >> 16;
+    h *= 0x85ebca6bUL;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35UL;
+    h ^= h >> 16;
+    return h;
 }
 /* }}} */
 
 /* {{{ string_nhash_8 */
-#define string_nhash_8(s,len) (unsigned long)(zend_inline_hash_func((s), len))
+#define string_nhash_8(s,len) hash_mix((unsigned long)(zend_inline_hash_func((s), len)))
 /* }}} */
 
 /* {{{ murmurhash */
@@ -136,8 +147,10 @@ static int make_prime(int n)
 }
 /* }}} */
 
-/* {{{ make_slot */
-slot_t* make_slot(apc_cache_key_t *key, apc_cache_entry_t* value, slot_t* next, time_t t TSRMLS_DC)
+/* {{{ make_slot
+ * Slots are allocated before any stripe is locked, so that a failing
+ * allocation can expunge the cache without deadlocking on our own stripe. */
+slot_t* make_slot(apc_cache_key_t *key, apc_cache_entry_t* value TSRMLS_DC)
 {
     slot_t* p = apc_pool_alloc(value->pool, sizeof(slot_t));
 
@@ -158,15 +171,301 @@ slot_t* make_slot(apc_cache_key_t *key, apc_cache_entry_t* value, slot_t* next,
     }
     p->key = key[0];
     p->value = value;
-    p->next = next;
+    p->next = NULL;
     p->num_hits = 0;
-    p->creation_time = t;
-    p->access_time = t;
     p->deletion_time = 0;
+    p->deletion_epoch = 0;
+    p->id = CACHE_DIR_NONE;
+    p->generation = 0;
+    p->moved = 0;
     return p;
 }
 /* }}} */
 
+/* {{{ dir_grow
+ * Adds a chunk of ids to the cache directory. The caller holds the header
+ * lock, and possibly a stripe, so the chunk is allocated without expunging. */
+static int dir_grow(apc_cache_t* cache TSRMLS_DC)
+{
+    cache_header_t* header = cache->header;
+    cache_dir_chunk_t* chunk;
+    unsigned int base, i;
+
+    if (header->dir_chunks >= header->dir_max_chunks) {
+        return 0;
+    }
+
+    chunk = (cache_dir_chunk_t*) apc_sma_malloc_noexpunge(sizeof(cache_dir_chunk_t) TSRMLS_CC);
+    if (!chunk) {
+        return 0;
+    }
+
+    memset(chunk->slot, 0, sizeof(chunk->slot));
+    base = header->dir_chunks * CACHE_DIR_CHUNK_SIZE;
+    for (i = 0; i < CACHE_DIR_CHUNK_SIZE; i++) {
+        chunk->next_free[i] = base + i + 1;
+    }
+    chunk->next_free[CACHE_DIR_CHUNK_SIZE - 1] = header->dir_free;
+
+    header->dir[header->dir_chunks++] = chunk;
+    header->dir_free = base;
+
+    return 1;
+}
+/* }}} */
+
+/* {{{ wheel_add
+ * Links directory entry id into the timer wheel, in the bucket of the second
+ * it is due in (the first one it counts as expired in). A level n bucket
+ * spans 64^n seconds and is moved down a level as the wheel reaches it.
+ * The caller holds the header lock. */
+static void wheel_add(apc_cache_t* cache, unsigned int id)
+{
+    cache_header_t* header = cache->header;
+    cache_dir_chunk_t* chunk = CACHE_DIR_CHUNK(cache, id);
+    unsigned int pos = CACHE_DIR_POS(id);
+    unsigned int level, bucket;
+    time_t due = chunk->expires[pos] + 1;
+
+    if (due < header->wheel_time) {
+        due = header->wheel_time;
+    }
+    for (level = 0; level < CACHE_WHEEL_LEVELS - 1; level++) {
+        if (due - header->wheel_time < ((time_t)1 << (CACHE_WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+    if (due - header->wheel_time >= CACHE_WHEEL_SPAN) {
+        /* beyond the wheel: wait in the last level, and go round again */
+        due = header->wheel_time + CACHE_WHEEL_SPAN - 1;
+    }
+    bucket = level * CACHE_WHEEL_SIZE + ((due >> (CACHE_WHEEL_BITS * level)) & (CACHE_WHEEL_SIZE - 1));
+
+    chunk->wheel_bucket[pos] = bucket;
+    chunk->wheel_prev[pos] = CACHE_DIR_NONE;
+    chunk->wheel_next[pos] = header->wheel[bucket];
+    if (header->wheel[bucket] != CACHE_DIR_NONE) {
+        CACHE_DIR_CHUNK(cache, header->wheel[bucket])->wheel_prev[CACHE_DIR_POS(header->wheel[bucket])] = id;
+    }
+    header->wheel[bucket] = id;
+    header->wheel_count++;
+}
+/* }}} */
+
+/* {{{ wheel_unlink
+ * Takes directory entry id out of the timer wheel, if it is in there. The
+ * caller holds the header lock. */
+static void wheel_unlink(apc_cache_t* cache, unsigned int id)
+{
+    cache_header_t* header = cache->header;
+    cache_dir_chunk_t* chunk = CACHE_DIR_CHUNK(cache, id);
+    unsigned int pos = CACHE_DIR_POS(id);
+    unsigned int prev = chunk->wheel_prev[pos];
+    unsigned int next = chunk->wheel_next[pos];
+
+    if (chunk->wheel_bucket[pos] == CACHE_WHEEL_NONE) {
+        return;
+    }
+    if (prev == CACHE_DIR_NONE) {
+        header->wheel[chunk->wheel_bucket[pos]] = next;
+    } else {
+        CACHE_DIR_CHUNK(cache, prev)->wheel_next[CACHE_DIR_POS(prev)] = next;
+    }
+    if (next != CACHE_DIR_NONE) {
+        CACHE_DIR_CHUNK(cache, next)->wheel_prev[CACHE_DIR_POS(next)] = prev;
+    }
+    chunk->wheel_bucket[pos] = CACHE_WHEEL_NONE;
+    header->wheel_count--;
+}
+/* }}} */
+
+/* {{{ wheel_collect
+ * Turns the timer wheel up to second t, and takes up to CACHE_WHEEL_BATCH
+ * expired entries out of it into ids. If there are more, the wheel stops
+ * where it is and the next call carries on. Returns the number of ids. */
+static int wheel_collect(apc_cache_t* cache, time_t t, unsigned int* ids TSRMLS_DC)
+{
+    cache_header_t* header = cache->header;
+    cache_dir_chunk_t* chunk;
+    unsigned int level, bucket, id, next, pos;
+    time_t s;
+    int n = 0;
+
+    CACHE_HEADER_LOCK(cache);
+    while ((s = header->wheel_time) <= t) {
+        if (!header->wheel_count) {
+            /* nothing to wait for, skip the idle seconds */
+            header->wheel_time = t + 1;
+            break;
+        }
+        /* buckets of the higher levels that start at s move down */
+        for (level = CACHE_WHEEL_LEVELS - 1; level > 0; level--) {
+            if (s & (((time_t)1 << (CACHE_WHEEL_BITS * level)) - 1)) {
+                continue;
+            }
+            bucket = level * CACHE_WHEEL_SIZE + ((s >> (CACHE_WHEEL_BITS * level)) & (CACHE_WHEEL_SIZE - 1));
+            id = header->wheel[bucket];
+            header->wheel[bucket] = CACHE_DIR_NONE;
+            while (id != CACHE_DIR_NONE) {
+                next = CACHE_DIR_CHUNK(cache, id)->wheel_next[CACHE_DIR_POS(id)];
+                header->wheel_count--;
+                wheel_add(cache, id);
+                id = next;
+            }
+        }
+        bucket = s & (CACHE_WHEEL_SIZE - 1);
+        while ((id = header->wheel[bucket]) != CACHE_DIR_NONE) {
+            if (n == CACHE_WHEEL_BATCH) {
+                goto done;
+            }
+            chunk = CACHE_DIR_CHUNK(cache, id);
+            pos = CACHE_DIR_POS(id);
+            wheel_unlink(cache, id);
+            if (chunk->expires[pos] < s) {
+                ids[n++] = id;
+            } else {
+                /* it was waiting beyond the wheel */
+                wheel_add(cache, id);
+            }
+        }
+        header->wheel_time = s + 1;
+    }
+done:
+    CACHE_HEADER_UNLOCK(cache);
+
+    return n;
+}
+/* }}} */
+
+/* {{{ dir_link
+ * Gives a slot that is about to be linked into its chain an id, and fills in
+ * its directory entry. The caller holds the slot's stripe. */
+static int dir_link(apc_cache_t* cache, slot_t* slot, time_t t TSRMLS_DC)
+{
+    cache_header_t* header = cache->header;
+    cache_dir_chunk_t* chunk;
+    unsigned int id, pos;
+    time_t expires = 0;
+
+    /* the entry is removed once its grace period is over too */
+    if (slot->value->type == APC_CACHE_ENTRY_USER && slot->value->data.user.ttl) {
+        expires = t + slot->value->data.user.ttl + slot->value->data.user.grace;
+    }
+
+    CACHE_HEADER_LOCK(cache);
+    if (header->dir_free == CACHE_DIR_NONE && !dir_grow(cache TSRMLS_CC)) {
+        CACHE_HEADER_UNLOCK(cache);
+        return 0;
+    }
+    id = header->dir_free;
+    chunk = CACHE_DIR_CHUNK(cache, id);
+    pos = CACHE_DIR_POS(id);
+    header->dir_free = chunk->next_free[pos];
+    chunk->expires[pos] = expires;
+    if (expires) {
+        wheel_add(cache, id);
+    } else {
+        chunk->wheel_bucket[pos] = CACHE_WHEEL_NONE;
+    }
+    if (cache->bloom) {
+        apc_bloom_add(cache->bloom, slot->key.h);
+    }
+    CACHE_HEADER_UNLOCK(cache);
+
+    slot->id = id;
+    slot->generation = header->generation;
+    chunk->h[pos] = slot->key.h;
+    chunk->creation_time[pos] = t;
+    chunk->access_time[pos] = t;
+    chunk->type[pos] = slot->value->type;
+    chunk->referenced[pos] = 1;
+    chunk->base[pos] = header->inflation;
+    chunk->slot[pos] = slot;
+
+    return 1;
+}
+/* }}} */
+
+/* {{{ dir_expired
+ * The expiry rules of apc_cache_expunge, on a directory entry. */
+static inline int dir_expired(apc_cache_t* cache, cache_dir_chunk_t* chunk, int pos, time_t t)
+{
+    if (chunk->type[pos] == APC_CACHE_ENTRY_USER) {
+        if (chunk->expires[pos]) {
+            return chunk->expires[pos] < t;
+        }
+        return cache->ttl && chunk->creation_time[pos] + cache->ttl < t;
+    }
+    return chunk->access_time[pos] < t - cache->ttl;
+}
+/* }}} */
+
+/* {{{ user_early
+ * Probabilistic early expiration (XFetch): an entry that expires at expires is
+ * refreshed ahead of time by a random reader, the more likely the closer the
+ * ttl is and the longer the key took to rebuild. beta scales how early. */
+static inline int user_early(slot_t* slot, time_t expires, time_t t TSRMLS_DC)
+{
+    apc_cache_entry_t* entry = slot->value;
+
+    if (entry->data.user.beta <= 0 || !entry->data.user.cost) {
+        return 0;
+    }
+
+    return t - entry->data.user.cost / 1000000.0 * entry->data.user.beta * log(php_combined_lcg(TSRMLS_C)) >= expires;
+}
+/* }}} */
+
+/* {{{ user_expired
+ * Whether a user entry is past its ttl at t. Its directory entry expires when
+ * the grace period is over; if stale is given, an entry within its grace
+ * period doesn't count as expired, and stale is set instead. So is stale for
+ * an entry user_early picks for a refresh. */
+static inline int user_expired(apc_cache_t* cache, slot_t* slot, time_t t, zend_bool* stale TSRMLS_DC)
+{
+    time_t expires = SLOT_EXPIRES(cache, slot);
+
+    if (!expires) {
+        return 0;
+    }
+    if (stale) {
+        expires -= (time_t)slot->value->data.user.grace;
+        *stale = expires < t || user_early(slot, expires, t TSRMLS_CC);
+        return expires + (time_t)slot->value->data.user.grace < t;
+    }
+    return expires - (time_t)slot->value->data.user.grace < t;
+}
+/* }}} */
+
+/* {{{ dir_release
+ * Returns the id of a slot that is being freed, unless the slot was moved
+ * and its copy has the id now. The caller holds the header lock. */
+static void dir_release(apc_cache_t* cache, slot_t* slot)
+{
+    if (slot->moved) {
+        return;
+    }
+    CACHE_DIR_CHUNK(cache, slot->id)->next_free[CACHE_DIR_POS(slot->id)] = cache->header->dir_free;
+    cache->header->dir_free = slot->id;
+    if (cache->bloom) {
+        apc_bloom_remove(cache->bloom, slot->key.h);
+    }
+}
+/* }}} */
+
+/* {{{ link_slot
+ * Puts a fully built slot at *slot. Lock-free readers may follow the link as
+ * soon as it is stored, so the slot has to be visible first. */
+static inline void link_slot(slot_t** slot, slot_t* new_slot)
+{
+    new_slot->next = *slot;
+#if APC_EPOCH_AVAILABLE
+    APC_WMB();
+#endif
+    *slot = new_slot;
+}
+/* }}} */
+
 /* {{{ free_slot */
 static void free_slot(slot_t* slot TSRMLS_DC)
 {
@@ -174,47 +473,251 @@ static void free_slot(slot_t* slot TSRMLS_DC)
 }
 /* }}} */
 
+/* {{{ retire_slot
+ * Puts a removed slot nobody holds a reference to into the bucket of the
+ * ring that is being filled, until lock-free readers have moved on. A full
+ * bucket is closed; when the ring has gone round, the oldest bucket is handed
+ * to the deleted list, where its slots wait on their own epoch and gc_ttl.
+ * Returns whether the ring is full now. The caller holds the header lock. */
+static int retire_slot(apc_cache_t* cache, slot_t* dead)
+{
+    cache_header_t* header = cache->header;
+    cache_retired_t* b = &header->retired[header->retired_head];
+    unsigned int next = (header->retired_head + 1) % CACHE_RETIRE_BUCKETS;
+    cache_retired_t* oldest;
+    slot_t* p;
+
+    if (b->count >= CACHE_RETIRE_BATCH) {
+        if (next == header->retired_tail) {
+            oldest = &header->retired[header->retired_tail];
+            while ((p = oldest->list) != NULL) {
+                oldest->list = p->next;
+                p->next = header->deleted_list;
+                header->deleted_list = p;
+            }
+            oldest->epoch = 0;
+            oldest->count = 0;
+            header->retired_tail = (header->retired_tail + 1) % CACHE_RETIRE_BUCKETS;
+        }
+        header->retired_head = next;
+        b = &header->retired[next];
+        next = (next + 1) % CACHE_RETIRE_BUCKETS;
+    }
+
+    if (!b->list) {
+        b->time = dead->deletion_time;
+    }
+    dead->next = b->list;
+    b->list = dead;
+    if (dead->deletion_epoch > b->epoch) {
+        b->epoch = dead->deletion_epoch;
+    }
+    return ++b->count >= CACHE_RETIRE_BATCH && next == header->retired_tail;
+}
+/* }}} */
+
+/* {{{ dispose_slot
+ * Frees a slot that is out of its chain, or leaves it to whoever comes last:
+ * the reclamation of retired slots, or the deleted list. */
+static void dispose_slot(apc_cache_t* cache, slot_t* dead TSRMLS_DC)
+{
+    int full = 0;
+
+    /* a lock-free reader may still be looking at the slot even though
+     * nobody holds a reference to it yet */
+    if (dead->value->ref_count <= 0 && !cache->optimistic_reads) {
+        CACHE_HEADER_LOCK(cache);
+        dir_release(cache, dead);
+        CACHE_HEADER_UNLOCK(cache);
+        free_slot(dead TSRMLS_CC);
+    }
+    else {
+        dead->deletion_time = time(0);
+#if APC_EPOCH_AVAILABLE
+        if (cache->optimistic_reads) {
+            dead->deletion_epoch = apc_epoch_retire(TSRMLS_C);
+        }
+#endif
+        CACHE_HEADER_LOCK(cache);
+        if (cache->optimistic_reads && dead->value->ref_count <= 0) {
+            full = retire_slot(cache, dead);
+        } else {
+            dead->next = cache->header->deleted_list;
+            cache->header->deleted_list = dead;
+        }
+        CACHE_HEADER_UNLOCK(cache);
+    }
+
+#if APC_EPOCH_AVAILABLE
+    /* the ring is full: rather than have the next retired slot push the
+     * oldest bucket onto the deleted list, wait for the readers of it */
+    if (full) {
+        apc_epoch_reap(TSRMLS_C);
+        apc_epoch_synchronize(TSRMLS_C);
+        reclaim_retired(cache, apc_epoch_min_active(cache->epoch_pin TSRMLS_CC), time(0) TSRMLS_CC);
+    }
+#endif
+}
+/* }}} */
+
 /* {{{ remove_slot */
 static void remove_slot(apc_cache_t* cache, slot_t** slot TSRMLS_DC)
 {
     slot_t* dead = *slot;
+    cache_dir_chunk_t* chunk = CACHE_DIR_CHUNK(cache, dead->id);
     *slot = (*slot)->next;
 
-    cache->header->mem_size -= dead->value->mem_size;
-    CACHE_FAST_DEC(cache, cache->header->num_entries);
-    if (dead->value->ref_count <= 0) {
+    chunk->slot[CACHE_DIR_POS(dead->id)] = NULL;
+    /* only entries that expire go into the wheel; the bucket itself may
+     * change under the header lock while the wheel turns */
+    if (chunk->expires[CACHE_DIR_POS(dead->id)]) {
+        CACHE_HEADER_LOCK(cache);
+        wheel_unlink(cache, dead->id);
+        CACHE_HEADER_UNLOCK(cache);
+    }
+
+    if (cache->use_index && dead->key.type == APC_CACHE_KEY_USER) {
+        apc_index_t* idx = &CACHE_STRIPE(cache, CACHE_STRIPE_OF(cache, dead->key.h))->index;
+        if (idx->groups) {
+            apc_index_remove(idx, dead->key.h, dead);
+        }
+    }
+
+    if (dead->generation == cache->header->generation) {
+        CACHE_STAT_ADD(cache, cache->header->mem_size, -dead->value->mem_size);
+        CACHE_STAT_ADD(cache, cache->header->num_entries, -1);
+    } else {
+        /* a leftover of a clear, which already took it out of the stats */
+        CACHE_HEADER_LOCK(cache);
+        cache->header->stale_size -= dead->value->mem_size;
+        cache->header->stale_entries--;
+        CACHE_HEADER_UNLOCK(cache);
+    }
+    dispose_slot(cache, dead TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ retired_due
+ * Whether the bucket can go: no lock-free reader or pin is older than its
+ * slots, or its oldest slot has been retired for more than gc_ttl seconds. */
+static inline int retired_due(apc_cache_t* cache, cache_retired_t* b, unsigned long min_epoch, time_t now)
+{
+    return b->list && (b->epoch <= min_epoch || (cache->gc_ttl && now - b->time > cache->gc_ttl));
+}
+/* }}} */
+
+/* {{{ reclaim_retired
+ * Frees the buckets of retired slots, oldest first, that no lock-free reader
+ * and no pin is older than, or that are past gc_ttl (we issue a debug message
+ * in the latter case). A slot somebody took a reference to before it was
+ * removed moves on to the deleted list instead. Only the oldest bucket is
+ * looked at when nothing can go yet. */
+static void reclaim_retired(apc_cache_t* cache, unsigned long min_epoch, time_t now TSRMLS_DC)
+{
+    cache_header_t* header = cache->header;
+    cache_retired_t* b;
+    slot_t* dead = NULL;
+    slot_t* p;
+    slot_t* next;
+
+    if (!retired_due(cache, &header->retired[header->retired_tail], min_epoch, now)) {
+        return;
+    }
+
+    CACHE_HEADER_LOCK(cache);
+    for (;;) {
+        b = &header->retired[header->retired_tail];
+        if (!retired_due(cache, b, min_epoch, now)) {
+            break;
+        }
+        if (b->epoch > min_epoch) {
+            apc_debug("GC %u retired cache entries that were held for %d seconds" TSRMLS_CC, b->count, (int)(now - b->time));
+        }
+        for (p = b->list; p; p = next) {
+            next = p->next;
+            if (p->value->ref_count > 0) {
+                p->next = header->deleted_list;
+                header->deleted_list = p;
+            } else {
+                dir_release(cache, p);
+                p->next = dead;
+                dead = p;
+            }
+        }
+        b->list = NULL;
+        b->epoch = 0;
+        b->count = 0;
+        if (header->retired_tail == header->retired_head) {
+            break;
+        }
+        header->retired_tail = (header->retired_tail + 1) % CACHE_RETIRE_BUCKETS;
+    }
+    CACHE_HEADER_UNLOCK(cache);
+
+    /* the pools go back to the allocator outside of the header lock */
+    for (; dead; dead = next) {
+        next = dead->next;
         free_slot(dead TSRMLS_CC);
     }
-    else {
-        dead->next = cache->header->deleted_list;
-        dead->deletion_time = time(0);
-        cache->header->deleted_list = dead;
+}
+/* }}} */
+
+#if APC_EPOCH_AVAILABLE
+/* {{{ retired_min_epoch
+ * The oldest epoch lock-free readers and pins of the cache are in. When that
+ * holds the oldest retired bucket back, it may be a worker that died in a
+ * read or with a pin: those are reaped and it is looked at again. */
+static unsigned long retired_min_epoch(apc_cache_t* cache TSRMLS_DC)
+{
+    unsigned long min_epoch = apc_epoch_min_active(cache->epoch_pin TSRMLS_CC);
+
+    if (cache->header->retired[cache->header->retired_tail].epoch > min_epoch) {
+        apc_epoch_reap(TSRMLS_C);
+        min_epoch = apc_epoch_min_active(cache->epoch_pin TSRMLS_CC);
     }
+    return min_epoch;
 }
 /* }}} */
+#endif
 
 /* {{{ process_pending_removals */
 static void process_pending_removals(apc_cache_t* cache TSRMLS_DC)
 {
     slot_t** slot;
     time_t now;
+    unsigned long min_epoch = ULONG_MAX;
 
-    /* This function scans the list of removed cache entries and deletes any
+    /* This function frees the retired slots lock-free readers have moved
+     * on from, then scans the list of removed cache entries and deletes any
      * entry whose reference count is zero (indicating that it is no longer
-     * being executed) or that has been on the pending list for more than
-     * cache->gc_ttl seconds (we issue a warning in the latter case).
+     * being executed) and that no lock-free reader can still reach, or that
+     * has been on the pending list for more than cache->gc_ttl seconds (we
+     * issue a warning in the latter case).
      */
 
+    if (!cache->header->deleted_list && !cache->header->retired[cache->header->retired_tail].list)
+        return;
+
+#if APC_EPOCH_AVAILABLE
+    if (cache->optimistic_reads) {
+        min_epoch = retired_min_epoch(cache TSRMLS_CC);
+    }
+#endif
+
+    now = time(0);
+    reclaim_retired(cache, min_epoch, now TSRMLS_CC);
+
     if (!cache->header->deleted_list)
         return;
 
+    CACHE_HEADER_LOCK(cache);
+
     slot = &cache->header->deleted_list;
-    now = time(0);
 
     while (*slot != NULL) {
         int gc_sec = cache->gc_ttl ? (now - (*slot)->deletion_time) : 0;
 
-        if ((*slot)->value->ref_count <= 0 || gc_sec > cache->gc_ttl) {
+        if (((*slot)->value->ref_count <= 0 && (*slot)->deletion_epoch <= min_epoch) || gc_sec > cache->gc_ttl) {
             slot_t* dead = *slot;
 
             if (dead->value->ref_count > 0) {
@@ -229,265 +732,1602 @@ static void process_pending_removals(apc_cache_t* cache TSRMLS_DC)
                 }
             }
             *slot = dead->next;
+            dir_release(cache, dead);
             free_slot(dead TSRMLS_CC);
         }
         else {
             slot = &(*slot)->next;
         }
     }
+
+    CACHE_HEADER_UNLOCK(cache);
 }
 /* }}} */
 
-/* {{{ prevent_garbage_collection */
-static void prevent_garbage_collection(apc_cache_entry_t* entry)
+/* {{{ pending_removals_step
+ * What inserts do about removed slots: retired buckets are checked every
+ * time, which costs a look at the oldest one unless it can go, while the
+ * deleted list, which only holds slots that are still referenced, is scanned
+ * at most once a second. */
+static void pending_removals_step(apc_cache_t* cache, time_t t TSRMLS_DC)
 {
-    /* set reference counts on zend objects to an arbitrarily high value to
-     * prevent garbage collection after execution */
+    cache_header_t* header = cache->header;
 
-    enum { BIG_VALUE = 1000 };
-
-    if(entry->data.file.op_array) {
-        entry->data.file.op_array->refcount[0] = BIG_VALUE;
-    }
-    if (entry->data.file.functions) {
-        int i;
-        apc_function_t* fns = entry->data.file.functions;
-        for (i=0; fns[i].function != NULL; i++) {
-            *(fns[i].function->op_array.refcount) = BIG_VALUE;
-        }
+    if (header->deleted_list && header->gc_time != t) {
+        header->gc_time = t;
+        process_pending_removals(cache TSRMLS_CC);
+        return;
     }
-    if (entry->data.file.classes) {
-        int i;
-        apc_class_t* classes = entry->data.file.classes;
-        for (i=0; classes[i].class_entry != NULL; i++) {
-            classes[i].class_entry->refcount = BIG_VALUE;
-        }
+#if APC_EPOCH_AVAILABLE
+    if (header->retired[header->retired_tail].list) {
+        reclaim_retired(cache, retired_min_epoch(cache TSRMLS_CC), t TSRMLS_CC);
     }
+#endif
 }
 /* }}} */
 
-/* {{{ apc_cache_create */
-apc_cache_t* apc_cache_create(int size_hint, int gc_ttl, int ttl TSRMLS_DC)
+/* {{{ reclaim_removed
+ * Expunges need the memory back right away: rather than leaving the slots
+ * retired until lock-free readers have moved on, wait for them. The caller
+ * doesn't hold the header lock. */
+static void reclaim_removed(apc_cache_t* cache TSRMLS_DC)
 {
-    apc_cache_t* cache;
-    int cache_size;
-    int num_slots;
-
-    num_slots = make_prime(size_hint > 0 ? size_hint : 2000);
-
-    cache = (apc_cache_t*) apc_emalloc(sizeof(apc_cache_t) TSRMLS_CC);
-    cache_size = sizeof(cache_header_t) + num_slots*sizeof(slot_t*);
-
-    cache->shmaddr = apc_sma_malloc(cache_size TSRMLS_CC);
-    if(!cache->shmaddr) {
-        apc_error("Unable to allocate shared memory for cache structures.  (Perhaps your shared memory size isn't large enough?). " TSRMLS_CC);
-        return NULL;
+#if APC_EPOCH_AVAILABLE
+    if (cache->optimistic_reads && (cache->header->deleted_list || cache->header->retired[cache->header->retired_tail].list)) {
+        apc_epoch_synchronize(TSRMLS_C);
+        process_pending_removals(cache TSRMLS_CC);
     }
-    memset(cache->shmaddr, 0, cache_size);
-
-    cache->header = (cache_header_t*) cache->shmaddr;
-    cache->header->num_hits = 0;
-    cache->header->num_misses = 0;
-    cache->header->deleted_list = NULL;
-    cache->header->start_time = time(NULL);
-    cache->header->expunges = 0;
-    cache->header->busy = 0;
-
-    cache->slots = (slot_t**) (((char*) cache->shmaddr) + sizeof(cache_header_t));
-    cache->num_slots = num_slots;
-    cache->gc_ttl = gc_ttl;
-    cache->ttl = ttl;
-    CREATE_LOCK(cache->header->lock);
-#if NONBLOCKING_LOCK_AVAILABLE
-    CREATE_LOCK(cache->header->wrlock);
 #endif
-    memset(cache->slots, 0, sizeof(slot_t*)*num_slots);
-    cache->expunge_cb = apc_cache_expunge;
-    cache->has_lock = 0;
-
-    return cache;
 }
 /* }}} */
 
-/* {{{ apc_cache_destroy */
-void apc_cache_destroy(apc_cache_t* cache TSRMLS_DC)
+/* {{{ rehash_bucket
+ * Moves the chain of old table bucket i into the current table. Bucket i and
+ * all of its destinations belong to the same stripe, which the caller holds
+ * exclusively. Slots of an older generation are left behind by a clear, and
+ * are removed instead. */
+static void rehash_bucket(apc_cache_t* cache, int i TSRMLS_DC)
 {
-    DESTROY_LOCK(cache->header->lock);
-#if NONBLOCKING_LOCK_AVAILABLE
-    DESTROY_LOCK(cache->header->wrlock);
-#endif
+    cache_header_t* header = cache->header;
+    slot_t** link = &header->old_slots[i];
+    slot_t* p;
 
-	/* XXX this is definitely a leak, but freeing this causes all the apache
-		children to freeze. It might be because the segment is shared between
-		several processes. To figure out is how to free this safely. */
-    /*apc_sma_free(cache->shmaddr TSRMLS_CC);*/
-    apc_efree(cache TSRMLS_CC);
+    while ((p = *link)) {
+        if (p->generation != header->generation) {
+            remove_slot(cache, link TSRMLS_CC);
+            continue;
+        }
+        *link = p->next;
+        link_slot(&header->slots[p->key.h % header->num_slots], p);
+    }
 }
 /* }}} */
 
-/* {{{ apc_cache_clear */
-void apc_cache_clear(apc_cache_t* cache TSRMLS_DC)
+/* {{{ rehash_stripe
+ * Migrates up to budget buckets of the old table that belong to stripe, or
+ * all of them if budget is negative. */
+static void rehash_stripe(apc_cache_t* cache, int stripe, int budget TSRMLS_DC)
 {
-    int i;
+    cache_stripe_t* s = CACHE_STRIPE(cache, stripe);
+    int per_stripe = cache->header->old_num_slots / cache->num_stripes;
 
-    if(!cache) return;
-
-    CACHE_LOCK(cache);
-    cache->header->busy = 1;
-    cache->header->num_hits = 0;
-    cache->header->num_misses = 0;
-    cache->header->start_time = time(NULL);
-    cache->header->expunges = 0;
-
-    for (i = 0; i < cache->num_slots; i++) {
-        slot_t* p = cache->slots[i];
-        while (p) {
-            remove_slot(cache, &p TSRMLS_CC);
-        }
-        cache->slots[i] = NULL;
+    if (s->rehash_pos >= per_stripe) {
+        return;
     }
 
-    memset(&cache->header->lastkey, 0, sizeof(apc_keyid_t));
+    while (s->rehash_pos < per_stripe && budget-- != 0) {
+        rehash_bucket(cache, stripe + s->rehash_pos * cache->num_stripes TSRMLS_CC);
+        s->rehash_pos++;
+    }
 
-    cache->header->busy = 0;
-    CACHE_UNLOCK(cache);
+    if (s->rehash_pos == per_stripe) {
+        CACHE_STAT_ADD(cache, cache->header->rehash_stripes, -1);
+    }
 }
 /* }}} */
 
-/* {{{ apc_cache_expunge */
-static void apc_cache_expunge(apc_cache_t* cache, size_t size TSRMLS_DC)
+/* {{{ rehash_step
+ * Incremental part of a rehash, done by every writer on its own stripe: the
+ * old bucket of the key being written is moved first, so that writers only
+ * ever need to look at the current table. */
+static void rehash_step(apc_cache_t* cache, int stripe, unsigned long h TSRMLS_DC)
 {
-    int i;
-    time_t t;
-
-    t = apc_time();
+    if (!cache->header->old_slots) {
+        return;
+    }
+    rehash_bucket(cache, h % cache->header->old_num_slots TSRMLS_CC);
+    rehash_stripe(cache, stripe, CACHE_REHASH_STEP TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ rehash_release
+ * Frees the old table once every stripe has been migrated. The caller holds
+ * every stripe exclusively. */
+static void rehash_release(apc_cache_t* cache TSRMLS_DC)
+{
+    if (!cache->header->old_slots || cache->header->rehash_stripes) {
+        return;
+    }
+
+#if APC_EPOCH_AVAILABLE
+    if (cache->optimistic_reads) {
+        /* lock-free readers may still be walking the old table */
+        apc_epoch_synchronize(TSRMLS_C);
+    }
+#endif
+    apc_sma_free(cache->header->old_slots TSRMLS_CC);
+    cache->header->old_slots = NULL;
+    cache->header->old_num_slots = 0;
+}
+/* }}} */
+
+/* {{{ rehash_check
+ * Called by writers after they released their stripe: grows the table once
+ * the load factor is exceeded and frees the old table once every stripe has
+ * been migrated. Both need every stripe, so they are kept out of the hot path
+ * by checking the header first. */
+static void rehash_check(apc_cache_t* cache TSRMLS_DC)
+{
+    cache_header_t* header = cache->header;
+    slot_t** slots;
+    int num_slots;
+    int i;
+
+    if (header->old_slots) {
+        if (header->rehash_stripes == 0) {
+            /* the last stripe has been migrated, release the old table */
+            CACHE_LOCK(cache);
+            rehash_release(cache TSRMLS_CC);
+            CACHE_UNLOCK(cache);
+        }
+        return;
+    }
+
+    if (header->num_entries <= header->num_slots * CACHE_MAX_LOAD) {
+        return;
+    }
+
+    if (header->grow_failed && time(NULL) - header->grow_failed < CACHE_GROW_RETRY) {
+        return;
+    }
+
+    /* growing is opportunistic: allocate outside of the locks, and never
+     * expunge entries to make room for a bigger table */
+    num_slots = header->num_slots * 2;
+    slots = (slot_t**) apc_sma_malloc_noexpunge(num_slots*sizeof(slot_t*) TSRMLS_CC);
+
+    if (!slots) {
+        header->grow_failed = time(NULL);
+        return;
+    }
+    memset(slots, 0, num_slots*sizeof(slot_t*));
+
+    CACHE_LOCK(cache);
+    if (!header->old_slots && header->num_slots * 2 == num_slots) {
+        header->old_slots = header->slots;
+        header->old_num_slots = header->num_slots;
+        header->slots = slots;
+        header->num_slots = num_slots;
+        header->rehash_stripes = cache->num_stripes;
+        header->grow_failed = 0;
+        for (i = 0; i < cache->num_stripes; i++) {
+            CACHE_STRIPE(cache, i)->rehash_pos = 0;
+        }
+        slots = NULL;
+    }
+    CACHE_UNLOCK(cache);
+
+    if (slots) {
+        /* somebody else grew the table in the meantime */
+        apc_sma_free(slots TSRMLS_CC);
+    }
+}
+/* }}} */
+
+/* {{{ rehash_drain
+ * Migrates what is left of the old table a stripe at a time, so that the
+ * other stripes stay available, and releases it. The tables clears dropped
+ * are emptied the same way. After a clear this is what reclaims the entries
+ * of the previous generations. The caller holds the expunge lock, which
+ * keeps drains from freeing the same table twice, and no stripe. */
+static void rehash_drain(apc_cache_t* cache TSRMLS_DC)
+{
+    cache_header_t* header = cache->header;
+    cache_stale_table_t* first = header->stale_tables;
+    cache_stale_table_t** link;
+    cache_stale_table_t* table;
+    int i, j;
+
+    if (!header->old_slots && !first) {
+        return;
+    }
+
+    /* a clear may put a newer table in front of first meanwhile, which is
+     * left to the next drain */
+    for (i = 0; i < cache->num_stripes; i++) {
+        CACHE_STRIPE_LOCK(cache, i);
+        if (header->old_slots) {
+            rehash_stripe(cache, i, -1 TSRMLS_CC);
+        }
+        for (table = first; table; table = table->next) {
+            for (j = i; j < table->num_slots; j += cache->num_stripes) {
+                while (table->slots[j]) {
+                    remove_slot(cache, &table->slots[j] TSRMLS_CC);
+                }
+            }
+        }
+        CACHE_STRIPE_UNLOCK(cache, i);
+    }
+    reclaim_removed(cache TSRMLS_CC);
+
+    if ((header->old_slots && header->rehash_stripes == 0) || first) {
+        CACHE_LOCK(cache);
+        rehash_release(cache TSRMLS_CC);
+        for (link = &header->stale_tables; *link && *link != first; link = &(*link)->next);
+        *link = NULL;
+        CACHE_UNLOCK(cache);
+
+#if APC_EPOCH_AVAILABLE
+        if (first && cache->optimistic_reads) {
+            /* lock-free readers may have started on them before the clear */
+            apc_epoch_synchronize(TSRMLS_C);
+        }
+#endif
+        while ((table = first)) {
+            first = table->next;
+            apc_sma_free(table->slots TSRMLS_CC);
+            apc_sma_free(table TSRMLS_CC);
+        }
+    }
+}
+/* }}} */
+
+/* {{{ remove_all_slots
+ * Removes every slot, in the table, the one a rehash is migrating and those
+ * clears dropped, and releases the old table. The tables clears dropped are
+ * left to rehash_drain. The caller holds every stripe. */
+static void remove_all_slots(apc_cache_t* cache TSRMLS_DC)
+{
+    cache_header_t* header = cache->header;
+    cache_stale_table_t* table;
+    int i;
+
+    for (i = 0; i < header->num_slots; i++) {
+        while (header->slots[i]) {
+            remove_slot(cache, &header->slots[i] TSRMLS_CC);
+        }
+    }
+    if (header->old_slots) {
+        for (i = 0; i < header->old_num_slots; i++) {
+            while (header->old_slots[i]) {
+                remove_slot(cache, &header->old_slots[i] TSRMLS_CC);
+            }
+        }
+        for (i = 0; i < cache->num_stripes; i++) {
+            CACHE_STRIPE(cache, i)->rehash_pos = header->old_num_slots / cache->num_stripes;
+        }
+        header->rehash_stripes = 0;
+        rehash_release(cache TSRMLS_CC);
+    }
+    for (table = header->stale_tables; table; table = table->next) {
+        for (i = 0; i < table->num_slots; i++) {
+            while (table->slots[i]) {
+                remove_slot(cache, &table->slots[i] TSRMLS_CC);
+            }
+        }
+    }
+    reclaim_removed(cache TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ dir_lock_slot
+ * Locks the stripe of the entry at directory id, and returns the entry's
+ * slot, or NULL and no lock if the id is unused. While the stripe is held the
+ * slot can't go away. With locked set the caller holds every stripe already. */
+static slot_t* dir_lock_slot(apc_cache_t* cache, unsigned int id, int* stripe, int locked TSRMLS_DC)
+{
+    cache_dir_chunk_t* chunk = CACHE_DIR_CHUNK(cache, id);
+    unsigned int pos = CACHE_DIR_POS(id);
+    slot_t* slot;
+
+    if (locked) {
+        return chunk->slot[pos];
+    }
+    if (!chunk->slot[pos]) {
+        return NULL;
+    }
+
+    *stripe = CACHE_STRIPE_OF(cache, chunk->h[pos]);
+    CACHE_STRIPE_LOCK(cache, *stripe);
+    /* the id may have gone to an entry of another stripe in the meantime,
+     * the hash is filled in before the slot */
+    slot = chunk->slot[pos];
+    if (slot && CACHE_STRIPE_OF(cache, chunk->h[pos]) == *stripe) {
+        return slot;
+    }
+    CACHE_STRIPE_UNLOCK(cache, *stripe);
+
+    return NULL;
+}
+/* }}} */
+
+/* {{{ dir_unlock_slot */
+static inline void dir_unlock_slot(apc_cache_t* cache, int stripe, int locked TSRMLS_DC)
+{
+    if (!locked) {
+        CACHE_STRIPE_UNLOCK(cache, stripe);
+    }
+}
+/* }}} */
+
+/* {{{ slot_link
+ * The link to a slot found through the directory, or NULL. The caller holds
+ * the slot's stripe; while a rehash is in progress the slot may still be in
+ * the old table. */
+static slot_t** slot_link(apc_cache_t* cache, slot_t* slot)
+{
+    cache_header_t* header = cache->header;
+    cache_stale_table_t* table;
+    slot_t** p = &header->slots[slot->key.h % header->num_slots];
+
+    while (*p && *p != slot) {
+        p = &(*p)->next;
+    }
+    if (!*p && header->old_slots) {
+        p = &header->old_slots[slot->key.h % header->old_num_slots];
+        while (*p && *p != slot) {
+            p = &(*p)->next;
+        }
+    }
+    for (table = header->stale_tables; !*p && table; table = table->next) {
+        p = &table->slots[slot->key.h % table->num_slots];
+        while (*p && *p != slot) {
+            p = &(*p)->next;
+        }
+    }
+
+    return *p ? p : NULL;
+}
+/* }}} */
+
+/* {{{ unlink_slot
+ * Removes a slot found through the directory, and returns its size. The
+ * caller holds the slot's stripe. */
+static size_t unlink_slot(apc_cache_t* cache, slot_t* slot TSRMLS_DC)
+{
+    slot_t** p = slot_link(cache, slot);
+    size_t size = slot->value->mem_size;
+
+    if (!p) {
+        return 0;
+    }
+    remove_slot(cache, p TSRMLS_CC);
+
+    return size;
+}
+/* }}} */
+
+/* {{{ dir_expire
+ * Removes the entry at directory id if it has expired, and returns its size,
+ * or 0. */
+static size_t dir_expire(apc_cache_t* cache, unsigned int id, time_t t, int locked TSRMLS_DC)
+{
+    slot_t* slot;
+    size_t size = 0;
+    int stripe;
+
+    if ((slot = dir_lock_slot(cache, id, &stripe, locked TSRMLS_CC))) {
+        if (dir_expired(cache, CACHE_DIR_CHUNK(cache, id), CACHE_DIR_POS(id), t)) {
+            size = unlink_slot(cache, slot TSRMLS_CC);
+        }
+        dir_unlock_slot(cache, stripe, locked TSRMLS_CC);
+    }
+
+    return size;
+}
+/* }}} */
+
+/* {{{ wheel_tick
+ * Expiry in small steps, for writers that don't hold a stripe yet: removes
+ * what the timer wheel has due, at most CACHE_WHEEL_BATCH entries, once a
+ * second. */
+static void wheel_tick(apc_cache_t* cache, time_t t TSRMLS_DC)
+{
+    unsigned int ids[CACHE_WHEEL_BATCH];
+    int i, n;
+
+    if (cache->header->wheel_time > t) {
+        return;
+    }
+    n = wheel_collect(cache, t, ids TSRMLS_CC);
+    for (i = 0; i < n; i++) {
+        dir_expire(cache, ids[i], t, 0 TSRMLS_CC);
+    }
+}
+/* }}} */
+
+/* {{{ wheel_drain
+ * Removes everything the timer wheel has due, and returns the memory that
+ * is released. */
+static size_t wheel_drain(apc_cache_t* cache, time_t t, int locked TSRMLS_DC)
+{
+    unsigned int ids[CACHE_WHEEL_BATCH];
+    size_t freed = 0;
+    int i, n;
+
+    do {
+        n = wheel_collect(cache, t, ids TSRMLS_CC);
+        for (i = 0; i < n; i++) {
+            freed += dir_expire(cache, ids[i], t, locked TSRMLS_CC);
+        }
+    } while (n == CACHE_WHEEL_BATCH);
+    reclaim_removed(cache TSRMLS_CC);
+
+    return freed;
+}
+/* }}} */
+
+/* {{{ index_rebuild
+ * (Re)builds the index of a stripe from its chains, sized for twice the
+ * entries the stripe holds. The caller holds the stripe exclusively. If the
+ * memory can't be had the stripe goes without an index, and lookups walk its
+ * chains, until a later insert manages to rebuild it. */
+static void index_rebuild(apc_cache_t* cache, int stripe TSRMLS_DC)
+{
+    cache_header_t* header = cache->header;
+    apc_index_t* idx = &CACHE_STRIPE(cache, stripe)->index;
+    apc_index_group_t* groups;
+    unsigned int num_groups = 1;
+    int count = 0;
+    int i, pass, n;
+    slot_t** table;
+    slot_t* p;
+
+    if (!idx->groups && idx->failed && time(NULL) - idx->failed < CACHE_GROW_RETRY) {
+        return;
+    }
+
+    /* the buckets of a stripe are the same in both tables during a rehash */
+    for (pass = 0; pass < 2; pass++) {
+        table = pass ? header->old_slots : header->slots;
+        n = pass ? header->old_num_slots : header->num_slots;
+        for (i = stripe; table && i < n; i += cache->num_stripes) {
+            for (p = table[i]; p; p = p->next) {
+                count += p->generation == header->generation;
+            }
+        }
+    }
+
+    while (num_groups * APC_INDEX_GROUP_SIZE < (unsigned int)count * 2) {
+        num_groups <<= 1;
+    }
+
+    if (idx->groups) {
+        groups = idx->groups;
+        idx->groups = NULL;
+#if APC_EPOCH_AVAILABLE
+        if (cache->optimistic_reads) {
+            apc_epoch_synchronize(TSRMLS_C);
+        }
+#endif
+        apc_sma_free(groups TSRMLS_CC);
+    }
+
+    groups = (apc_index_group_t*) apc_sma_malloc_noexpunge(num_groups * sizeof(apc_index_group_t) TSRMLS_CC);
+    if (!groups) {
+        idx->failed = time(NULL);
+        return;
+    }
+    idx->failed = 0;
+    apc_index_init(idx, groups, num_groups);
+
+    for (pass = 0; pass < 2; pass++) {
+        table = pass ? header->old_slots : header->slots;
+        n = pass ? header->old_num_slots : header->num_slots;
+        for (i = stripe; table && i < n; i += cache->num_stripes) {
+            for (p = table[i]; p; p = p->next) {
+                if (p->generation == header->generation) {
+                    apc_index_insert(idx, p->key.h, p);
+                }
+            }
+        }
+    }
+}
+/* }}} */
+
+/* {{{ index_add
+ * Adds a slot that was just linked into its chain to the index of its stripe. */
+static void index_add(apc_cache_t* cache, int stripe, slot_t* slot TSRMLS_DC)
+{
+    apc_index_t* idx = &CACHE_STRIPE(cache, stripe)->index;
+
+    if (!idx->groups || APC_INDEX_FULL(idx)) {
+        /* picks up the new slot from its chain */
+        index_rebuild(cache, stripe TSRMLS_CC);
+        return;
+    }
+    apc_index_insert(idx, slot->key.h, slot);
+}
+/* }}} */
+
+/* {{{ prevent_garbage_collection */
+static void prevent_garbage_collection(apc_cache_entry_t* entry)
+{
+    /* set reference counts on zend objects to an arbitrarily high value to
+     * prevent garbage collection after execution */
+
+    enum { BIG_VALUE = 1000 };
+
+    /* after the first hit the values are already there, and reading them
+     * keeps the cache lines shared between the processes */
+    if(entry->data.file.op_array && entry->data.file.op_array->refcount[0] != BIG_VALUE) {
+        entry->data.file.op_array->refcount[0] = BIG_VALUE;
+    }
+    if (entry->data.file.functions) {
+        int i;
+        apc_function_t* fns = entry->data.file.functions;
+        for (i=0; fns[i].function != NULL; i++) {
+            if (*(fns[i].function->op_array.refcount) != BIG_VALUE) {
+                *(fns[i].function->op_array.refcount) = BIG_VALUE;
+            }
+        }
+    }
+    if (entry->data.file.classes) {
+        int i;
+        apc_class_t* classes = entry->data.file.classes;
+        for (i=0; classes[i].class_entry != NULL; i++) {
+            if (classes[i].class_entry->refcount != BIG_VALUE) {
+                classes[i].class_entry->refcount = BIG_VALUE;
+            }
+        }
+    }
+}
+/* }}} */
+
+/* {{{ touch_slot
+ * Records a hit on a slot. In write-free mode only every CACHE_HIT_SAMPLE-th
+ * hit of the process updates the slot's hit count, by CACHE_HIT_SAMPLE. The
+ * access time has a resolution of a second, and is only written when the
+ * second has changed. */
+static inline void touch_slot(apc_cache_t* cache, slot_t* slot, time_t t TSRMLS_DC)
+{
+    if (!cache->write_free_hits) {
+        CACHE_SAFE_INC(cache, slot->num_hits);
+    } else if (++cache->hit_tick % CACHE_HIT_SAMPLE == 0) {
+        CACHE_STAT_ADD(cache, slot->num_hits, CACHE_HIT_SAMPLE);
+    }
+    if (SLOT_ACCESS_TIME(cache, slot) != t) {
+        SLOT_ACCESS_TIME(cache, slot) = t;
+    }
+    if (!SLOT_REFERENCED(cache, slot)) {
+        SLOT_REFERENCED(cache, slot) = 1;
+    }
+}
+/* }}} */
+
+/* {{{ hold_entry
+ * Keeps the entry of a hit alive until apc_cache_release. In write-free mode
+ * the worker's epoch pin for the cache does, without writing to the entry. */
+static inline void hold_entry(apc_cache_t* cache, apc_cache_entry_t* entry TSRMLS_DC)
+{
+#if APC_EPOCH_AVAILABLE
+    if (cache->write_free_hits && cache->optimistic_reads && apc_epoch_pin(cache->epoch_pin TSRMLS_CC)) {
+        return;
+    }
+#endif
+    CACHE_SAFE_INC(cache, entry->ref_count);
+}
+/* }}} */
+
+/* {{{ count_lookup
+ * In write-free mode the process counts hits and misses itself, and adds
+ * them to the header once CACHE_LOCAL_BATCH have piled up, when the request
+ * ends or when the statistics are read. */
+static inline void count_lookup(apc_cache_t* cache, int hit TSRMLS_DC)
+{
+    if (!cache->write_free_hits) {
+        if (hit) {
+            CACHE_STAT_INC(cache, CACHE_MY_STATS(cache)->num_hits);
+        } else {
+            CACHE_STAT_INC(cache, CACHE_MY_STATS(cache)->num_misses);
+        }
+        return;
+    }
+
+    if (hit) {
+        cache->local_hits++;
+    } else {
+        cache->local_misses++;
+    }
+    if (cache->local_hits + cache->local_misses >= CACHE_LOCAL_BATCH) {
+        apc_cache_flush_stats(cache TSRMLS_CC);
+    }
+}
+/* }}} */
+
+/* {{{ count_user_lookup
+ * count_lookup for a user key with hash h, which also feeds the admission
+ * sketch. The sketch only sees a random sample of the lookups, and in
+ * write-free mode only the misses, so that hits don't write to it. */
+static inline void count_user_lookup(apc_cache_t* cache, unsigned long h, int hit TSRMLS_DC)
+{
+    count_lookup(cache, hit TSRMLS_CC);
+
+    if (!cache->sketch || (hit && cache->write_free_hits)) {
+        return;
+    }
+    cache->sketch_seed = cache->sketch_seed * 1103515245 + 12345;
+    if ((cache->sketch_seed >> 16) % CACHE_SKETCH_SAMPLE == 0) {
+        apc_sketch_add(cache->sketch, h);
+    }
+}
+/* }}} */
+
+/* {{{ apc_cache_flush_stats */
+void apc_cache_flush_stats(apc_cache_t* cache TSRMLS_DC)
+{
+    unsigned long n;
+
+    if (!cache) {
+        return;
+    }
+    if ((n = cache->local_hits)) {
+        cache->local_hits = 0;
+        CACHE_STAT_ADD(cache, CACHE_MY_STATS(cache)->num_hits, n);
+    }
+    if ((n = cache->local_misses)) {
+        cache->local_misses = 0;
+        CACHE_STAT_ADD(cache, CACHE_MY_STATS(cache)->num_misses, n);
+    }
+}
+/* }}} */
+
+/* {{{ apc_cache_stats_activate
+ * Picks the stats shard of the worker, at request startup so that forked
+ * workers spread out. */
+void apc_cache_stats_activate(TSRMLS_D)
+{
+#ifdef ZTS
+    APCG(stats_shard) = (int)(hash_mix((unsigned long)tsrm_thread_id()) % CACHE_STATS_SHARDS);
+#else
+    APCG(stats_shard) = (int)(hash_mix((unsigned long)getpid()) % CACHE_STATS_SHARDS);
+#endif
+}
+/* }}} */
+
+/* {{{ reset_stats */
+static void reset_stats(apc_cache_t* cache)
+{
+    int i;
+
+    for (i = 0; i < CACHE_STATS_SHARDS; i++) {
+        CACHE_STATS(cache, i)->num_hits = 0;
+        CACHE_STATS(cache, i)->num_misses = 0;
+        CACHE_STATS(cache, i)->expunges = 0;
+        CACHE_STATS(cache, i)->compacted = 0;
+    }
+}
+/* }}} */
+
+/* {{{ sum_stats */
+static void sum_stats(apc_cache_t* cache, cache_stats_t* sum)
+{
+    int i;
+
+    memset(sum, 0, sizeof(cache_stats_t));
+    for (i = 0; i < CACHE_STATS_SHARDS; i++) {
+        sum->num_hits += CACHE_STATS(cache, i)->num_hits;
+        sum->num_misses += CACHE_STATS(cache, i)->num_misses;
+        sum->num_inserts += CACHE_STATS(cache, i)->num_inserts;
+        sum->expunges += CACHE_STATS(cache, i)->expunges;
+        sum->compacted += CACHE_STATS(cache, i)->compacted;
+    }
+}
+/* }}} */
+
+/* {{{ apc_cache_create */
+apc_cache_t* apc_cache_create(int size_hint, int gc_ttl, int ttl, int num_stripes TSRMLS_DC)
+{
+    apc_cache_t* cache;
+    int cache_size;
+    int num_slots;
+    int i;
+
+    if (num_stripes < 1) {
+        num_stripes = 1;
+    } else if (num_stripes > CACHE_MAX_STRIPES) {
+        num_stripes = CACHE_MAX_STRIPES;
+    }
+
+    num_slots = make_prime(size_hint > 0 ? size_hint : 2000);
+
+    /* round up so that slot i always belongs to stripe (i % num_stripes), and
+     * therefore a key's stripe only depends on its hash */
+    num_slots = ((num_slots + num_stripes - 1) / num_stripes) * num_stripes;
+
+    cache = (apc_cache_t*) apc_emalloc(sizeof(apc_cache_t) TSRMLS_CC);
+    cache_size = sizeof(cache_header_t) + CACHE_LINE_SIZE + num_stripes*CACHE_STRIPE_SIZE + CACHE_STATS_SHARDS*CACHE_STATS_SIZE;
+
+    cache->shmaddr = apc_sma_malloc(cache_size TSRMLS_CC);
+    if(!cache->shmaddr) {
+        apc_error("Unable to allocate shared memory for cache structures.  (Perhaps your shared memory size isn't large enough?). " TSRMLS_CC);
+        return NULL;
+    }
+    memset(cache->shmaddr, 0, cache_size);
+
+    cache->header = (cache_header_t*) cache->shmaddr;
+
+    /* the table lives in its own block, so that it can be replaced when it grows */
+    cache->header->slots = (slot_t**) apc_sma_malloc(num_slots*sizeof(slot_t*) TSRMLS_CC);
+    if(!cache->header->slots) {
+        apc_error("Unable to allocate shared memory for cache structures.  (Perhaps your shared memory size isn't large enough?). " TSRMLS_CC);
+        return NULL;
+    }
+    memset(cache->header->slots, 0, sizeof(slot_t*)*num_slots);
+    cache->header->num_slots = num_slots;
+    cache->header->old_slots = NULL;
+    cache->header->stale_tables = NULL;
+
+    /* every entry takes at least a slot_t of shared memory, which bounds the
+     * number of directory chunks that can ever be needed */
+    cache->header->dir_max_chunks = apc_sma_get_avail_mem() / sizeof(slot_t) / CACHE_DIR_CHUNK_SIZE + 1;
+    cache->header->dir = (cache_dir_chunk_t**) apc_sma_malloc(cache->header->dir_max_chunks*sizeof(cache_dir_chunk_t*) TSRMLS_CC);
+    if(!cache->header->dir) {
+        apc_error("Unable to allocate shared memory for cache structures.  (Perhaps your shared memory size isn't large enough?). " TSRMLS_CC);
+        return NULL;
+    }
+    cache->header->dir_chunks = 0;
+    cache->header->dir_free = CACHE_DIR_NONE;
+    memset(cache->header->wheel, 0xff, sizeof(cache->header->wheel));
+    cache->header->wheel_time = time(NULL);
+    cache->header->wheel_count = 0;
+
+    cache->header->deleted_list = NULL;
+    cache->header->start_time = time(NULL);
+    cache->header->busy = 0;
+
+    /* the stripes start on a cache line boundary, the stats shards follow */
+    cache->stripes = (cache_stripe_t*) ((((size_t) cache->shmaddr) + sizeof(cache_header_t) + CACHE_LINE_SIZE - 1) & ~((size_t) CACHE_LINE_SIZE - 1));
+    cache->stats = (cache_stats_t*) (((char*) cache->stripes) + num_stripes*CACHE_STRIPE_SIZE);
+    cache->num_stripes = num_stripes;
+    cache->use_index = 0;
+    cache->optimistic_reads = 0;
+    cache->epoch_pin = 0;
+    cache->sketch = NULL;
+    cache->bloom = NULL;
+    cache->leases = NULL;
+    cache->write_free_hits = 0;
+    cache->janitor = 0;
+    cache->local_hits = 0;
+    cache->local_misses = 0;
+    cache->hit_tick = 0;
+    cache->sketch_seed = 0;
+    cache->gc_ttl = gc_ttl;
+    cache->ttl = ttl;
+    CREATE_LOCK(cache->header->lock);
+    CREATE_LOCK(cache->header->expunge_lock);
+#if NONBLOCKING_LOCK_AVAILABLE
+    CREATE_LOCK(cache->header->wrlock);
+#endif
+    for (i = 0; i < num_stripes; i++) {
+        CREATE_LOCK(CACHE_STRIPE(cache, i)->lock);
+    }
+    cache->expunge_cb = apc_cache_expunge;
+    cache->has_lock = 0;
+
+    return cache;
+}
+/* }}} */
+
+/* {{{ apc_cache_destroy */
+void apc_cache_destroy(apc_cache_t* cache TSRMLS_DC)
+{
+    int i;
+
+    for (i = 0; i < cache->num_stripes; i++) {
+        DESTROY_LOCK(CACHE_STRIPE(cache, i)->lock);
+    }
+    DESTROY_LOCK(cache->header->lock);
+    DESTROY_LOCK(cache->header->expunge_lock);
+    if (cache->leases) {
+        apc_lease_destroy(cache->leases TSRMLS_CC);
+    }
+#if NONBLOCKING_LOCK_AVAILABLE
+    DESTROY_LOCK(cache->header->wrlock);
+#endif
+
+	/* XXX this is definitely a leak, but freeing this causes all the apache
+		children to freeze. It might be because the segment is shared between
+		several processes. To figure out is how to free this safely. */
+    /*apc_sma_free(cache->shmaddr TSRMLS_CC);*/
+    apc_efree(cache TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ apc_cache_clear
+ * Doesn't touch the entries: the cache moves on to a new generation and an
+ * empty table, and the old table is left to the rehash, which removes the
+ * slots of older generations instead of migrating them. A table that a rehash
+ * was still migrating isn't migrated first, it goes to the stale tables that
+ * rehash_drain empties. The stripes are only held for a moment, and lookups
+ * never find the cache busy. Only if there is no memory for the new table is
+ * every slot removed under the locks. */
+void apc_cache_clear(apc_cache_t* cache TSRMLS_DC)
+{
+    cache_header_t* header;
+    apc_index_group_t* groups[CACHE_MAX_STRIPES];
+    cache_stale_table_t* stale;
+    slot_t** slots;
+    int num_slots;
+    int i, n = 0;
 
     if(!cache) return;
 
-    if(!cache->ttl) {
-        /*
-         * If cache->ttl is not set, we wipe out the entire cache when
-         * we run out of space.
-         */
-        CACHE_SAFE_LOCK(cache);
-        process_pending_removals(cache TSRMLS_CC);
-        if (apc_sma_get_avail_mem() > (size_t)(APCG(shm_size)/2)) {
-            /* probably a queued up expunge, we don't need to do this */
-            CACHE_SAFE_UNLOCK(cache);
-            return;
-        }
-        cache->header->busy = 1;
-        CACHE_FAST_INC(cache, cache->header->expunges);
-clear_all:
-        for (i = 0; i < cache->num_slots; i++) {
-            slot_t* p = cache->slots[i];
-            while (p) {
-                remove_slot(cache, &p TSRMLS_CC);
+    header = cache->header;
+
+    /* like a grow, the table is allocated outside of the locks and without
+     * expunging */
+    num_slots = header->num_slots;
+    slots = (slot_t**) apc_sma_malloc_noexpunge(num_slots*sizeof(slot_t*) TSRMLS_CC);
+    if (slots) {
+        memset(slots, 0, num_slots*sizeof(slot_t*));
+    }
+    stale = (cache_stale_table_t*) apc_sma_malloc_noexpunge(sizeof(cache_stale_table_t) TSRMLS_CC);
+
+    CACHE_LOCK(cache);
+    reset_stats(cache);
+    header->start_time = time(NULL);
+
+    /* a table that has been migrated entirely can go right away */
+    rehash_release(cache TSRMLS_CC);
+
+    if (slots && header->num_slots == num_slots && (stale || !header->old_slots)) {
+        if (header->old_slots) {
+            stale->slots = header->old_slots;
+            stale->num_slots = header->old_num_slots;
+            stale->next = header->stale_tables;
+            header->stale_tables = stale;
+            stale = NULL;
+        }
+        header->generation++;
+        header->stale_entries += header->num_entries;
+        header->stale_size += header->mem_size;
+        header->num_entries = 0;
+        header->mem_size = 0;
+        header->old_slots = header->slots;
+        header->old_num_slots = num_slots;
+        header->slots = slots;
+        header->rehash_stripes = cache->num_stripes;
+        for (i = 0; i < cache->num_stripes; i++) {
+            cache_stripe_t* s = CACHE_STRIPE(cache, i);
+            s->rehash_pos = 0;
+            /* everything the index holds is stale, the next insert rebuilds it */
+            if (s->index.groups) {
+                groups[n++] = s->index.groups;
+                s->index.groups = NULL;
             }
-            cache->slots[i] = NULL;
+            s->index.failed = 0;
         }
-        memset(&cache->header->lastkey, 0, sizeof(apc_keyid_t));
-        cache->header->busy = 0;
-        CACHE_SAFE_UNLOCK(cache);
+        slots = NULL;
     } else {
-        slot_t **p;
-        /*
-         * If the ttl for the cache is set we walk through and delete stale 
-         * entries.  For the user cache that is slightly confusing since
-         * we have the individual entry ttl's we can look at, but that would be
-         * too much work.  So if you want the user cache expunged, set a high
-         * default apc.user_ttl and still provide a specific ttl for each entry
-         * on insert
-         */
+        header->busy = 1;
+        remove_all_slots(cache TSRMLS_CC);
+        header->busy = 0;
+    }
+
+    CACHE_UNLOCK(cache);
+
+    if (slots) {
+        apc_sma_free(slots TSRMLS_CC);
+    }
+    if (stale) {
+        apc_sma_free(stale TSRMLS_CC);
+    }
+    if (n) {
+#if APC_EPOCH_AVAILABLE
+        if (cache->optimistic_reads) {
+            /* lock-free readers may still be probing the indexes */
+            apc_epoch_synchronize(TSRMLS_C);
+        }
+#endif
+        for (i = 0; i < n; i++) {
+            apc_sma_free(groups[i] TSRMLS_CC);
+        }
+    }
+}
+/* }}} */
+
+/* {{{ gdsf_priority
+ * GreedyDual-Size-Frequency: what it costs to rebuild the entry per byte it
+ * takes, times its hits, on top of the inflation at the time it was last
+ * used. Low priorities go first. */
+static inline double gdsf_priority(cache_dir_chunk_t* chunk, int pos, slot_t* slot)
+{
+    double cost = slot->value->data.file.cost ? slot->value->data.file.cost : 1;
+
+    return chunk->base[pos] + (slot->num_hits + 1) * cost / (slot->value->mem_size + 1);
+}
+/* }}} */
+
+/* {{{ clock_evict
+ * Second chance replacement for caches without a ttl. The hand walks the
+ * directory: an entry hit since the hand last passed gets another round, one
+ * that has expired or that nobody uses goes. File entries that nobody uses
+ * are collected CACHE_GDSF_SAMPLE at a time, and the one with the lowest
+ * gdsf_priority goes. Stops as soon as size bytes are available again, or
+ * after two rounds. Entries are looked at under their own stripe. */
+static int clock_evict(apc_cache_t* cache, size_t size, time_t t, int locked TSRMLS_DC)
+{
+    cache_header_t* header = cache->header;
+    cache_dir_chunk_t* chunk;
+    slot_t* slot;
+    unsigned int n = header->dir_chunks * CACHE_DIR_CHUNK_SIZE;
+    unsigned int id, pos, visited;
+    unsigned int victim = CACHE_DIR_NONE, sampled = 0;
+    double prio, victim_prio = 0;
+    size_t freed = 0;
+    int stripe;
+
+    for (visited = 0; visited < 2 * n; visited++) {
+        id = header->clock_hand % n;
+        header->clock_hand = id + 1;
+
+        chunk = CACHE_DIR_CHUNK(cache, id);
+        pos = CACHE_DIR_POS(id);
+        if (!chunk->slot[pos]) {
+            continue;
+        }
+        if (chunk->referenced[pos] && !(chunk->expires[pos] && chunk->expires[pos] < t)) {
+            /* the hits since the last round count as a use */
+            chunk->referenced[pos] = 0;
+            chunk->base[pos] = header->inflation;
+            continue;
+        }
+        if (!(slot = dir_lock_slot(cache, id, &stripe, locked TSRMLS_CC))) {
+            continue;
+        }
+        if (!(chunk->expires[pos] && chunk->expires[pos] < t)) {
+            if (slot->value->ref_count > 0) {
+                dir_unlock_slot(cache, stripe, locked TSRMLS_CC);
+                continue;
+            }
+            if (chunk->type[pos] == APC_CACHE_ENTRY_FILE) {
+                prio = gdsf_priority(chunk, pos, slot);
+                dir_unlock_slot(cache, stripe, locked TSRMLS_CC);
+                if (victim == CACHE_DIR_NONE || prio < victim_prio) {
+                    victim = id;
+                    victim_prio = prio;
+                }
+                if (++sampled < CACHE_GDSF_SAMPLE) {
+                    continue;
+                }
+                if (victim_prio > header->inflation) {
+                    header->inflation = victim_prio;
+                }
+                id = victim;
+                victim = CACHE_DIR_NONE;
+                sampled = 0;
+                if (!(slot = dir_lock_slot(cache, id, &stripe, locked TSRMLS_CC))) {
+                    continue;
+                }
+                if (slot->value->ref_count > 0) {
+                    dir_unlock_slot(cache, stripe, locked TSRMLS_CC);
+                    continue;
+                }
+            }
+        }
+
+        freed += unlink_slot(cache, slot TSRMLS_CC);
+        dir_unlock_slot(cache, stripe, locked TSRMLS_CC);
+
+        /* removed entries may only be freed once readers have moved on */
+        if (freed >= size) {
+            reclaim_removed(cache TSRMLS_CC);
+            if (apc_sma_get_avail_size(size)) {
+                return 1;
+            }
+            freed = 0;
+        }
+    }
+    if (victim != CACHE_DIR_NONE && (slot = dir_lock_slot(cache, victim, &stripe, locked TSRMLS_CC))) {
+        if (slot->value->ref_count <= 0) {
+            unlink_slot(cache, slot TSRMLS_CC);
+        }
+        dir_unlock_slot(cache, stripe, locked TSRMLS_CC);
+    }
+    reclaim_removed(cache TSRMLS_CC);
+
+    return apc_sma_get_avail_size(size);
+}
+/* }}} */
+
+/* {{{ sweep_expired
+ * The expunge of caches with a ttl: walks the directory from where the last
+ * sweep stopped, removing stale entries until size bytes are available
+ * again, for at most a round. For the user cache that is slightly confusing
+ * since we have the individual entry ttl's we can look at, but those are in
+ * the timer wheel. So if you want the user cache expunged, set a high
+ * default apc.user_ttl and still provide a specific ttl for each entry on
+ * insert. The expiry data is laid out sequentially, and only the entries
+ * that go are dereferenced. */
+static int sweep_expired(apc_cache_t* cache, size_t size, time_t t, int locked TSRMLS_DC)
+{
+    cache_header_t* header = cache->header;
+    cache_dir_chunk_t* chunk;
+    unsigned int n = header->dir_chunks * CACHE_DIR_CHUNK_SIZE;
+    unsigned int id, pos, visited;
+    size_t freed = 0;
+
+    for (visited = 0; visited < n; visited++) {
+        id = header->sweep_pos % n;
+        header->sweep_pos = id + 1;
+
+        chunk = CACHE_DIR_CHUNK(cache, id);
+        pos = CACHE_DIR_POS(id);
+        if (!chunk->slot[pos] || !dir_expired(cache, chunk, pos, t)) {
+            continue;
+        }
+        freed += dir_expire(cache, id, t, locked TSRMLS_CC);
+
+        if (freed >= size) {
+            reclaim_removed(cache TSRMLS_CC);
+            if (apc_sma_get_avail_size(size)) {
+                return 1;
+            }
+            freed = 0;
+        }
+    }
+    reclaim_removed(cache TSRMLS_CC);
+
+    return apc_sma_get_avail_size(size);
+}
+/* }}} */
+
+/* {{{ sketch_age
+ * Halves up to max counters of the admission sketch if that is due, under
+ * the header lock. Returns nonzero if there are more to halve. */
+static int sketch_age(apc_cache_t* cache, unsigned int max TSRMLS_DC)
+{
+    int more;
+
+    if (!cache->sketch || !APC_SKETCH_AGING_DUE(cache->sketch)) {
+        return 0;
+    }
+    CACHE_HEADER_LOCK(cache);
+    more = apc_sketch_age(cache->sketch, max);
+    CACHE_HEADER_UNLOCK(cache);
+
+    return more;
+}
+/* }}} */
+
+/* {{{ apc_cache_maintain
+ * A round of the janitor: frees the deleted list, reclaims what a clear left
+ * behind, removes whatever the timer wheel has due and ages the admission
+ * sketch. If less than keep_free bytes are available then, it evicts a
+ * CACHE_MAINTAIN_STEP at a time like an expunge would, but it never wipes
+ * the cache. */
+void apc_cache_maintain(apc_cache_t* cache, size_t keep_free TSRMLS_DC)
+{
+    time_t t = time(0);
+    int entries;
+
+    cache->header->janitor_time = t;
+    process_pending_removals(cache TSRMLS_CC);
+    if (cache->header->old_slots || cache->header->stale_tables) {
+        LOCK(cache->header->expunge_lock);
+        rehash_drain(cache TSRMLS_CC);
+        UNLOCK(cache->header->expunge_lock);
+    }
+    wheel_drain(cache, t, 0 TSRMLS_CC);
+    while (sketch_age(cache, CACHE_SKETCH_AGE_STEP TSRMLS_CC));
+
+    if (apc_sma_get_avail_mem() >= keep_free) {
+        return;
+    }
+
+    LOCK(cache->header->expunge_lock);
+    do {
+        entries = cache->header->num_entries;
+        if (!(cache->ttl ? sweep_expired(cache, CACHE_MAINTAIN_STEP, t, 0 TSRMLS_CC)
+                         : clock_evict(cache, CACHE_MAINTAIN_STEP, t, 0 TSRMLS_CC))) {
+            break;
+        }
+    } while (apc_sma_get_avail_mem() < keep_free && cache->header->num_entries < entries);
+    UNLOCK(cache->header->expunge_lock);
+}
+/* }}} */
+
+/* {{{ compact_slot
+ * Moves the user entry at directory id, if nobody holds it, into memory below
+ * its pool, so that the free blocks around the old copy can merge. The value
+ * is copied under the entry's stripe, so no update is lost, and the copy
+ * takes over the place of the old slot in its chain, the index and the
+ * directory, keeping its id, hits and times. The old slot goes like a
+ * removed one. Returns the bytes moved, 0 if the entry stays. */
+static size_t compact_slot(apc_cache_t* cache, unsigned int id TSRMLS_DC)
+{
+    apc_cache_entry_t* old;
+    apc_cache_entry_t* entry;
+    apc_cache_key_t key;
+    apc_context_t ctxt = {0,};
+    slot_t* dead;
+    slot_t* slot;
+    slot_t** link;
+    size_t moved = 0;
+    int stripe;
+
+    if (!(dead = dir_lock_slot(cache, id, &stripe, 0 TSRMLS_CC))) {
+        return 0;
+    }
+    old = dead->value;
+    if (old->type != APC_CACHE_ENTRY_USER || old->ref_count > 0 || dead->generation != cache->header->generation
+        || !(link = slot_link(cache, dead))) {
+        goto done;
+    }
+    if (Z_TYPE_P(old->data.user.val) == IS_ARRAY && !APCG(serializer) && APCG(serializer_name)
+        && strcmp(APCG(serializer_name), "default")) {
+        /* a serializer registered after the process started: whether the
+         * array is serialized can't be told */
+        goto done;
+    }
+
+    /* the pool is the first block of the entry */
+    ctxt.pool = apc_pool_create_ctx(APC_SMALL_POOL, apc_sma_malloc_below, old->pool, apc_sma_free, apc_sma_protect, apc_sma_unprotect TSRMLS_CC);
+    if (!ctxt.pool) {
+        goto done;
+    }
+    ctxt.copy = APC_COPY_MOVE_USER;
+    key = dead->key;
+    if (!(entry = apc_cache_make_user_entry(old->data.user.info, old->data.user.info_len, old->data.user.val, &ctxt, old->data.user.ttl TSRMLS_CC))
+        || !(slot = make_slot(&key, entry TSRMLS_CC))) {
+        apc_pool_destroy(ctxt.pool TSRMLS_CC);
+        goto done;
+    }
+    entry->data.user.grace = old->data.user.grace;
+    entry->data.user.cost = old->data.user.cost;
+    entry->data.user.beta = old->data.user.beta;
+    entry->mem_size = ctxt.pool->size;
+    slot->num_hits = dead->num_hits;
+    slot->id = dead->id;
+    slot->generation = dead->generation;
+
+    /* readers still on the old slot go on from there */
+    slot->next = dead->next;
+#if APC_EPOCH_AVAILABLE
+    APC_WMB();
+#endif
+    *link = slot;
+    CACHE_DIR_CHUNK(cache, id)->slot[CACHE_DIR_POS(id)] = slot;
+    if (cache->use_index) {
+        apc_index_t* idx = &CACHE_STRIPE(cache, stripe)->index;
+        if (idx->groups) {
+            apc_index_replace(idx, key.h, dead, slot);
+        }
+    }
+    CACHE_STAT_ADD(cache, cache->header->mem_size, entry->mem_size - old->mem_size);
+
+    moved = old->mem_size;
+    dead->moved = 1;
+    dispose_slot(cache, dead TSRMLS_CC);
+
+done:
+    dir_unlock_slot(cache, stripe, 0 TSRMLS_CC);
+
+    return moved;
+}
+/* }}} */
+
+/* {{{ apc_cache_compact
+ * A round of compaction: while the free memory is fragmented, moves up to
+ * budget user entries down their segment, walking the directory from where
+ * the last round stopped. What else lives in the segments can't move, so the
+ * walk is bounded too: memory may stay fragmented around it. Returns the
+ * entries moved. */
+int apc_cache_compact(apc_cache_t* cache, int budget TSRMLS_DC)
+{
+    cache_header_t* header = cache->header;
+    unsigned int n = header->dir_chunks * CACHE_DIR_CHUNK_SIZE;
+    unsigned int id, visited;
+    int moved = 0;
+
+    if (budget <= 0 || apc_sma_get_fragmentation() <= CACHE_COMPACT_FRAGMENTATION) {
+        return 0;
+    }
+    if (!APCG(serializer) && APCG(serializer_name)) {
+        /* stored arrays are serialized if there is a serializer */
+        APCG(serializer) = apc_find_serializer(APCG(serializer_name) TSRMLS_CC);
+    }
+
+    for (visited = 0; visited < n && visited < (unsigned int)budget * CACHE_COMPACT_VISITS && moved < budget; visited++) {
+        id = header->compact_pos % n;
+        header->compact_pos = id + 1;
+
+        if (CACHE_DIR_CHUNK(cache, id)->type[CACHE_DIR_POS(id)] != APC_CACHE_ENTRY_USER) {
+            continue;
+        }
+        if (compact_slot(cache, id TSRMLS_CC)) {
+            moved++;
+        }
+    }
+    /* the old copies go once readers have moved on */
+    process_pending_removals(cache TSRMLS_CC);
+    if (moved) {
+        CACHE_STAT_ADD(cache, CACHE_MY_STATS(cache)->compacted, moved);
+    }
+
+    return moved;
+}
+/* }}} */
+
+/* {{{ apc_cache_user_admit
+ * The TinyLFU admission test, for a store that doesn't fit without evicting:
+ * the key goes in only if it is asked for more often than the entry the
+ * clock hand would evict next. The directory is only peeked at, hashes and
+ * flags don't need the locks. */
+zend_bool apc_cache_user_admit(apc_cache_t* cache, apc_cache_key_t* key TSRMLS_DC)
+{
+    cache_header_t* header = cache->header;
+    cache_dir_chunk_t* chunk;
+    unsigned int n = header->dir_chunks * CACHE_DIR_CHUNK_SIZE;
+    unsigned int id, pos, i;
+    time_t t;
+
+    if (!cache->sketch) {
+        return 1;
+    }
+    /* a rejected store is an access too, or a key could never warm up */
+    apc_sketch_add(cache->sketch, key->h);
+
+    t = apc_time();
+    for (i = 0; i < CACHE_ADMIT_WINDOW && i < n; i++) {
+        id = (header->clock_hand + i) % n;
+        chunk = CACHE_DIR_CHUNK(cache, id);
+        pos = CACHE_DIR_POS(id);
+        if (!chunk || !chunk->slot[pos] || chunk->referenced[pos]) {
+            continue;
+        }
+        if (chunk->expires[pos] && chunk->expires[pos] < t) {
+            return 1;
+        }
+        return apc_sketch_estimate(cache->sketch, key->h) > apc_sketch_estimate(cache->sketch, chunk->h[pos]);
+    }
+
+    return 1;
+}
+/* }}} */
+
+/* {{{ apc_cache_expunge
+ * Makes room in small steps: what a clear left behind first, then expired
+ * entries, then those past the cache ttl, or if there is none the ones the
+ * eviction clock picks. Entries are removed under their own stripe, so that
+ * lookups go on meanwhile, and the sweep and the clock carry on where the
+ * last expunge stopped. Only if that can't make room is the entire cache
+ * wiped out, and bypassed until that is done. */
+static void apc_cache_expunge(apc_cache_t* cache, size_t size TSRMLS_DC)
+{
+    int i;
+    int locked;
+    time_t t;
+
+    t = apc_time();
+
+    if(!cache) return;
+
+    /* from within a whole-cache lock, every stripe is held already */
+    locked = cache->has_lock;
+    if (!locked) {
+        LOCK(cache->header->expunge_lock);
+    }
+
+    process_pending_removals(cache TSRMLS_CC);
+    if (apc_sma_get_avail_mem() > (size_t)(APCG(shm_size)/2)) {
+        /* probably a queued up expunge, we don't need to do this */
+        goto done;
+    }
+    CACHE_STAT_INC(cache, CACHE_MY_STATS(cache)->expunges);
+
+    /* whatever a clear left behind goes first */
+    if (!locked && cache->header->stale_entries) {
+        rehash_drain(cache TSRMLS_CC);
+        if (apc_sma_get_avail_size(size)) {
+            goto done;
+        }
+    }
+    if (wheel_drain(cache, t, locked TSRMLS_CC) >= size && apc_sma_get_avail_size(size)) {
+        goto done;
+    }
+    if (cache->ttl ? sweep_expired(cache, size, t, locked TSRMLS_CC) : clock_evict(cache, size, t, locked TSRMLS_CC)) {
+        goto done;
+    }
+
+    CACHE_SAFE_LOCK(cache);
+    cache->header->busy = 1;
+    remove_all_slots(cache TSRMLS_CC);
+    cache->header->busy = 0;
+    CACHE_SAFE_UNLOCK(cache);
+
+done:
+    if (!locked) {
+        UNLOCK(cache->header->expunge_lock);
+    }
+}
+/* }}} */
+
+/* {{{ file_key_matches */
+static inline int file_key_matches(slot_t* p, apc_cache_key_t* key)
+{
+    if (key->type != p->key.type) {
+        return 0;
+    }
+    if (key->type == APC_CACHE_KEY_FILE) {
+        return key_equals(p->key.data.file, key->data.file);
+    }
+    /* APC_CACHE_KEY_FPFILE */
+    return key->h == p->key.h &&
+        !memcmp(p->key.data.fpfile.fullpath, key->data.fpfile.fullpath, key->data.fpfile.fullpath_len+1);
+}
+/* }}} */
+
+/* {{{ user_key_matches */
+#define user_key_matches(p, h, strkey, keylen) \
+    ((h) == (p)->key.h && !memcmp((p)->key.data.user.identifier, (strkey), (keylen)))
+/* }}} */
+
+/* {{{ find_file_slot
+ * Returns the link pointing at the file entry for key, or NULL. While a
+ * rehash is in progress, readers may find the entry in either table; what is
+ * left of a cleared generation in the old one is ignored. */
+static slot_t** find_file_slot(apc_cache_t* cache, apc_cache_key_t* key)
+{
+    cache_header_t* header = cache->header;
+    slot_t** slot = &header->slots[key->h % header->num_slots];
+    int pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        while (*slot) {
+            if ((*slot)->generation == header->generation && file_key_matches(*slot, key)) {
+                return slot;
+            }
+            slot = &(*slot)->next;
+        }
+        if (!header->old_slots) {
+            break;
+        }
+        slot = &header->old_slots[key->h % header->old_num_slots];
+    }
+
+    return NULL;
+}
+/* }}} */
+
+/* {{{ find_user_slot
+ * Returns the link pointing at the user entry for strkey, or NULL. While a
+ * rehash is in progress, readers may find the entry in either table. */
+static slot_t** find_user_slot(apc_cache_t* cache, unsigned long h, char *strkey, int keylen)
+{
+    cache_header_t* header = cache->header;
+    slot_t** slot = &header->slots[h % header->num_slots];
+    int pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        while (*slot) {
+            if ((*slot)->generation == header->generation && user_key_matches(*slot, h, strkey, keylen)) {
+                return slot;
+            }
+            slot = &(*slot)->next;
+        }
+        if (!header->old_slots) {
+            break;
+        }
+        slot = &header->old_slots[h % header->old_num_slots];
+    }
+
+    return NULL;
+}
+/* }}} */
+
+/* {{{ find_user_entry
+ * Lookup for readers, which don't need the link: goes through the index of
+ * the stripe if there is one. */
+static inline slot_t* find_user_entry(apc_cache_t* cache, int stripe, unsigned long h, char *strkey, int keylen)
+{
+    apc_index_t* idx = &CACHE_STRIPE(cache, stripe)->index;
+    slot_t** slot;
+
+    if (idx->groups) {
+        return apc_index_find(idx, h, strkey, keylen);
+    }
+
+    slot = find_user_slot(cache, h, strkey, keylen);
+    return slot ? *slot : NULL;
+}
+/* }}} */
+
+#if APC_EPOCH_AVAILABLE
+/*
+ * Lock-free lookups: readers don't take the stripe lock: they announce themselves through the
+ * reader epoch, so that nothing they may reach is freed under them (see
+ * apc_epoch.h), and walk the chains and the index as writers change them.
+ * Writers publish a slot only once it is complete and never change a removed
+ * slot's link, so a reader always ends on a NULL link. What it finds under a
+ * matching key is a valid answer; a miss only counts if the stripe sequence
+ * shows that no writer got in between, since moving a slot to the new table
+ * or replacing an entry can make a walk skip over the key. Readers retry a
+ * few times before falling back to the lock.
+ */
+#define CACHE_READ_RETRIES 4
+
+/* {{{ struct definition: read_view_t
+   The shared state a lock-free lookup in one stripe depends on, read as a
+   whole so that one sequence check covers it. */
+typedef struct read_view_t read_view_t;
+struct read_view_t {
+    slot_t** slots;
+    int num_slots;
+    slot_t** old_slots;
+    int old_num_slots;
+    unsigned int generation;
+    apc_index_t index;
+};
+/* }}} */
+
+/* {{{ read_begin
+ * Returns 0 if a writer holds the stripe, otherwise fills view in and sets
+ * seq to check the lookup against. */
+static inline int read_begin(apc_cache_t* cache, cache_stripe_t* s, read_view_t* view, unsigned int* seq)
+{
+    *seq = s->seq;
+    APC_RMB();
+    if (*seq & 1) {
+        return 0;
+    }
+
+    view->slots = cache->header->slots;
+    view->num_slots = cache->header->num_slots;
+    view->old_slots = cache->header->old_slots;
+    view->old_num_slots = cache->header->old_num_slots;
+    view->generation = cache->header->generation;
+    view->index.groups = s->index.groups;
+    view->index.mask = s->index.mask;
+
+    APC_RMB();
+    return s->seq == *seq;
+}
+/* }}} */
+
+/* {{{ read_unchanged */
+static inline int read_unchanged(cache_stripe_t* s, unsigned int seq)
+{
+    APC_RMB();
+    return s->seq == seq;
+}
+/* }}} */
+
+/* {{{ optimistic_find_file
+ * Returns 1 and sets found to the slot for key, or to NULL if there is none,
+ * or returns 0 if writers kept getting in the way. The caller has entered the
+ * reader epoch. */
+static int optimistic_find_file(apc_cache_t* cache, int stripe, apc_cache_key_t* key, slot_t** found)
+{
+    cache_stripe_t* s = CACHE_STRIPE(cache, stripe);
+    read_view_t view;
+    unsigned int seq;
+    slot_t* p;
+    int tries;
+
+    for (tries = 0; tries < CACHE_READ_RETRIES; tries++) {
+        if (!read_begin(cache, s, &view, &seq)) {
+            continue;
+        }
+        for (p = view.slots[key->h % view.num_slots]; p && !file_key_matches(p, key); p = p->next);
+        if (!p && view.old_slots) {
+            for (p = view.old_slots[key->h % view.old_num_slots]; p && !(p->generation == view.generation && file_key_matches(p, key)); p = p->next);
+        }
+        if (p || read_unchanged(s, seq)) {
+            *found = p;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+/* }}} */
+
+/* {{{ optimistic_find_user
+ * Like optimistic_find_file, for user entries: goes through the index of the
+ * stripe if there is one. */
+static int optimistic_find_user(apc_cache_t* cache, int stripe, unsigned long h, char *strkey, int keylen, slot_t** found)
+{
+    cache_stripe_t* s = CACHE_STRIPE(cache, stripe);
+    read_view_t view;
+    unsigned int seq;
+    slot_t* p;
+    int tries;
+
+    for (tries = 0; tries < CACHE_READ_RETRIES; tries++) {
+        if (!read_begin(cache, s, &view, &seq)) {
+            continue;
+        }
+        if (view.index.groups) {
+            p = apc_index_find(&view.index, h, strkey, keylen);
+        } else {
+            for (p = view.slots[h % view.num_slots]; p && !user_key_matches(p, h, strkey, keylen); p = p->next);
+            if (!p && view.old_slots) {
+                for (p = view.old_slots[h % view.old_num_slots]; p && !(p->generation == view.generation && user_key_matches(p, h, strkey, keylen)); p = p->next);
+            }
+        }
+        if (p || read_unchanged(s, seq)) {
+            *found = p;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+/* }}} */
+#endif
 
-        CACHE_SAFE_LOCK(cache);
-        process_pending_removals(cache TSRMLS_CC);
-        if (apc_sma_get_avail_mem() > (size_t)(APCG(shm_size)/2)) {
-            /* probably a queued up expunge, we don't need to do this */
-            CACHE_SAFE_UNLOCK(cache);
-            return;
-        }
-        cache->header->busy = 1;
-        CACHE_FAST_INC(cache, cache->header->expunges);
-        for (i = 0; i < cache->num_slots; i++) {
-            p = &cache->slots[i];
-            while(*p) {
-                /*
-                 * For the user cache we look at the individual entry ttl values
-                 * and if not set fall back to the default ttl for the user cache
-                 */
-                if((*p)->value->type == APC_CACHE_ENTRY_USER) {
-                    if((*p)->value->data.user.ttl) {
-                        if((time_t) ((*p)->creation_time + (*p)->value->data.user.ttl) < t) {
-                            remove_slot(cache, p TSRMLS_CC);
-                            continue;
-                        }
-                    } else if(cache->ttl) {
-                        if((*p)->creation_time + cache->ttl < t) {
-                            remove_slot(cache, p TSRMLS_CC);
-                            continue;
-                        }
-                    }
-                } else if((*p)->access_time < (t - cache->ttl)) {
-                    remove_slot(cache, p TSRMLS_CC);
-                    continue;
-                }
-                p = &(*p)->next;
+/* {{{ rehash_read_step
+ * Readers only hold their stripe shared and can't migrate buckets; if the
+ * stripe happens to be free, take it exclusively for a moment and help out,
+ * so that a read-mostly cache doesn't stay split across two tables. */
+static void rehash_read_step(apc_cache_t* cache, int stripe TSRMLS_DC)
+{
+#if USE_READ_LOCKS && NONBLOCKING_LOCK_AVAILABLE
+    if (cache->header->old_slots && CACHE_STRIPE(cache, stripe)->rehash_pos < cache->header->old_num_slots / cache->num_stripes) {
+        HANDLE_BLOCK_INTERRUPTIONS();
+        if (apc_lck_nb_lock(CACHE_STRIPE(cache, stripe)->lock)) {
+            CACHE_STRIPE_WRITE_BEGIN(cache, stripe);
+            if (cache->header->old_slots) {
+                rehash_stripe(cache, stripe, CACHE_REHASH_STEP TSRMLS_CC);
             }
+            CACHE_STRIPE_WRITE_END(cache, stripe);
+            apc_lck_unlock(CACHE_STRIPE(cache, stripe)->lock);
         }
-
-        if (!apc_sma_get_avail_size(size)) {
-            /* TODO: re-do this to remove goto across locked sections */
-            goto clear_all;
-        }
-        memset(&cache->header->lastkey, 0, sizeof(apc_keyid_t));
-        cache->header->busy = 0;
-        CACHE_SAFE_UNLOCK(cache);
+        HANDLE_UNBLOCK_INTERRUPTIONS();
     }
+#endif
 }
 /* }}} */
 
 /* {{{ apc_cache_insert */
 static inline int _apc_cache_insert(apc_cache_t* cache,
-                     apc_cache_key_t key,
-                     apc_cache_entry_t* value,
+                     slot_t* new_slot,
                      apc_context_t* ctxt,
                      time_t t
                      TSRMLS_DC)
 {
     slot_t** slot;
+    apc_cache_key_t* key = &new_slot->key;
 
-    if (!value) {
-        return 0;
-    }
-
-    apc_debug("Inserting [%s]\n" TSRMLS_CC, value->data.file.filename);
+    apc_debug("Inserting [%s]\n" TSRMLS_CC, new_slot->value->data.file.filename);
 
-    process_pending_removals(cache TSRMLS_CC);
+    rehash_step(cache, CACHE_STRIPE_OF(cache, key->h), key->h TSRMLS_CC);
 
-    slot = &cache->slots[key.h % cache->num_slots];
+    slot = &cache->header->slots[key->h % cache->header->num_slots];
 
     while(*slot) {
-      if(key.type == (*slot)->key.type) {
-        if(key.type == APC_CACHE_KEY_FILE) {
-            if(key_equals((*slot)->key.data.file, key.data.file)) {
+      if(key->type == (*slot)->key.type) {
+        if(key->type == APC_CACHE_KEY_FILE) {
+            if(key_equals((*slot)->key.data.file, key->data.file)) {
                 /* If existing slot for the same device+inode is different, remove it and insert the new version */
-                if (ctxt->force_update || (*slot)->key.mtime != key.mtime) {
+                if (ctxt->force_update || (*slot)->key.mtime != key->mtime) {
                     remove_slot(cache, slot TSRMLS_CC);
                     break;
                 }
                 return 0;
-            } else if(cache->ttl && (*slot)->access_time < (t - cache->ttl)) {
+            } else if(cache->ttl && SLOT_ACCESS_TIME(cache, *slot) < (t - cache->ttl)) {
                 remove_slot(cache, slot TSRMLS_CC);
                 continue;
             }
         } else {   /* APC_CACHE_KEY_FPFILE */
-            if((key.h == (*slot)->key.h) &&
-                !memcmp((*slot)->key.data.fpfile.fullpath, key.data.fpfile.fullpath, key.data.fpfile.fullpath_len+1)) {
+            if((key->h == (*slot)->key.h) &&
+                !memcmp((*slot)->key.data.fpfile.fullpath, key->data.fpfile.fullpath, key->data.fpfile.fullpath_len+1)) {
                 /* Hrm.. it's already here, remove it and insert new one */
                 remove_slot(cache, slot TSRMLS_CC);
                 break;
-            } else if(cache->ttl && (*slot)->access_time < (t - cache->ttl)) {
+            } else if(cache->ttl && SLOT_ACCESS_TIME(cache, *slot) < (t - cache->ttl)) {
                 remove_slot(cache, slot TSRMLS_CC);
                 continue;
             }
@@ -496,26 +2336,62 @@ static inline int _apc_cache_insert(apc_cache_t* cache,
       slot = &(*slot)->next;
     }
 
-    if ((*slot = make_slot(&key, value, *slot, t TSRMLS_CC)) == NULL) {
+    if (!dir_link(cache, new_slot, t TSRMLS_CC)) {
         return -1;
     }
 
-    value->mem_size = ctxt->pool->size;
-    cache->header->mem_size += ctxt->pool->size;
-    CACHE_FAST_INC(cache, cache->header->num_entries);
-    CACHE_FAST_INC(cache, cache->header->num_inserts);
+    link_slot(slot, new_slot);
+
+    CACHE_STAT_ADD(cache, cache->header->mem_size, new_slot->value->mem_size);
+    CACHE_STAT_ADD(cache, cache->header->num_entries, 1);
+    CACHE_STAT_INC(cache, CACHE_MY_STATS(cache)->num_inserts);
 
     return 1;
 }
 /* }}} */
 
+/* {{{ janitor_active
+ * Whether writers can leave the housekeeping to the janitor: there is one,
+ * and it started a round within the last two intervals. When it died or is
+ * stuck, writers take the work back. */
+static inline int janitor_active(apc_cache_t* cache, time_t t)
+{
+    return cache->janitor && t - cache->header->janitor_time <= 2 * cache->janitor;
+}
+/* }}} */
+
 /* {{{ apc_cache_insert */
 int apc_cache_insert(apc_cache_t* cache, apc_cache_key_t key, apc_cache_entry_t* value, apc_context_t *ctxt, time_t t TSRMLS_DC)
 {
     int rval;
-    CACHE_LOCK(cache);
-    rval = _apc_cache_insert(cache, key, value, ctxt, t TSRMLS_CC);
-    CACHE_UNLOCK(cache);
+    int stripe;
+    slot_t* new_slot;
+
+    if (!value) {
+        return 0;
+    }
+
+    if ((new_slot = make_slot(&key, value TSRMLS_CC)) == NULL) {
+        return -1;
+    }
+    value->mem_size = ctxt->pool->size;
+
+    if (!janitor_active(cache, t)) {
+        pending_removals_step(cache, t TSRMLS_CC);
+    }
+
+    stripe = CACHE_STRIPE_OF(cache, key.h);
+    CACHE_STRIPE_LOCK(cache, stripe);
+    rval = _apc_cache_insert(cache, new_slot, ctxt, t TSRMLS_CC);
+    CACHE_STRIPE_UNLOCK(cache, stripe);
+
+    if (rval < 0) {
+        /* the directory is full and couldn't grow without expunging */
+        cache->expunge_cb(cache, sizeof(cache_dir_chunk_t) TSRMLS_CC);
+    }
+
+    rehash_check(cache TSRMLS_CC);
+
     return rval;
 }
 /* }}} */
@@ -525,16 +2401,28 @@ int *apc_cache_insert_mult(apc_cache_t* cache, apc_cache_key_t* keys, apc_cache_
 {
     int *rval;
     int i;
+    int stripe;
+    slot_t* new_slot;
 
     rval = emalloc(sizeof(int) * num_entries);
-    CACHE_LOCK(cache);
+    if (!janitor_active(cache, t)) {
+        pending_removals_step(cache, t TSRMLS_CC);
+    }
     for (i=0; i < num_entries; i++) {
         if (values[i]) {
             ctxt->pool = values[i]->pool;
-            rval[i] = _apc_cache_insert(cache, keys[i], values[i], ctxt, t TSRMLS_CC);
+            if ((new_slot = make_slot(&keys[i], values[i] TSRMLS_CC)) == NULL) {
+                rval[i] = -1;
+                continue;
+            }
+            values[i]->mem_size = ctxt->pool->size;
+            stripe = CACHE_STRIPE_OF(cache, keys[i].h);
+            CACHE_STRIPE_LOCK(cache, stripe);
+            rval[i] = _apc_cache_insert(cache, new_slot, ctxt, t TSRMLS_CC);
+            CACHE_STRIPE_UNLOCK(cache, stripe);
         }
     }
-    CACHE_UNLOCK(cache);
+    rehash_check(cache TSRMLS_CC);
     return rval;
 }
 /* }}} */
@@ -543,8 +2431,9 @@ int *apc_cache_insert_mult(apc_cache_t* cache, apc_cache_key_t* keys, apc_cache_
 int apc_cache_user_insert(apc_cache_t* cache, apc_cache_key_t key, apc_cache_entry_t* value, apc_context_t* ctxt, time_t t, int exclusive TSRMLS_DC)
 {
     slot_t** slot;
+    slot_t* new_slot;
     unsigned int keylen = key.data.user.identifier_len;
-    apc_keyid_t *lastkey = &cache->header->lastkey;
+    int stripe;
     
     if (!value) {
         return 0;
@@ -555,31 +2444,28 @@ int apc_cache_user_insert(apc_cache_t* cache, apc_cache_key_t key, apc_cache_ent
         return 0;
     }
 
-    if(apc_cache_is_last_key(cache, &key, t TSRMLS_CC)) {
-        /* potential cache slam */
+    if ((new_slot = make_slot(&key, value TSRMLS_CC)) == NULL) {
         return 0;
     }
+    value->mem_size = ctxt->pool->size;
 
-    CACHE_LOCK(cache);
-
-    memset(lastkey, 0, sizeof(apc_keyid_t));
+    if (!janitor_active(cache, t)) {
+        pending_removals_step(cache, t TSRMLS_CC);
+        wheel_tick(cache, t TSRMLS_CC);
+        sketch_age(cache, CACHE_SKETCH_AGE_STEP TSRMLS_CC);
+        /* a little of the janitor's compaction, at most once a second */
+        if (APCG(janitor_compact) > 0 && cache->header->compact_time != t) {
+            cache->header->compact_time = t;
+            apc_cache_compact(cache, MIN(APCG(janitor_compact), CACHE_COMPACT_STEP) TSRMLS_CC);
+        }
+    }
 
-    lastkey->h = key.h;
-    lastkey->keylen = keylen;
-    lastkey->mtime = t;
-#ifdef ZTS
-    lastkey->tid = tsrm_thread_id();
-#else
-    lastkey->pid = getpid();
-#endif
-    
-    /* we do not reset lastkey after the insert. Whether it is inserted 
-     * or not, another insert in the same second is always a bad idea. 
-     */
+    stripe = CACHE_STRIPE_OF(cache, key.h);
+    CACHE_STRIPE_LOCK(cache, stripe);
 
-    process_pending_removals(cache TSRMLS_CC);
+    rehash_step(cache, stripe, key.h TSRMLS_CC);
     
-    slot = &cache->slots[key.h % cache->num_slots];
+    slot = &cache->header->slots[key.h % cache->header->num_slots];
 
     while (*slot) {
         if (((*slot)->key.h == key.h) && 
@@ -590,9 +2476,7 @@ int apc_cache_user_insert(apc_cache_t* cache, apc_cache_key_t key, apc_cache_ent
              * the user entry already exists and it has no ttl, or
              * there is a ttl and the entry has not timed out yet.
              */
-            if(exclusive && (  !(*slot)->value->data.user.ttl ||
-                              ( (*slot)->value->data.user.ttl && (time_t) ((*slot)->creation_time + (*slot)->value->data.user.ttl) >= t ) 
-                            ) ) {
+            if(exclusive && !user_expired(cache, *slot, t, NULL TSRMLS_CC)) {
                 goto fail;
             }
             remove_slot(cache, slot TSRMLS_CC);
@@ -605,30 +2489,39 @@ int apc_cache_user_insert(apc_cache_t* cache, apc_cache_key_t key, apc_cache_ent
          * access ttl on it and removing entries that haven't been accessed for ttl seconds and secondly
          * we see if the entry has a hard ttl on it and remove it if it has been around longer than its ttl
          */
-        if((cache->ttl && (*slot)->access_time < (t - cache->ttl)) || 
-           ((*slot)->value->data.user.ttl && (time_t) ((*slot)->creation_time + (*slot)->value->data.user.ttl) < t)) {
+        if((cache->ttl && SLOT_ACCESS_TIME(cache, *slot) < (t - cache->ttl)) || 
+           (SLOT_EXPIRES(cache, *slot) && SLOT_EXPIRES(cache, *slot) < t)) {
             remove_slot(cache, slot TSRMLS_CC);
             continue;
         }
         slot = &(*slot)->next;
     }
 
-    if ((*slot = make_slot(&key, value, *slot, t TSRMLS_CC)) == NULL) {
-        goto fail;
-    } 
-    
-    value->mem_size = ctxt->pool->size;
-    cache->header->mem_size += ctxt->pool->size;
+    if (!dir_link(cache, new_slot, t TSRMLS_CC)) {
+        CACHE_STRIPE_UNLOCK(cache, stripe);
+        /* the directory is full and couldn't grow without expunging */
+        cache->expunge_cb(cache, sizeof(cache_dir_chunk_t) TSRMLS_CC);
+        return 0;
+    }
 
-    CACHE_FAST_INC(cache, cache->header->num_entries);
-    CACHE_FAST_INC(cache, cache->header->num_inserts);
+    link_slot(slot, new_slot);
 
-    CACHE_UNLOCK(cache);
+    if (cache->use_index) {
+        index_add(cache, stripe, new_slot TSRMLS_CC);
+    }
+
+    CACHE_STAT_ADD(cache, cache->header->mem_size, value->mem_size);
+    CACHE_STAT_ADD(cache, cache->header->num_entries, 1);
+    CACHE_STAT_INC(cache, CACHE_MY_STATS(cache)->num_inserts);
+
+    CACHE_STRIPE_UNLOCK(cache, stripe);
+
+    rehash_check(cache TSRMLS_CC);
 
     return 1;
 
 fail:
-    CACHE_UNLOCK(cache);
+    CACHE_STRIPE_UNLOCK(cache, stripe);
 
     return 0;
 }
@@ -639,56 +2532,65 @@ slot_t* apc_cache_find_slot(apc_cache_t* cache, apc_cache_key_t key, time_t t TS
 {
     slot_t** slot;
     volatile slot_t* retval = NULL;
+    int stripe;
 
-    CACHE_RDLOCK(cache);
-    if(key.type == APC_CACHE_KEY_FILE) slot = &cache->slots[hash(key) % cache->num_slots];
-    else slot = &cache->slots[key.h % cache->num_slots];
+    stripe = CACHE_STRIPE_OF(cache, key.h);
 
-    while (*slot) {
-      if(key.type == (*slot)->key.type) {
-        if(key.type == APC_CACHE_KEY_FILE) {
-            if(key_equals((*slot)->key.data.file, key.data.file)) {
-                if((*slot)->key.mtime != key.mtime) {
-                    #if (USE_READ_LOCKS == 0)
-                    /* this is merely a memory-friendly optimization, if we do have a write-lock
-                     * might as well move this to the deleted_list right-away. Otherwise an insert
-                     * of the same key wil do it (or an expunge, *eventually*).
-                     */
-                    remove_slot(cache, slot TSRMLS_CC);
-                    #endif
-                    CACHE_SAFE_INC(cache, cache->header->num_misses);
-                    CACHE_RDUNLOCK(cache);
-                    return NULL;
-                }
-                CACHE_SAFE_INC(cache, (*slot)->num_hits);
-                CACHE_SAFE_INC(cache, (*slot)->value->ref_count);
-                (*slot)->access_time = t;
-                prevent_garbage_collection((*slot)->value);
-                CACHE_FAST_INC(cache, cache->header->num_hits); 
-                retval = *slot;
-                CACHE_RDUNLOCK(cache);
-                return (slot_t*)retval;
-            }
-        } else {  /* APC_CACHE_KEY_FPFILE */
-            if(((*slot)->key.h == key.h) &&
-                !memcmp((*slot)->key.data.fpfile.fullpath, key.data.fpfile.fullpath, key.data.fpfile.fullpath_len+1)) {
-                /* TTL Check ? */
-                CACHE_SAFE_INC(cache, (*slot)->num_hits);
-                CACHE_SAFE_INC(cache, (*slot)->value->ref_count);
-                (*slot)->access_time = t;
-                prevent_garbage_collection((*slot)->value);
-                CACHE_FAST_INC(cache, cache->header->num_hits);
-                retval = *slot;
-                CACHE_RDUNLOCK(cache);
-                return (slot_t*)retval;
+#if APC_EPOCH_AVAILABLE
+    if (cache->optimistic_reads && apc_epoch_enter(TSRMLS_C)) {
+        slot_t* p;
+
+        if (optimistic_find_file(cache, stripe, &key, &p)) {
+            if (p && !(key.type == APC_CACHE_KEY_FILE && p->key.mtime != key.mtime)) {
+                touch_slot(cache, p, t TSRMLS_CC);
+                hold_entry(cache, p->value TSRMLS_CC);
+                prevent_garbage_collection(p->value);
+                retval = p;
             }
+            apc_epoch_leave(TSRMLS_C);
+
+            count_lookup(cache, retval != NULL TSRMLS_CC);
+            rehash_read_step(cache, stripe TSRMLS_CC);
+            return (slot_t*)retval;
         }
-      }
-      slot = &(*slot)->next;
+        apc_epoch_leave(TSRMLS_C);
     }
-    CACHE_FAST_INC(cache, cache->header->num_misses); 
-    CACHE_RDUNLOCK(cache);
-    return NULL;
+#endif
+
+    CACHE_STRIPE_RDLOCK(cache, stripe);
+
+    slot = find_file_slot(cache, &key);
+
+    if (slot) {
+        if(key.type == APC_CACHE_KEY_FILE && (*slot)->key.mtime != key.mtime) {
+            #if (USE_READ_LOCKS == 0)
+            /* this is merely a memory-friendly optimization, if we do have a write-lock
+             * might as well move this to the deleted_list right-away. Otherwise an insert
+             * of the same key wil do it (or an expunge, *eventually*).
+             */
+            remove_slot(cache, slot TSRMLS_CC);
+            #endif
+            count_lookup(cache, 0 TSRMLS_CC);
+            CACHE_STRIPE_RDUNLOCK(cache, stripe);
+            return NULL;
+        }
+        /* TTL Check ? */
+        touch_slot(cache, *slot, t TSRMLS_CC);
+        hold_entry(cache, (*slot)->value TSRMLS_CC);
+        prevent_garbage_collection((*slot)->value);
+        count_lookup(cache, 1 TSRMLS_CC);
+        retval = *slot;
+    } else {
+        count_lookup(cache, 0 TSRMLS_CC);
+    }
+#if (USE_READ_LOCKS == 0)
+    rehash_step(cache, stripe, key.h TSRMLS_CC);
+#endif
+    CACHE_STRIPE_RDUNLOCK(cache, stripe);
+
+    rehash_read_step(cache, stripe TSRMLS_CC);
+
+    return (slot_t*)retval;
 }
 /* }}} */
 
@@ -701,12 +2603,17 @@ apc_cache_entry_t* apc_cache_find(apc_cache_t* cache, apc_cache_key_t key, time_
 }
 /* }}} */
 
-/* {{{ apc_cache_user_find */
-apc_cache_entry_t* apc_cache_user_find(apc_cache_t* cache, char *strkey, int keylen, time_t t TSRMLS_DC)
+/* {{{ user_find */
+static apc_cache_entry_t* user_find(apc_cache_t* cache, char *strkey, int keylen, time_t t, zend_bool* stale TSRMLS_DC)
 {
-    slot_t** slot;
+    slot_t* slot;
     volatile apc_cache_entry_t* value = NULL;
     unsigned long h;
+    int stripe;
+
+    if (stale) {
+        *stale = 0;
+    }
 
     if(apc_cache_busy(cache))
     {
@@ -714,53 +2621,96 @@ apc_cache_entry_t* apc_cache_user_find(apc_cache_t* cache, char *strkey, int key
         return NULL;
     }
 
-    CACHE_RDLOCK(cache);
-
     h = string_nhash_8(strkey, keylen);
 
-    slot = &cache->slots[h % cache->num_slots];
+    /* a key that was never stored is a miss without a look at the table */
+    if (cache->bloom && !apc_bloom_maybe(cache->bloom, h)) {
+        count_user_lookup(cache, h, 0 TSRMLS_CC);
+        return NULL;
+    }
+
+    stripe = CACHE_STRIPE_OF(cache, h);
 
-    while (*slot) {
-        if ((h == (*slot)->key.h) &&
-            !memcmp((*slot)->key.data.user.identifier, strkey, keylen)) {
-            /* Check to make sure this entry isn't expired by a hard TTL */
-            if((*slot)->value->data.user.ttl && (time_t) ((*slot)->creation_time + (*slot)->value->data.user.ttl) < t) {
-                #if (USE_READ_LOCKS == 0) 
-                /* this is merely a memory-friendly optimization, if we do have a write-lock
-                 * might as well move this to the deleted_list right-away. Otherwise an insert
-                 * of the same key wil do it (or an expunge, *eventually*).
-                 */
-                remove_slot(cache, slot TSRMLS_CC);
-                #endif
-                CACHE_FAST_INC(cache, cache->header->num_misses);
-                CACHE_RDUNLOCK(cache);
-                return NULL;
+#if APC_EPOCH_AVAILABLE
+    if (cache->optimistic_reads && apc_epoch_enter(TSRMLS_C)) {
+        if (optimistic_find_user(cache, stripe, h, strkey, keylen, &slot)) {
+            /* expired entries are left to the next writer of the stripe */
+            if (slot && !user_expired(cache, slot, t, stale TSRMLS_CC)) {
+                touch_slot(cache, slot, t TSRMLS_CC);
+                hold_entry(cache, slot->value TSRMLS_CC);
+                value = slot->value;
             }
-            /* Otherwise we are fine, increase counters and return the cache entry */
-            CACHE_SAFE_INC(cache, (*slot)->num_hits);
-            CACHE_SAFE_INC(cache, (*slot)->value->ref_count);
-            (*slot)->access_time = t;
-
-            CACHE_FAST_INC(cache, cache->header->num_hits);
-            value = (*slot)->value;
-            CACHE_RDUNLOCK(cache);
+            apc_epoch_leave(TSRMLS_C);
+
+            count_user_lookup(cache, h, value != NULL TSRMLS_CC);
+            rehash_read_step(cache, stripe TSRMLS_CC);
             return (apc_cache_entry_t*)value;
         }
-        slot = &(*slot)->next;
+        apc_epoch_leave(TSRMLS_C);
     }
- 
-    CACHE_FAST_INC(cache, cache->header->num_misses);
-    CACHE_RDUNLOCK(cache);
-    return NULL;
+#endif
+
+    CACHE_STRIPE_RDLOCK(cache, stripe);
+
+    slot = find_user_entry(cache, stripe, h, strkey, keylen);
+
+    if (slot) {
+        /* Check to make sure this entry isn't expired by a hard TTL */
+        if(user_expired(cache, slot, t, stale TSRMLS_CC)) {
+            #if (USE_READ_LOCKS == 0) 
+            /* this is merely a memory-friendly optimization, if we do have a write-lock
+             * might as well move this to the deleted_list right-away. Otherwise an insert
+             * of the same key wil do it (or an expunge, *eventually*).
+             */
+            if (SLOT_EXPIRES(cache, slot) < t) {
+                remove_slot(cache, find_user_slot(cache, h, strkey, keylen) TSRMLS_CC);
+            }
+            #endif
+            count_user_lookup(cache, h, 0 TSRMLS_CC);
+            CACHE_STRIPE_RDUNLOCK(cache, stripe);
+            return NULL;
+        }
+        /* Otherwise we are fine, increase counters and return the cache entry */
+        touch_slot(cache, slot, t TSRMLS_CC);
+        hold_entry(cache, slot->value TSRMLS_CC);
+
+        count_user_lookup(cache, h, 1 TSRMLS_CC);
+        value = slot->value;
+    } else {
+        count_user_lookup(cache, h, 0 TSRMLS_CC);
+    }
+#if (USE_READ_LOCKS == 0)
+    rehash_step(cache, stripe, h TSRMLS_CC);
+#endif
+    CACHE_STRIPE_RDUNLOCK(cache, stripe);
+
+    rehash_read_step(cache, stripe TSRMLS_CC);
+
+    return (apc_cache_entry_t*)value;
+}
+/* }}} */
+
+/* {{{ apc_cache_user_find */
+apc_cache_entry_t* apc_cache_user_find(apc_cache_t* cache, char *strkey, int keylen, time_t t TSRMLS_DC)
+{
+    return user_find(cache, strkey, keylen, t, NULL TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ apc_cache_user_find_stale */
+apc_cache_entry_t* apc_cache_user_find_stale(apc_cache_t* cache, char *strkey, int keylen, time_t t, zend_bool* stale TSRMLS_DC)
+{
+    return user_find(cache, strkey, keylen, t, stale TSRMLS_CC);
 }
 /* }}} */
 
 /* {{{ apc_cache_user_exists */
 apc_cache_entry_t* apc_cache_user_exists(apc_cache_t* cache, char *strkey, int keylen, time_t t TSRMLS_DC)
 {
-    slot_t** slot;
+    slot_t* slot;
     volatile apc_cache_entry_t* value = NULL;
     unsigned long h;
+    int stripe;
 
     if(apc_cache_busy(cache))
     {
@@ -768,29 +2718,39 @@ apc_cache_entry_t* apc_cache_user_exists(apc_cache_t* cache, char *strkey, int k
         return NULL;
     }
 
-    CACHE_RDLOCK(cache);
-
     h = string_nhash_8(strkey, keylen);
 
-    slot = &cache->slots[h % cache->num_slots];
+    if (cache->bloom && !apc_bloom_maybe(cache->bloom, h)) {
+        return NULL;
+    }
+
+    stripe = CACHE_STRIPE_OF(cache, h);
 
-    while (*slot) {
-        if ((h == (*slot)->key.h) &&
-            !memcmp((*slot)->key.data.user.identifier, strkey, keylen)) {
-            /* Check to make sure this entry isn't expired by a hard TTL */
-            if((*slot)->value->data.user.ttl && (time_t) ((*slot)->creation_time + (*slot)->value->data.user.ttl) < t) {
-                CACHE_UNLOCK(cache);
-                return NULL;
+#if APC_EPOCH_AVAILABLE
+    if (cache->optimistic_reads && apc_epoch_enter(TSRMLS_C)) {
+        if (optimistic_find_user(cache, stripe, h, strkey, keylen, &slot)) {
+            if (slot && !user_expired(cache, slot, t, NULL TSRMLS_CC)) {
+                value = slot->value;
             }
-            /* Return the cache entry ptr */
-            value = (*slot)->value;
-            CACHE_RDUNLOCK(cache);
+            apc_epoch_leave(TSRMLS_C);
             return (apc_cache_entry_t*)value;
         }
-        slot = &(*slot)->next;
+        apc_epoch_leave(TSRMLS_C);
     }
-    CACHE_RDUNLOCK(cache);
-    return NULL;
+#endif
+
+    CACHE_STRIPE_RDLOCK(cache, stripe);
+
+    slot = find_user_entry(cache, stripe, h, strkey, keylen);
+
+    /* Check to make sure this entry isn't expired by a hard TTL */
+    if (slot && !user_expired(cache, slot, t, NULL TSRMLS_CC)) {
+        /* Return the cache entry ptr */
+        value = slot->value;
+    }
+
+    CACHE_STRIPE_RDUNLOCK(cache, stripe);
+    return (apc_cache_entry_t*)value;
 }
 /* }}} */
 
@@ -798,8 +2758,9 @@ apc_cache_entry_t* apc_cache_user_exists(apc_cache_t* cache, char *strkey, int k
 int _apc_cache_user_update(apc_cache_t* cache, char *strkey, int keylen, apc_cache_updater_t updater, void* data TSRMLS_DC)
 {
     slot_t** slot;
-    int retval;
+    int retval = 0;
     unsigned long h;
+    int stripe;
 
     if(apc_cache_busy(cache))
     {
@@ -807,41 +2768,40 @@ int _apc_cache_user_update(apc_cache_t* cache, char *strkey, int keylen, apc_cac
         return 0;
     }
 
-    CACHE_LOCK(cache);
-
     h = string_nhash_8(strkey, keylen);
-    slot = &cache->slots[h % cache->num_slots];
 
-    while (*slot) {
-        if ((h == (*slot)->key.h) &&
-            !memcmp((*slot)->key.data.user.identifier, strkey, keylen)) {
-            switch(Z_TYPE_P((*slot)->value->data.user.val) & ~IS_CONSTANT_INDEX) {
-                case IS_ARRAY:
-                case IS_CONSTANT_ARRAY:
-                case IS_OBJECT:
-                {
-                    if(APCG(serializer)) {
-                        retval = 0;
-                        break;
-                    } else {
-                        /* fall through */
-                    }
-                }
-                /* fall through */
-                default:
-                {
-                    retval = updater(cache, (*slot)->value, data);
-                    (*slot)->key.mtime = apc_time();
+    stripe = CACHE_STRIPE_OF(cache, h);
+    CACHE_STRIPE_LOCK(cache, stripe);
+
+    rehash_step(cache, stripe, h TSRMLS_CC);
+
+    slot = find_user_slot(cache, h, strkey, keylen);
+
+    if (slot) {
+        switch(Z_TYPE_P((*slot)->value->data.user.val) & ~IS_CONSTANT_INDEX) {
+            case IS_ARRAY:
+            case IS_CONSTANT_ARRAY:
+            case IS_OBJECT:
+            {
+                if(APCG(serializer)) {
+                    retval = 0;
+                    break;
+                } else {
+                    /* fall through */
                 }
-                break;
             }
-            CACHE_UNLOCK(cache);
-            return retval;
+            /* fall through */
+            default:
+            {
+                retval = updater(cache, (*slot)->value, data);
+                (*slot)->key.mtime = apc_time();
+            }
+            break;
         }
-        slot = &(*slot)->next;
     }
-    CACHE_UNLOCK(cache);
-    return 0;
+
+    CACHE_STRIPE_UNLOCK(cache, stripe);
+    return retval;
 }
 /* }}} */
 
@@ -850,25 +2810,23 @@ int apc_cache_user_delete(apc_cache_t* cache, char *strkey, int keylen TSRMLS_DC
 {
     slot_t** slot;
     unsigned long h;
-
-    CACHE_LOCK(cache);
+    int stripe;
 
     h = string_nhash_8(strkey, keylen);
 
-    slot = &cache->slots[h % cache->num_slots];
+    stripe = CACHE_STRIPE_OF(cache, h);
+    CACHE_STRIPE_LOCK(cache, stripe);
 
-    while (*slot) {
-        if ((h == (*slot)->key.h) && 
-            !memcmp((*slot)->key.data.user.identifier, strkey, keylen)) {
-            remove_slot(cache, slot TSRMLS_CC);
-            CACHE_UNLOCK(cache);
-            return 1;
-        }
-        slot = &(*slot)->next;
+    rehash_step(cache, stripe, h TSRMLS_CC);
+
+    slot = find_user_slot(cache, h, strkey, keylen);
+
+    if (slot) {
+        remove_slot(cache, slot TSRMLS_CC);
     }
 
-    CACHE_UNLOCK(cache);
-    return 0;
+    CACHE_STRIPE_UNLOCK(cache, stripe);
+    return slot != NULL;
 }
 /* }}} */
 
@@ -878,6 +2836,7 @@ int apc_cache_delete(apc_cache_t* cache, char *filename, int filename_len TSRMLS
     slot_t** slot;
     time_t t;
     apc_cache_key_t key;
+    int stripe;
 
     t = apc_time();
 
@@ -887,34 +2846,21 @@ int apc_cache_delete(apc_cache_t* cache, char *filename, int filename_len TSRMLS
         return -1;
     }
 
-    CACHE_LOCK(cache);
+    stripe = CACHE_STRIPE_OF(cache, key.h);
+    CACHE_STRIPE_LOCK(cache, stripe);
 
-    if(key.type == APC_CACHE_KEY_FILE) slot = &cache->slots[hash(key) % cache->num_slots];
-    else slot = &cache->slots[key.h % cache->num_slots];
+    rehash_step(cache, stripe, key.h TSRMLS_CC);
 
-    while(*slot) {
-      if(key.type == (*slot)->key.type) {
-        if(key.type == APC_CACHE_KEY_FILE) {
-            if(key_equals((*slot)->key.data.file, key.data.file)) {
-                remove_slot(cache, slot TSRMLS_CC);
-                CACHE_UNLOCK(cache);
-                return 1;
-            }
-        } else {   /* APC_CACHE_KEY_FPFILE */
-            if(((*slot)->key.h == key.h) &&
-                (!memcmp((*slot)->key.data.fpfile.fullpath, key.data.fpfile.fullpath, key.data.fpfile.fullpath_len+1))) {
-                remove_slot(cache, slot TSRMLS_CC);
-                CACHE_UNLOCK(cache);
-                return 1;
-            }
-        }
-      }
-      slot = &(*slot)->next;
+    slot = find_file_slot(cache, &key);
+
+    if (slot) {
+        remove_slot(cache, slot TSRMLS_CC);
+        CACHE_STRIPE_UNLOCK(cache, stripe);
+        return 1;
     }
-    
-    memset(&cache->header->lastkey, 0, sizeof(apc_keyid_t));
-    
-    CACHE_UNLOCK(cache);
+
+    CACHE_STRIPE_UNLOCK(cache, stripe);
+
     return 0;
 
 }
@@ -923,6 +2869,13 @@ int apc_cache_delete(apc_cache_t* cache, char *filename, int filename_len TSRMLS
 /* {{{ apc_cache_release */
 void apc_cache_release(apc_cache_t* cache, apc_cache_entry_t* entry TSRMLS_DC)
 {
+#if APC_EPOCH_AVAILABLE
+    /* held through the epoch pin, see hold_entry */
+    if (cache->write_free_hits && APCG(epoch_holds)[cache->epoch_pin]) {
+        apc_epoch_unpin(cache->epoch_pin TSRMLS_CC);
+        return;
+    }
+#endif
     CACHE_SAFE_DEC(cache, entry->ref_count);
 }
 /* }}} */
@@ -1101,6 +3054,7 @@ apc_cache_entry_t* apc_cache_make_file_entry(const char* filename,
     entry->data.file.classes   = classes;
 
     entry->data.file.halt_offset = apc_file_halt_offset(filename TSRMLS_CC);
+    entry->data.file.cost = 0;
 
     entry->type = APC_CACHE_ENTRY_FILE;
     entry->ref_count = 0;
@@ -1166,6 +3120,9 @@ apc_cache_entry_t* apc_cache_make_user_entry(const char* info, int info_len, con
     }
     INIT_PZVAL(entry->data.user.val);
     entry->data.user.ttl = ttl;
+    entry->data.user.grace = 0;
+    entry->data.user.cost = 0;
+    entry->data.user.beta = 0;
     entry->type = APC_CACHE_ENTRY_USER;
     entry->ref_count = 0;
     entry->mem_size = 0;
@@ -1216,17 +3173,20 @@ static zval* apc_cache_link_info(apc_cache_t *cache, slot_t* p TSRMLS_DC)
                make_digest(md5str, p->key.md5);
                add_assoc_string(link, "md5", md5str, 1);
         } 
+        add_assoc_long(link, "compile_time", p->value->data.file.cost);
     } else if(p->value->type == APC_CACHE_ENTRY_USER) {
         add_assoc_stringl(link, "info", p->value->data.user.info, p->value->data.user.info_len-1, 1);
         add_assoc_long(link, "ttl", (long)p->value->data.user.ttl);
+        add_assoc_long(link, "grace", (long)p->value->data.user.grace);
+        add_assoc_long(link, "rebuild_time", (long)p->value->data.user.cost);
         add_assoc_string(link, "type", "user", 1);
     }
 
     add_assoc_double(link, "num_hits", (double)p->num_hits);
     add_assoc_long(link, "mtime", p->key.mtime);
-    add_assoc_long(link, "creation_time", p->creation_time);
+    add_assoc_long(link, "creation_time", SLOT_CREATION_TIME(cache, p));
     add_assoc_long(link, "deletion_time", p->deletion_time);
-    add_assoc_long(link, "access_time", p->access_time);
+    add_assoc_long(link, "access_time", SLOT_ACCESS_TIME(cache, p));
     add_assoc_long(link, "ref_count", p->value->ref_count);
     add_assoc_long(link, "mem_size", p->value->mem_size);
 
@@ -1242,10 +3202,15 @@ zval* apc_cache_info(apc_cache_t* cache, zend_bool limited TSRMLS_DC)
     zval *deleted_list = NULL;
     zval *slots = NULL;
     slot_t* p;
-    int i, j;
+    slot_t** table;
+    cache_stats_t stats;
+    int i, j, n, pass;
+    int used_slots = 0, max_chain = 0;
 
     if(!cache) return NULL;
 
+    apc_cache_flush_stats(cache TSRMLS_CC);
+
     CACHE_RDLOCK(cache);
 
     ALLOC_INIT_ZVAL(info);
@@ -1256,17 +3221,21 @@ zval* apc_cache_info(apc_cache_t* cache, zend_bool limited TSRMLS_DC)
     }
 
     array_init(info);
-    add_assoc_long(info, "num_slots", cache->num_slots);
+    add_assoc_long(info, "num_slots", cache->header->num_slots);
+    add_assoc_long(info, "num_stripes", cache->num_stripes);
     add_assoc_long(info, "ttl", cache->ttl);
 
-    add_assoc_double(info, "num_hits", (double)cache->header->num_hits);
-    add_assoc_double(info, "num_misses", (double)cache->header->num_misses);
-    add_assoc_double(info, "num_inserts", (double)cache->header->num_inserts);
-    add_assoc_double(info, "expunges", (double)cache->header->expunges);
+    sum_stats(cache, &stats);
+    add_assoc_double(info, "num_hits", (double)stats.num_hits);
+    add_assoc_double(info, "num_misses", (double)stats.num_misses);
+    add_assoc_double(info, "num_inserts", (double)stats.num_inserts);
+    add_assoc_double(info, "expunges", (double)stats.expunges);
+    add_assoc_double(info, "compacted", (double)stats.compacted);
     
     add_assoc_long(info, "start_time", cache->header->start_time);
     add_assoc_double(info, "mem_size", (double)cache->header->mem_size);
     add_assoc_long(info, "num_entries", cache->header->num_entries);
+    add_assoc_long(info, "stale_entries", cache->header->stale_entries);
 #ifdef MULTIPART_EVENT_FORMDATA
     add_assoc_long(info, "file_upload_progress", 1);
 #else
@@ -1280,34 +3249,81 @@ zval* apc_cache_info(apc_cache_t* cache, zend_bool limited TSRMLS_DC)
     add_assoc_stringl(info, "locking_type", APC_LOCK_TYPE, sizeof(APC_LOCK_TYPE)-1, 1);
 
     if(!limited) {
-        /* For each hashtable slot */
         ALLOC_INIT_ZVAL(list);
         array_init(list);
 
         ALLOC_INIT_ZVAL(slots);
         array_init(slots);
+    }
 
-        for (i = 0; i < cache->num_slots; i++) {
-            p = cache->slots[i];
+    /* For each hashtable slot, of both tables while a rehash is in progress */
+    for (pass = 0; pass < 2; pass++) {
+        table = pass ? cache->header->old_slots : cache->header->slots;
+        n = pass ? cache->header->old_num_slots : cache->header->num_slots;
+        if (!table) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            p = table[i];
             j = 0;
             for (; p != NULL; p = p->next) {
-                zval *link = apc_cache_link_info(cache, p TSRMLS_CC);
-                add_next_index_zval(list, link);
+                if (p->generation != cache->header->generation) {
+                    /* cleared, and still to be reclaimed */
+                    continue;
+                }
+                if(!limited) {
+                    zval *link = apc_cache_link_info(cache, p TSRMLS_CC);
+                    add_next_index_zval(list, link);
+                }
                 j++;
             }
             if(j != 0) {
-                add_index_long(slots, (ulong)i, j);
+                used_slots++;
+                if(j > max_chain) {
+                    max_chain = j;
+                }
+                if(!limited && !pass) {
+                    add_index_long(slots, (ulong)i, j);
+                }
             }
         }
+    }
+
+    add_assoc_double(info, "load_factor", (double)cache->header->num_entries / cache->header->num_slots);
+    add_assoc_long(info, "used_slots", used_slots);
+    add_assoc_long(info, "max_chain_length", max_chain);
+    add_assoc_double(info, "avg_chain_length", used_slots ? (double)cache->header->num_entries / used_slots : 0.0);
+    add_assoc_bool(info, "rehashing", cache->header->old_slots != NULL);
+    if (cache->use_index) {
+        add_assoc_stringl(info, "slot_index", APC_INDEX_TYPE, sizeof(APC_INDEX_TYPE)-1, 1);
+    } else {
+        add_assoc_stringl(info, "slot_index", "chained", sizeof("chained")-1, 1);
+    }
+    add_assoc_bool(info, "optimistic_reads", cache->optimistic_reads);
+    add_assoc_bool(info, "write_free_hits", cache->write_free_hits);
+    add_assoc_bool(info, "admission_filter", cache->sketch != NULL);
+    add_assoc_bool(info, "prefilter", cache->bloom != NULL);
+    add_assoc_bool(info, "leases", cache->leases != NULL);
+    add_assoc_bool(info, "janitor", janitor_active(cache, time(0)));
+
+    if(!limited) {
 
         /* For each slot pending deletion */
         ALLOC_INIT_ZVAL(deleted_list);
         array_init(deleted_list);
 
+        CACHE_HEADER_LOCK(cache);
         for (p = cache->header->deleted_list; p != NULL; p = p->next) {
             zval *link = apc_cache_link_info(cache, p TSRMLS_CC);
             add_next_index_zval(deleted_list, link);
         }
+        for (i = 0; i < CACHE_RETIRE_BUCKETS; i++) {
+            for (p = cache->header->retired[i].list; p != NULL; p = p->next) {
+                zval *link = apc_cache_link_info(cache, p TSRMLS_CC);
+                add_next_index_zval(deleted_list, link);
+            }
+        }
+        CACHE_HEADER_UNLOCK(cache);
         
         add_assoc_zval(info, "cache_list", list);
         add_assoc_zval(info, "deleted_list", deleted_list);
@@ -1319,6 +3335,37 @@ zval* apc_cache_info(apc_cache_t* cache, zend_bool limited TSRMLS_DC)
 }
 /* }}} */
 
+/* {{{ apc_cache_lock_all */
+void apc_cache_lock_all(apc_cache_t* cache, zend_bool shared TSRMLS_DC)
+{
+    int i;
+
+    /* always in ascending order, so that two whole-cache lockers can't deadlock */
+    for (i = 0; i < cache->num_stripes; i++) {
+        if (shared) {
+            CACHE_STRIPE_RDLOCK(cache, i);
+        } else {
+            CACHE_STRIPE_LOCK(cache, i);
+        }
+    }
+}
+/* }}} */
+
+/* {{{ apc_cache_unlock_all */
+void apc_cache_unlock_all(apc_cache_t* cache, zend_bool shared TSRMLS_DC)
+{
+    int i;
+
+    for (i = cache->num_stripes - 1; i >= 0; i--) {
+        if (shared) {
+            CACHE_STRIPE_RDUNLOCK(cache, i);
+        } else {
+            CACHE_STRIPE_UNLOCK(cache, i);
+        }
+    }
+}
+/* }}} */
+
 /* {{{ apc_cache_unlock */
 void apc_cache_unlock(apc_cache_t* cache TSRMLS_DC)
 {
@@ -1333,32 +3380,63 @@ zend_bool apc_cache_busy(apc_cache_t* cache)
 }
 /* }}} */
 
-/* {{{ apc_cache_is_last_key */
-zend_bool apc_cache_is_last_key(apc_cache_t* cache, apc_cache_key_t* key, time_t t TSRMLS_DC)
+/* {{{ lease_key
+ * Leases tell keys apart by their bytes: the name of a user key or of a file
+ * cached by path, the device and inode of any other file. */
+static inline const char* lease_key(apc_cache_key_t* key, unsigned int* keylen)
 {
-    apc_keyid_t *lastkey = &cache->header->lastkey;
-    unsigned int keylen = key->data.user.identifier_len;
-#ifdef ZTS
-    THREAD_T tid = tsrm_thread_id();
-    #define FROM_DIFFERENT_THREAD(k) (memcmp(&((k)->tid), &tid, sizeof(THREAD_T))!=0)
-#else
-    pid_t pid = getpid();
-    #define FROM_DIFFERENT_THREAD(k) (pid != (k)->pid) 
-#endif
+    switch (key->type) {
+        case APC_CACHE_KEY_USER:
+            *keylen = key->data.user.identifier_len;
+            return key->data.user.identifier;
+        case APC_CACHE_KEY_FPFILE:
+            *keylen = key->data.fpfile.fullpath_len;
+            return key->data.fpfile.fullpath;
+        default:
+            *keylen = sizeof(key->data.file);
+            return (const char*) &key->data.file;
+    }
+}
+/* }}} */
 
+/* {{{ apc_cache_lease */
+zend_bool apc_cache_lease(apc_cache_t* cache, apc_cache_key_t* key TSRMLS_DC)
+{
+    const char* bytes;
+    unsigned int keylen;
 
-    /* unlocked reads, but we're not shooting for 100% success with this */
-    if(lastkey->h == key->h && keylen == lastkey->keylen) {
-        if(lastkey->mtime == t && FROM_DIFFERENT_THREAD(lastkey)) {
-            /* potential cache slam */
-            if(APCG(slam_defense)) {
-                apc_debug("Potential cache slam averted for key '%s'" TSRMLS_CC, key->data.user.identifier);
-                return 1;
-            }
-        }
+    if (!cache->leases) {
+        return 1;
+    }
+    bytes = lease_key(key, &keylen);
+    /* the request time may be long gone, leases run on the clock */
+    if (!apc_lease_acquire(cache->leases, key->h, bytes, keylen, time(NULL) TSRMLS_CC)) {
+        return 0;
     }
+    APCG(leased) = 1;
+    return 1;
+}
+/* }}} */
 
-    return 0;
+/* {{{ apc_cache_lease_release */
+void apc_cache_lease_release(apc_cache_t* cache, apc_cache_key_t* key TSRMLS_DC)
+{
+    const char* bytes;
+    unsigned int keylen;
+
+    if (cache->leases && APCG(leased)) {
+        bytes = lease_key(key, &keylen);
+        apc_lease_release(cache->leases, key->h, bytes, keylen TSRMLS_CC);
+    }
+}
+/* }}} */
+
+/* {{{ apc_cache_release_leases */
+void apc_cache_release_leases(apc_cache_t* cache TSRMLS_DC)
+{
+    if (cache && cache->leases) {
+        apc_lease_release_all(cache->leases TSRMLS_CC);
+    }
 }
 /* }}} */
 
@@ -40,6 +40,11 @@
 #include "apc_compile.h"
 #include "apc_lock.h"
 #include "apc_pool.h"
+#include "apc_index.h"
+#include "apc_epoch.h"
+#include "apc_sketch.h"
+#include "apc_bloom.h"
+#include "apc_lease.h"
 #include "apc_main.h"
 #include "TSRM.h"
 
@@ -58,24 +63,69 @@ typedef ino_t apc_ino_t;
 typedef dev_t apc_dev_t;
 #endif
 
-/* {{{ cache locking macros */
-#define CACHE_LOCK(cache)        { LOCK(cache->header->lock);   cache->has_lock = 1; }
-#define CACHE_UNLOCK(cache)      { UNLOCK(cache->header->lock); cache->has_lock = 0; }
-#define CACHE_SAFE_LOCK(cache)   { if ((++cache->has_lock) == 1) LOCK(cache->header->lock); }
-#define CACHE_SAFE_UNLOCK(cache) { if ((--cache->has_lock) == 0) UNLOCK(cache->header->lock); }
+/* {{{ cache locking macros
+ * The slot array is partitioned into cache->num_stripes lock stripes; slot i
+ * belongs to stripe i % num_stripes. Single key operations only take the
+ * stripe of their slot, the CACHE_LOCK family takes every stripe (in order)
+ * for whole-cache operations. The header lock is always taken last and only
+ * guards the deleted list and the shared bookkeeping in the header.
+ * Taking every stripe doesn't complete a pending rehash: whole-cache walkers
+ * look at header->old_slots too, and skip the slots of older generations. */
+#define CACHE_STRIPE_OF(cache, h)  ((h) % (cache)->num_stripes)
+#define CACHE_STRIPE(cache, s)     ((cache_stripe_t*)(((char*)(cache)->stripes) + (s) * CACHE_STRIPE_SIZE))
+
+#define CACHE_LOCK(cache)        { apc_cache_lock_all(cache, 0 TSRMLS_CC); cache->has_lock = 1; }
+#define CACHE_UNLOCK(cache)      { cache->has_lock = 0; apc_cache_unlock_all(cache, 0 TSRMLS_CC); }
+#define CACHE_SAFE_LOCK(cache)   { if ((++cache->has_lock) == 1) apc_cache_lock_all(cache, 0 TSRMLS_CC); }
+#define CACHE_SAFE_UNLOCK(cache) { if ((--cache->has_lock) == 0) apc_cache_unlock_all(cache, 0 TSRMLS_CC); }
+
+/* Holders of a stripe's write lock keep its sequence odd, so that lock-free
+ * readers can tell whether the stripe changed under them (see the lock-free
+ * lookups in apc_cache.c). */
+#if APC_EPOCH_AVAILABLE
+#define CACHE_STRIPE_WRITE_BEGIN(cache, s) { CACHE_STRIPE(cache, s)->seq++; APC_WMB(); }
+#define CACHE_STRIPE_WRITE_END(cache, s)   { APC_WMB(); CACHE_STRIPE(cache, s)->seq++; }
+#else
+#define CACHE_STRIPE_WRITE_BEGIN(cache, s)
+#define CACHE_STRIPE_WRITE_END(cache, s)
+#endif
+
+#define CACHE_STRIPE_LOCK(cache, s)     { LOCK(CACHE_STRIPE(cache, s)->lock); CACHE_STRIPE_WRITE_BEGIN(cache, s); }
+#define CACHE_STRIPE_UNLOCK(cache, s)   { CACHE_STRIPE_WRITE_END(cache, s); UNLOCK(CACHE_STRIPE(cache, s)->lock); }
+
+#define CACHE_HEADER_LOCK(cache)   LOCK(cache->header->lock)
+#define CACHE_HEADER_UNLOCK(cache) UNLOCK(cache->header->lock)
 
 #if (RDLOCK_AVAILABLE == 1) && defined(HAVE_ATOMIC_OPERATIONS)
 #define USE_READ_LOCKS 1
-#define CACHE_RDLOCK(cache)        { RDLOCK(cache->header->lock);  cache->has_lock = 0; }
-#define CACHE_RDUNLOCK(cache)      { RDUNLOCK(cache->header->lock);  cache->has_lock = 0; }
+#define CACHE_RDLOCK(cache)        { apc_cache_lock_all(cache, 1 TSRMLS_CC);  cache->has_lock = 0; }
+#define CACHE_RDUNLOCK(cache)      { apc_cache_unlock_all(cache, 1 TSRMLS_CC);  cache->has_lock = 0; }
+#define CACHE_STRIPE_RDLOCK(cache, s)   RDLOCK(CACHE_STRIPE(cache, s)->lock)
+#define CACHE_STRIPE_RDUNLOCK(cache, s) RDUNLOCK(CACHE_STRIPE(cache, s)->lock)
 #define CACHE_SAFE_INC(cache, obj) { ATOMIC_INC(obj); }
 #define CACHE_SAFE_DEC(cache, obj) { ATOMIC_DEC(obj); }
 #else
 #define USE_READ_LOCKS 0
-#define CACHE_RDLOCK(cache)        { LOCK(cache->header->lock);  cache->has_lock = 1; }
-#define CACHE_RDUNLOCK(cache)      { UNLOCK(cache->header->lock);  cache->has_lock = 0; }
-#define CACHE_SAFE_INC(cache, obj) { CACHE_SAFE_LOCK(cache); obj++; CACHE_SAFE_UNLOCK(cache);}
-#define CACHE_SAFE_DEC(cache, obj) { CACHE_SAFE_LOCK(cache); obj--; CACHE_SAFE_UNLOCK(cache);}
+#define CACHE_RDLOCK(cache)        { apc_cache_lock_all(cache, 0 TSRMLS_CC);  cache->has_lock = 1; }
+#define CACHE_RDUNLOCK(cache)      { cache->has_lock = 0; apc_cache_unlock_all(cache, 0 TSRMLS_CC); }
+#define CACHE_STRIPE_RDLOCK(cache, s)   CACHE_STRIPE_LOCK(cache, s)
+#define CACHE_STRIPE_RDUNLOCK(cache, s) CACHE_STRIPE_UNLOCK(cache, s)
+#define CACHE_SAFE_INC(cache, obj) { CACHE_HEADER_LOCK(cache); obj++; CACHE_HEADER_UNLOCK(cache); }
+#define CACHE_SAFE_DEC(cache, obj) { CACHE_HEADER_LOCK(cache); obj--; CACHE_HEADER_UNLOCK(cache); }
+#endif
+
+/* header statistics written by holders of different stripes */
+#ifdef ATOMIC_ADD
+#define CACHE_STAT_ADD(cache, obj, n) { ATOMIC_ADD(obj, n); }
+#else
+#define CACHE_STAT_ADD(cache, obj, n) { CACHE_HEADER_LOCK(cache); obj += (n); CACHE_HEADER_UNLOCK(cache); }
+#endif
+
+/* counters of a stats shard, which more than one worker may count in */
+#ifdef HAVE_ATOMIC_OPERATIONS
+#define CACHE_STAT_INC(cache, obj) { ATOMIC_INC(obj); }
+#else
+#define CACHE_STAT_INC(cache, obj) CACHE_STAT_ADD(cache, obj, 1)
 #endif
 
 #define CACHE_FAST_INC(cache, obj) { obj++; }
@@ -109,20 +159,6 @@ struct apc_cache_key_t {
     unsigned char type;
     unsigned char md5[16];        /* md5 hash of the source file */
 };
-
-
-typedef struct apc_keyid_t apc_keyid_t;
-
-struct apc_keyid_t {
-    unsigned int h;
-    unsigned int keylen;
-    time_t mtime;
-#ifdef ZTS
-    THREAD_T tid;
-#else
-    pid_t pid;
-#endif
-};
 /* }}} */
 
 /* {{{ struct definition: apc_cache_entry_t */
@@ -133,13 +169,16 @@ typedef union _apc_cache_entry_value_t {
         apc_function_t* functions;  /* array of apc_function_t's */
         apc_class_t* classes;       /* array of apc_class_t's */
         long halt_offset;           /* value of __COMPILER_HALT_OFFSET__ for the file */
-        zend_uint *exec_refcount;   /* refcount member of zend_op_array refreshed before execution */
+        unsigned int cost;          /* microseconds it took to compile and copy in the file */
     } file;
     struct {
         char *info;
         int info_len;
         zval *val;
         unsigned int ttl;
+        unsigned int grace;         /* seconds past the ttl a stale entry may still be served */
+        unsigned int cost;          /* microseconds from the miss of the key to its store, 0 if unknown */
+        double beta;                /* eagerness of early refreshes ahead of the ttl, 0 for none */
     } user;
 } apc_cache_entry_value_t;
 
@@ -160,8 +199,9 @@ struct apc_cache_entry_t {
  * necessarily break anything). Returns a pointer to the cache object.
  *
  * size_hint is a "hint" at the total number of source files that will be
- * cached. It determines the physical size of the hash table. Passing 0 for
- * this argument will use a reasonable default value.
+ * cached. It determines the initial size of the hash table, which grows once
+ * the cache holds more entries than it has slots. Passing 0 for this
+ * argument will use a reasonable default value.
  *
  * gc_ttl is the maximum time a cache entry may speed on the garbage
  * collection list. This is basically a work around for the inherent
@@ -170,8 +210,11 @@ struct apc_cache_entry_t {
  * ttl is the maximum time a cache entry can idle in a slot in case the slot
  * is needed.  This helps in cleaning up the cache and ensuring that entries 
  * hit frequently stay cached and ones not hit very often eventually disappear.
+ *
+ * num_stripes is the number of locks the slot array is partitioned into, so
+ * that operations on unrelated keys do not serialize on a single lock.
  */
-extern T apc_cache_create(int size_hint, int gc_ttl, int ttl TSRMLS_DC);
+extern T apc_cache_create(int size_hint, int gc_ttl, int ttl, int num_stripes TSRMLS_DC);
 
 /*
  * apc_cache_destroy releases any OS resources associated with a cache object.
@@ -183,6 +226,9 @@ extern void apc_cache_destroy(T cache TSRMLS_DC);
 /*
  * apc_cache_clear empties a cache. This can safely be called at any time,
  * even while other server processes are executing cached source files.
+ * The entries aren't removed right away: the cache moves on to a new
+ * generation and an empty slot table, and the entries of the old one are
+ * reclaimed as writers, expunges and the janitor come across them.
  */
 extern void apc_cache_clear(T cache TSRMLS_DC);
 
@@ -224,6 +270,14 @@ extern apc_cache_entry_t* apc_cache_find(T cache, apc_cache_key_t key, time_t t
  */
 extern apc_cache_entry_t* apc_cache_user_find(T cache, char* strkey, int keylen, time_t t TSRMLS_DC);
 
+/*
+ * apc_cache_user_find_stale is apc_cache_user_find, except that an entry past
+ * its ttl but within its grace period is returned as well, with stale set.
+ * Entries stored with a beta are also reported stale, at random, as their ttl
+ * draws near (see user_early).
+ */
+extern apc_cache_entry_t* apc_cache_user_find_stale(T cache, char* strkey, int keylen, time_t t, zend_bool* stale TSRMLS_DC);
+
 /*
  * apc_cache_user_exists searches for a cache entry by its hashed identifier,
  * and returns a pointer to the entry if found, NULL otherwise.  This is a
@@ -307,9 +361,133 @@ struct slot_t {
     apc_cache_entry_t* value;   /* slot value */
     slot_t* next;               /* next slot in linked list */
     unsigned long num_hits;     /* number of hits to this bucket */
-    time_t creation_time;       /* time slot was initialized */
     time_t deletion_time;       /* time slot was removed from cache */
-    time_t access_time;         /* time slot was last accessed */
+    unsigned long deletion_epoch; /* reader epoch the slot was retired in */
+    unsigned int id;            /* entry of this slot in the cache directory */
+    unsigned int generation;    /* cache generation the slot was inserted in */
+    zend_bool moved;            /* replaced by a copy elsewhere, which took over its id */
+};
+/* }}} */
+
+/* {{{ struct definition: cache_dir_chunk_t
+   The cache directory keeps what sweeps over the whole cache look at in
+   dense parallel arrays, so that an expunge scans memory sequentially instead
+   of touching one pool block per entry. A slot's id indexes into it; chunks
+   are allocated as the cache fills up and never move. An id stays reserved
+   until its slot is freed, so the times of slots on the deleted list remain
+   readable. */
+#define CACHE_DIR_CHUNK_SIZE 1024
+#define CACHE_DIR_NONE       ((unsigned int)-1)
+
+typedef struct cache_dir_chunk_t cache_dir_chunk_t;
+struct cache_dir_chunk_t {
+    slot_t* slot[CACHE_DIR_CHUNK_SIZE];             /* slot in the cache, NULL once removed */
+    unsigned long h[CACHE_DIR_CHUNK_SIZE];          /* key hash, locates the slot's chain */
+    time_t creation_time[CACHE_DIR_CHUNK_SIZE];     /* time slot was initialized */
+    time_t access_time[CACHE_DIR_CHUNK_SIZE];       /* time slot was last accessed */
+    time_t expires[CACHE_DIR_CHUNK_SIZE];           /* hard expiry of a user entry, 0 for none */
+    unsigned char type[CACHE_DIR_CHUNK_SIZE];       /* type of the entry */
+    unsigned char referenced[CACHE_DIR_CHUNK_SIZE]; /* hit since the clock hand last passed */
+    double base[CACHE_DIR_CHUNK_SIZE];              /* eviction priority inflation when last used */
+    unsigned int next_free[CACHE_DIR_CHUNK_SIZE];   /* free list link of unused ids */
+    unsigned int wheel_next[CACHE_DIR_CHUNK_SIZE];  /* timer wheel bucket links of entries that expire */
+    unsigned int wheel_prev[CACHE_DIR_CHUNK_SIZE];
+    unsigned short wheel_bucket[CACHE_DIR_CHUNK_SIZE]; /* timer wheel bucket, CACHE_WHEEL_NONE if not in the wheel */
+};
+
+#define CACHE_DIR_CHUNK(cache, id)      ((cache)->header->dir[(id) / CACHE_DIR_CHUNK_SIZE])
+#define CACHE_DIR_POS(id)               ((id) % CACHE_DIR_CHUNK_SIZE)
+#define SLOT_CREATION_TIME(cache, s)    CACHE_DIR_CHUNK(cache, (s)->id)->creation_time[CACHE_DIR_POS((s)->id)]
+#define SLOT_ACCESS_TIME(cache, s)      CACHE_DIR_CHUNK(cache, (s)->id)->access_time[CACHE_DIR_POS((s)->id)]
+#define SLOT_EXPIRES(cache, s)          CACHE_DIR_CHUNK(cache, (s)->id)->expires[CACHE_DIR_POS((s)->id)]
+#define SLOT_REFERENCED(cache, s)       CACHE_DIR_CHUNK(cache, (s)->id)->referenced[CACHE_DIR_POS((s)->id)]
+/* }}} */
+
+/* {{{ struct definition: cache_stripe_t
+   One lock stripe, laid out in SHM right after the cache header. Stripes are
+   CACHE_STRIPE_SIZE apart so that two locks never share a cache line. */
+typedef struct cache_stripe_t cache_stripe_t;
+struct cache_stripe_t {
+    apc_lck_t lock;             /* read/write lock for the slots of this stripe */
+    volatile unsigned int seq;  /* odd while a writer holds the stripe */
+    int rehash_pos;             /* next old table bucket of this stripe to migrate */
+    apc_index_t index;          /* user cache index over the slots of this stripe */
+};
+
+#define CACHE_LINE_SIZE    64
+#define CACHE_STRIPE_SIZE  ((sizeof(cache_stripe_t) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1))
+#define CACHE_MAX_STRIPES  256
+
+/* {{{ struct definition: cache_stats_t
+   Counters of the workers that share a stats shard, which count in it with
+   CACHE_STAT_INC. The shards are a cache line apart and only summed up for
+   apc_cache_info(). */
+typedef struct cache_stats_t cache_stats_t;
+struct cache_stats_t {
+    unsigned long num_hits;     /* successful hits */
+    unsigned long num_misses;   /* unsuccessful hits */
+    unsigned long num_inserts;  /* successful inserts */
+    unsigned long expunges;     /* expunges */
+    unsigned long compacted;    /* entries moved by compaction */
+};
+
+#define CACHE_STATS_SHARDS 16
+#define CACHE_STATS_SIZE   ((sizeof(cache_stats_t) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1))
+#define CACHE_STATS(cache, i)  ((cache_stats_t*)(((char*)(cache)->stats) + (i) * CACHE_STATS_SIZE))
+#define CACHE_MY_STATS(cache)  CACHE_STATS(cache, APCG(stats_shard))
+/* }}} */
+
+/* {{{ struct definition: cache_retired_t
+   A bucket of slots that were removed while lock-free readers might still
+   reach them. The bucket goes as a whole once no reader or pin is older than
+   the newest of them, or once the oldest of them is older than gc_ttl. */
+typedef struct cache_retired_t cache_retired_t;
+struct cache_retired_t {
+    slot_t* list;               /* slots retired into this bucket */
+    unsigned long epoch;        /* newest reader epoch they were retired in */
+    unsigned int count;         /* slots in list */
+    time_t time;                /* deletion time of the first slot retired into it */
+};
+
+#define CACHE_RETIRE_BUCKETS 8  /* buckets in the ring of retired slots */
+#define CACHE_RETIRE_BATCH   64 /* slots a bucket takes before the next one is opened */
+/* }}} */
+
+#define CACHE_GDSF_SAMPLE  8    /* unused file entries compared per eviction */
+#define CACHE_ADMIT_WINDOW 64   /* directory ids searched for the next victim on admission */
+#define CACHE_SKETCH_SAMPLE 8   /* the admission sketch counts one lookup in about as many */
+#define CACHE_SKETCH_AGE_STEP 16384 /* sketch counters an insert halves at a time */
+#define CACHE_MAINTAIN_STEP 16384 /* bytes the janitor evicts at a time to reach its watermark */
+#define CACHE_COMPACT_FRAGMENTATION 0.5 /* share of free memory off the largest blocks that calls for compaction */
+#define CACHE_COMPACT_VISITS 16 /* directory ids a compaction round looks at per entry it may move */
+#define CACHE_COMPACT_STEP 16   /* entries a store may move, once a second, when there is no janitor */
+
+/* The timer wheel has CACHE_WHEEL_LEVELS levels of CACHE_WHEEL_SIZE buckets,
+ * a bucket of level n spanning 64^n seconds: about an hour ahead fits in the
+ * first two levels, half a year in all four. */
+#define CACHE_WHEEL_BITS   6
+#define CACHE_WHEEL_SIZE   (1 << CACHE_WHEEL_BITS)
+#define CACHE_WHEEL_LEVELS 4
+#define CACHE_WHEEL_SPAN   ((time_t)1 << (CACHE_WHEEL_BITS * CACHE_WHEEL_LEVELS))
+#define CACHE_WHEEL_NONE   0xffff
+#define CACHE_WHEEL_BATCH  64   /* expired entries an insert removes at most */
+
+#define CACHE_MAX_LOAD     1    /* grow the slot table past this many entries per slot */
+#define CACHE_REHASH_STEP  4    /* old table buckets migrated per write */
+#define CACHE_GROW_RETRY   10   /* seconds to wait after a failed table allocation */
+
+#define CACHE_LOCAL_BATCH  256  /* lookups a process counts before adding them to the header */
+#define CACHE_HIT_SAMPLE   16   /* hits per sampled update of a slot's hit count */
+/* }}} */
+
+/* {{{ struct definition: cache_stale_table_t
+   A slot table that a clear dropped while a rehash was still migrating it.
+   Everything left in it is of an older generation, and waits to be drained. */
+typedef struct cache_stale_table_t cache_stale_table_t;
+struct cache_stale_table_t {
+    slot_t** slots;             /* the table */
+    int num_slots;              /* number of slots in it */
+    cache_stale_table_t* next;  /* the table dropped before, if that one is still there */
 };
 /* }}} */
 
@@ -317,18 +495,41 @@ struct slot_t {
    Any values that must be shared among processes should go in here. */
 typedef struct cache_header_t cache_header_t;
 struct cache_header_t {
-    apc_lck_t lock;             /* read/write lock (exclusive blocking cache lock) */
+    apc_lck_t lock;             /* header lock (deleted list and shared bookkeeping), taken after any stripe */
     apc_lck_t wrlock;           /* write lock (non-blocking used to prevent cache slams) */
-    unsigned long num_hits;     /* total successful hits in cache */
-    unsigned long num_misses;   /* total unsuccessful hits in cache */
-    unsigned long num_inserts;  /* total successful inserts in cache */
-    unsigned long expunges;     /* total number of expunges */
-    slot_t* deleted_list;       /* linked list of to-be-deleted slots */
+    apc_lck_t expunge_lock;     /* one expunge at a time, taken before any stripe */
+    slot_t* deleted_list;       /* linked list of to-be-deleted slots that are still referenced */
+    time_t gc_time;             /* last time deleted_list was scanned on an insert */
+    time_t janitor_time;        /* last time the janitor started a round */
+    cache_retired_t retired[CACHE_RETIRE_BUCKETS]; /* ring of retired slots, oldest at retired_tail */
+    unsigned int retired_head;  /* bucket retired slots go into */
+    unsigned int retired_tail;  /* oldest bucket */
     time_t start_time;          /* time the above counters were reset */
     zend_bool busy;             /* Flag to tell clients when we are busy cleaning the cache */
     int num_entries;            /* Statistic on the number of entries */
     size_t mem_size;            /* Statistic on the memory size used by this cache */
-    apc_keyid_t lastkey;        /* the key that is being inserted (user cache) */
+    slot_t** slots;             /* array of cache slots */
+    int num_slots;              /* number of slots in cache, a multiple of the stripe count */
+    slot_t** old_slots;         /* table being migrated into slots, NULL unless rehashing */
+    int old_num_slots;          /* number of slots in old_slots */
+    int rehash_stripes;         /* stripes which still have buckets in old_slots */
+    cache_stale_table_t* stale_tables; /* tables dropped by clears, newest first */
+    unsigned int generation;    /* bumped by every clear, slots of older generations are dead */
+    int stale_entries;          /* entries of older generations that are still to be reclaimed */
+    size_t stale_size;          /* memory size of those */
+    time_t grow_failed;         /* last time the table could not be grown */
+    cache_dir_chunk_t** dir;    /* chunks of the cache directory */
+    unsigned int dir_chunks;    /* number of chunks allocated */
+    unsigned int dir_max_chunks;/* size of dir */
+    unsigned int dir_free;      /* first unused id, or CACHE_DIR_NONE */
+    unsigned int clock_hand;    /* next directory id the eviction clock looks at */
+    unsigned int sweep_pos;     /* next directory id the expunge of a cache with a ttl looks at */
+    unsigned int compact_pos;   /* next directory id the compaction looks at */
+    time_t compact_time;        /* last time a store compacted in place of the janitor */
+    double inflation;           /* priority of the last file entry evicted (GDSF) */
+    unsigned int wheel[CACHE_WHEEL_LEVELS * CACHE_WHEEL_SIZE]; /* timer wheel buckets of user entries with a ttl */
+    time_t wheel_time;          /* next second the timer wheel expires entries of */
+    unsigned int wheel_count;   /* entries in the timer wheel */
 };
 /* }}} */
 
@@ -338,8 +539,21 @@ typedef void (*apc_expunge_cb_t)(T cache, size_t n TSRMLS_DC);
 struct apc_cache_t {
     void* shmaddr;                /* process (local) address of shared cache */
     cache_header_t* header;       /* cache header (stored in SHM) */
-    slot_t** slots;               /* array of cache slots (stored in SHM) */
-    int num_slots;                /* number of slots in cache */
+    cache_stripe_t* stripes;      /* array of lock stripes (stored in SHM) */
+    cache_stats_t* stats;         /* CACHE_STATS_SHARDS counter shards (stored in SHM) */
+    int num_stripes;              /* number of lock stripes */
+    zend_bool use_index;          /* look user entries up through the stripe indexes */
+    zend_bool optimistic_reads;   /* lookups run without locks, see apc_epoch.h */
+    int epoch_pin;                /* the epoch pin that holds entries of this cache */
+    apc_sketch_t* sketch;         /* access frequencies for admission (stored in SHM), NULL if disabled */
+    apc_bloom_t* bloom;           /* filter of the keys in the cache (stored in SHM), NULL if disabled */
+    apc_lease_table_t* leases;    /* leases on keys that are being rebuilt (stored in SHM), NULL if disabled */
+    zend_bool write_free_hits;    /* hits don't write to shared memory, lookups are counted locally */
+    long janitor;                 /* seconds between the rounds of the janitor process, 0 for none */
+    unsigned long local_hits;     /* hits not yet added to the header (write_free_hits) */
+    unsigned long local_misses;   /* misses not yet added to the header (write_free_hits) */
+    unsigned int hit_tick;        /* hits since a slot's hit count was last sampled (write_free_hits) */
+    unsigned int sketch_seed;     /* picks the lookups the admission sketch counts */
     int gc_ttl;                   /* maximum time on GC list for a slot */
     int ttl;                      /* if slot is needed and entry's access time is older than this ttl, remove it */
     apc_expunge_cb_t expunge_cb;  /* cache specific expunge callback to free up sma memory */
@@ -348,11 +562,32 @@ struct apc_cache_t {
 /* }}} */
 
 extern zval* apc_cache_info(T cache, zend_bool limited TSRMLS_DC);
+extern void apc_cache_flush_stats(T cache TSRMLS_DC);
+extern void apc_cache_stats_activate(TSRMLS_D);
+extern zend_bool apc_cache_user_admit(apc_cache_t* cache, apc_cache_key_t* key TSRMLS_DC);
+extern void apc_cache_maintain(apc_cache_t* cache, size_t keep_free TSRMLS_DC);
+extern int apc_cache_compact(apc_cache_t* cache, int budget TSRMLS_DC);
+extern void apc_cache_lock_all(apc_cache_t* cache, zend_bool shared TSRMLS_DC);
+extern void apc_cache_unlock_all(apc_cache_t* cache, zend_bool shared TSRMLS_DC);
 extern void apc_cache_unlock(apc_cache_t* cache TSRMLS_DC);
 extern zend_bool apc_cache_busy(apc_cache_t* cache);
 extern zend_bool apc_cache_write_lock(apc_cache_t* cache TSRMLS_DC);
 extern void apc_cache_write_unlock(apc_cache_t* cache TSRMLS_DC);
-extern zend_bool apc_cache_is_last_key(apc_cache_t* cache, apc_cache_key_t* key, time_t t TSRMLS_DC);
+
+/*
+ * apc_cache_lease is called after a miss on key: returns 1 if the caller
+ * takes (or holds) the lease on the key and is expected to rebuild it, 0 if
+ * another process is rebuilding it already. Without leases it returns 1.
+ */
+extern zend_bool apc_cache_lease(apc_cache_t* cache, apc_cache_key_t* key TSRMLS_DC);
+
+/*
+ * apc_cache_lease_release gives back the caller's lease on key once it has
+ * been stored (or couldn't be); apc_cache_release_leases gives back all of
+ * them at the end of a request.
+ */
+extern void apc_cache_lease_release(apc_cache_t* cache, apc_cache_key_t* key TSRMLS_DC);
+extern void apc_cache_release_leases(apc_cache_t* cache TSRMLS_DC);
 
 /* used by apc_rfc1867 to update data in-place - not to be used elsewhere */
 
@@ -324,7 +324,7 @@ static APC_HOTSPOT zval* my_copy_zval(zval* dst, const zval* src, apc_context_t*
     }
 
 
-    if(ctxt->copy == APC_COPY_OUT_USER || ctxt->copy == APC_COPY_IN_USER) {
+    if(ctxt->copy == APC_COPY_OUT_USER || ctxt->copy == APC_COPY_IN_USER || ctxt->copy == APC_COPY_MOVE_USER) {
         /* deep copies are refcount(1), but moved up for recursive 
          * arrays,  which end up being add_ref'd during its copy. */
         Z_SET_REFCOUNT_P(dst, 1);
@@ -369,7 +369,12 @@ static APC_HOTSPOT zval* my_copy_zval(zval* dst, const zval* src, apc_context_t*
         }
 
     case IS_OBJECT:
-    
+
+        if(ctxt->copy == APC_COPY_MOVE_USER) {
+            /* stored serialized, the string moves as it is */
+            CHECK(dst->value.str.val = apc_pmemcpy(src->value.str.val, src->value.str.len + 1, pool TSRMLS_CC));
+            break;
+        }
         dst->type = IS_NULL;
         if(ctxt->copy == APC_COPY_IN_USER) {
             dst = my_serialize_object(dst, src, ctxt TSRMLS_CC);
@@ -0,0 +1,346 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+   This software was contributed to PHP by Community Connect Inc. in 2002
+   and revised in 2005 by Yahoo! Inc. to add support for PHP 5.1.
+   Future revisions and derivatives of this source code must acknowledge
+   Community Connect Inc. as the original contributor of this module by
+   leaving this note intact in the source code.
+
+   All other licensing and usage conditions are those of the PHP Group.
+
+ */
+
+/* $Id$ */
+
+#include "apc_epoch.h"
+#include "apc_sma.h"
+#include "apc_globals.h"
+
+#ifndef PHP_WIN32
+# include <sched.h>
+# include <signal.h>
+#endif
+#include <errno.h>
+
+apc_epoch_t* apc_epoch = NULL;
+
+#if APC_EPOCH_AVAILABLE
+
+/* workers are a cache line apart, so that a read only writes its own line */
+#define EPOCH_WORKER_SIZE   64
+#define EPOCH_WORKER(e, i)  ((apc_epoch_worker_t*)(((char*)(e)->workers) + (i) * EPOCH_WORKER_SIZE))
+
+#define EPOCH_NO_SLOT      -1   /* not registered yet */
+#define EPOCH_REAPING      -1   /* owner of a slot whose dead worker is being cleared */
+#define EPOCH_REGISTRY_FULL -2  /* no slot left, read under the locks until the next request */
+
+#define EPOCH_SPINS        1000 /* busy waits before synchronize yields the CPU */
+#define EPOCH_LIVENESS     100  /* yields before synchronize checks for dead readers */
+
+/* {{{ epoch_self */
+static inline long epoch_self(void)
+{
+#ifdef ZTS
+    return (long)tsrm_thread_id();
+#else
+    return (long)getpid();
+#endif
+}
+/* }}} */
+
+/* {{{ epoch_owner_dead
+ * A worker that died in the middle of a read would hold back reclamation
+ * forever. Threads can't be checked from the outside, and always count as
+ * alive. */
+static int epoch_owner_dead(long owner)
+{
+#if defined(ZTS) || defined(PHP_WIN32)
+    return 0;
+#else
+    return owner > 0 && kill((pid_t)owner, 0) == -1 && errno == ESRCH;
+#endif
+}
+/* }}} */
+
+/* {{{ epoch_yield */
+static inline void epoch_yield(void)
+{
+#ifdef PHP_WIN32
+    Sleep(0);
+#else
+    sched_yield();
+#endif
+}
+/* }}} */
+
+/* {{{ apc_epoch_create */
+apc_epoch_t* apc_epoch_create(int max_workers TSRMLS_DC)
+{
+    apc_epoch_t* epoch;
+    size_t size = sizeof(apc_epoch_t) + EPOCH_WORKER_SIZE + (size_t)max_workers * EPOCH_WORKER_SIZE;
+
+    epoch = (apc_epoch_t*) apc_sma_malloc(size TSRMLS_CC);
+    if (!epoch) {
+        return NULL;
+    }
+    memset(epoch, 0, size);
+
+    epoch->global = 1;
+    epoch->num_workers = 0;
+    epoch->max_workers = max_workers;
+    epoch->workers = (apc_epoch_worker_t*) ((((size_t) epoch) + sizeof(apc_epoch_t) + EPOCH_WORKER_SIZE - 1) & ~((size_t) EPOCH_WORKER_SIZE - 1));
+
+    return epoch;
+}
+/* }}} */
+
+/* {{{ epoch_register
+ * Claims a free registry slot, or the slot of a worker that has exited. */
+static int epoch_register(TSRMLS_D)
+{
+    long self = epoch_self();
+    apc_epoch_worker_t* w;
+    long owner, n;
+    int i;
+
+    for (i = 0; i < apc_epoch->max_workers; i++) {
+        w = EPOCH_WORKER(apc_epoch, i);
+        owner = w->owner;
+        if ((owner == 0 || (i < apc_epoch->num_workers && epoch_owner_dead(owner)))
+            && ATOMIC_CAS(w->owner, owner, self)) {
+            w->epoch = 0;
+            memset((void*)w->pin, 0, sizeof(w->pin));
+            while ((n = apc_epoch->num_workers) <= i && !ATOMIC_CAS(apc_epoch->num_workers, n, i + 1));
+            APCG(epoch_owner) = self;
+            return APCG(epoch_worker) = i;
+        }
+    }
+
+    return APCG(epoch_worker) = EPOCH_REGISTRY_FULL;
+}
+/* }}} */
+
+/* {{{ apc_epoch_activate */
+void apc_epoch_activate(TSRMLS_D)
+{
+    if (APCG(epoch_worker) == EPOCH_REGISTRY_FULL || APCG(epoch_owner) != epoch_self()) {
+        APCG(epoch_worker) = EPOCH_NO_SLOT;
+        memset(APCG(epoch_holds), 0, sizeof(APCG(epoch_holds)));
+    }
+}
+/* }}} */
+
+/* {{{ apc_epoch_release */
+void apc_epoch_release(TSRMLS_D)
+{
+    apc_epoch_worker_t* w;
+
+    if (!apc_epoch || APCG(epoch_worker) < 0 || APCG(epoch_owner) != epoch_self()) {
+        return;
+    }
+    w = EPOCH_WORKER(apc_epoch, APCG(epoch_worker));
+    w->epoch = 0;
+    memset((void*)w->pin, 0, sizeof(w->pin));
+    memset(APCG(epoch_holds), 0, sizeof(APCG(epoch_holds)));
+    ATOMIC_CAS(w->owner, APCG(epoch_owner), 0);
+    APCG(epoch_worker) = EPOCH_NO_SLOT;
+}
+/* }}} */
+
+/* {{{ apc_epoch_enter */
+int apc_epoch_enter(TSRMLS_D)
+{
+    int i = APCG(epoch_worker);
+
+    if (i < 0 && (i == EPOCH_REGISTRY_FULL || (i = epoch_register(TSRMLS_C)) < 0)) {
+        return 0;
+    }
+
+    EPOCH_WORKER(apc_epoch, i)->epoch = apc_epoch->global;
+    /* the epoch must be visible before anything shared is read */
+    APC_MB();
+    return 1;
+}
+/* }}} */
+
+/* {{{ apc_epoch_leave */
+void apc_epoch_leave(TSRMLS_D)
+{
+    /* every read of the section happens before the worker shows up as idle */
+    APC_MB();
+    EPOCH_WORKER(apc_epoch, APCG(epoch_worker))->epoch = 0;
+}
+/* }}} */
+
+/* {{{ apc_epoch_pin */
+int apc_epoch_pin(int which TSRMLS_DC)
+{
+    apc_epoch_worker_t* w;
+    int i = APCG(epoch_worker);
+
+    if (APCG(epoch_holds)[which]++) {
+        return 1;
+    }
+    if (i < 0 && (i == EPOCH_REGISTRY_FULL || (i = epoch_register(TSRMLS_C)) < 0)) {
+        APCG(epoch_holds)[which] = 0;
+        return 0;
+    }
+
+    /* inside a read the read's epoch covers what it found, under a lock
+     * nothing it found can be retired before the lock is released */
+    w = EPOCH_WORKER(apc_epoch, i);
+    w->pin[which] = w->epoch ? w->epoch : apc_epoch->global;
+    APC_MB();
+    return 1;
+}
+/* }}} */
+
+/* {{{ apc_epoch_unpin */
+void apc_epoch_unpin(int which TSRMLS_DC)
+{
+    if (--APCG(epoch_holds)[which] > 0) {
+        return;
+    }
+    APC_MB();
+    EPOCH_WORKER(apc_epoch, APCG(epoch_worker))->pin[which] = 0;
+}
+/* }}} */
+
+/* {{{ apc_epoch_unpin_all */
+void apc_epoch_unpin_all(TSRMLS_D)
+{
+    int which;
+
+    for (which = 0; which < APC_EPOCH_PINS; which++) {
+        if (APCG(epoch_holds)[which]) {
+            APCG(epoch_holds)[which] = 0;
+            APC_MB();
+            EPOCH_WORKER(apc_epoch, APCG(epoch_worker))->pin[which] = 0;
+        }
+    }
+}
+/* }}} */
+
+/* {{{ apc_epoch_retire */
+unsigned long apc_epoch_retire(TSRMLS_D)
+{
+    return ATOMIC_INC(apc_epoch->global);
+}
+/* }}} */
+
+/* {{{ epoch_min
+ * The oldest epoch of a running read, or of pin which if it is >= 0. */
+static unsigned long epoch_min(int which)
+{
+    unsigned long min = ULONG_MAX;
+    unsigned long e;
+    apc_epoch_worker_t* w;
+    int i, n = apc_epoch->num_workers;
+
+    APC_MB();
+    for (i = 0; i < n; i++) {
+        w = EPOCH_WORKER(apc_epoch, i);
+        e = w->epoch;
+        if (e && e < min) {
+            min = e;
+        }
+        e = which >= 0 ? w->pin[which] : 0;
+        if (e && e < min) {
+            min = e;
+        }
+    }
+
+    return min;
+}
+/* }}} */
+
+/* {{{ apc_epoch_min_active */
+unsigned long apc_epoch_min_active(int which TSRMLS_DC)
+{
+    return epoch_min(which);
+}
+/* }}} */
+
+/* {{{ epoch_reap
+ * Clears the read and the pins of dead workers. The slot is taken from the
+ * dead owner first, so that no worker can register in it meanwhile. */
+static void epoch_reap(void)
+{
+    apc_epoch_worker_t* w;
+    long owner;
+    int i, which, held;
+
+    for (i = 0; i < apc_epoch->num_workers; i++) {
+        w = EPOCH_WORKER(apc_epoch, i);
+        held = w->epoch != 0;
+        for (which = 0; which < APC_EPOCH_PINS; which++) {
+            held |= w->pin[which] != 0;
+        }
+        owner = w->owner;
+        if (!held || !epoch_owner_dead(owner) || !ATOMIC_CAS(w->owner, owner, EPOCH_REAPING)) {
+            continue;
+        }
+        w->epoch = 0;
+        memset((void*)w->pin, 0, sizeof(w->pin));
+        APC_MB();
+        w->owner = 0;
+    }
+}
+/* }}} */
+
+/* {{{ apc_epoch_reap */
+void apc_epoch_reap(TSRMLS_D)
+{
+    long now = (long)time(NULL);
+    long last = apc_epoch->reaped;
+
+    if (last == now || !ATOMIC_CAS(apc_epoch->reaped, last, now)) {
+        return;
+    }
+    epoch_reap();
+}
+/* }}} */
+
+/* {{{ apc_epoch_synchronize */
+void apc_epoch_synchronize(TSRMLS_D)
+{
+    unsigned long target = apc_epoch_retire(TSRMLS_C);
+    int spins = 0, yields = 0;
+
+    while (epoch_min(-1) < target) {
+        if (++spins < EPOCH_SPINS) {
+            continue;
+        }
+        spins = 0;
+        epoch_yield();
+
+        if (++yields % EPOCH_LIVENESS == 0) {
+            epoch_reap();
+        }
+    }
+}
+/* }}} */
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
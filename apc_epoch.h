@@ -0,0 +1,173 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+   This software was contributed to PHP by Community Connect Inc. in 2002
+   and revised in 2005 by Yahoo! Inc. to add support for PHP 5.1.
+   Future revisions and derivatives of this source code must acknowledge
+   Community Connect Inc. as the original contributor of this module by
+   leaving this note intact in the source code.
+
+   All other licensing and usage conditions are those of the PHP Group.
+
+ */
+
+/* $Id$ */
+
+#ifndef APC_EPOCH_H
+#define APC_EPOCH_H
+
+/*
+ * Epoch based reclamation for readers that don't take locks.
+ *
+ * Every worker (process, or thread under ZTS) that reads without locks owns
+ * a slot in a registry kept in shared memory. While it reads, its slot holds
+ * the global epoch as it was when the read began; outside of reads it holds
+ * 0. A writer that unlinks something lock-free readers may still be looking
+ * at retires it: apc_epoch_retire advances the global epoch and returns the
+ * new value as a tag. The memory may be reused once apc_epoch_min_active is
+ * at least the tag, since every read that began before the unlink has ended.
+ * Writers that can't wait for that, because they release the memory right
+ * away, call apc_epoch_synchronize instead.
+ *
+ * A worker can also pin the epoch of a cache while it holds entries it found
+ * there, which keeps them alive without touching the entries themselves.
+ * Each cache has its own pin, so that the file entries a request executes
+ * don't hold back the user cache. Pins hold back reclamation through
+ * apc_epoch_min_active, but not apc_epoch_synchronize: what is released
+ * right away is never used past a single lookup.
+ *
+ * Reads must be short and must never wait for a stripe lock: writers wait for
+ * them while holding stripes.
+ */
+
+#include "apc.h"
+#include "apc_lock.h"
+#include <limits.h>
+
+#if defined(HAVE_ATOMIC_OPERATIONS) && defined(ATOMIC_CAS)
+# define APC_EPOCH_AVAILABLE 1
+#else
+# define APC_EPOCH_AVAILABLE 0
+#endif
+
+#define APC_EPOCH_MAX_WORKERS 1024
+#define APC_EPOCH_PINS        2     /* one per cache */
+
+/* {{{ struct definition: apc_epoch_worker_t */
+typedef struct apc_epoch_worker_t apc_epoch_worker_t;
+struct apc_epoch_worker_t {
+    volatile long owner;            /* pid (thread id under ZTS) of the worker, 0 if the slot is free */
+    volatile unsigned long epoch;   /* epoch the current read began in, 0 outside of reads */
+    volatile unsigned long pin[APC_EPOCH_PINS]; /* epoch each pin was taken in, 0 if not held */
+};
+/* }}} */
+
+/* {{{ struct definition: apc_epoch_t */
+typedef struct apc_epoch_t apc_epoch_t;
+struct apc_epoch_t {
+    volatile unsigned long global;  /* current epoch, never 0 */
+    volatile long num_workers;      /* slots handed out so far, the rest has never been used */
+    volatile long reaped;           /* last time apc_epoch_reap looked for dead workers */
+    int max_workers;                /* size of the registry */
+    apc_epoch_worker_t* workers;    /* registry, one cache line per worker */
+};
+/* }}} */
+
+/* the registry shared by all caches, NULL unless lock-free reads are enabled */
+extern apc_epoch_t* apc_epoch;
+
+#if APC_EPOCH_AVAILABLE
+
+/*
+ * apc_epoch_create allocates the registry in shared memory. Returns NULL if
+ * it doesn't fit.
+ */
+extern apc_epoch_t* apc_epoch_create(int max_workers TSRMLS_DC);
+
+/*
+ * apc_epoch_activate is called at request startup; a forked worker must not
+ * keep using the registry slot of its parent.
+ */
+extern void apc_epoch_activate(TSRMLS_D);
+
+/*
+ * apc_epoch_release gives the registry slot of the worker back.
+ */
+extern void apc_epoch_release(TSRMLS_D);
+
+/*
+ * apc_epoch_enter begins a lock-free read. Returns 0 if the worker can't
+ * get a registry slot, in which case it must read under the locks.
+ */
+extern int apc_epoch_enter(TSRMLS_D);
+
+/*
+ * apc_epoch_leave ends a lock-free read; nothing found during the read may
+ * be used afterwards unless it was pinned (e.g. by a reference count).
+ */
+extern void apc_epoch_leave(TSRMLS_D);
+
+/*
+ * apc_epoch_pin adds a hold on pin which: whatever the worker found, or
+ * finds, in that cache stays alive until the last hold is dropped with
+ * apc_epoch_unpin. Returns 0 if the worker can't get a registry slot.
+ */
+extern int apc_epoch_pin(int which TSRMLS_DC);
+extern void apc_epoch_unpin(int which TSRMLS_DC);
+
+/*
+ * apc_epoch_unpin_all drops every hold at request shutdown, including those
+ * of entries that were never released.
+ */
+extern void apc_epoch_unpin_all(TSRMLS_D);
+
+/*
+ * apc_epoch_retire is called after unlinking memory that lock-free readers
+ * may still reach, and returns the tag to pass to apc_epoch_min_active.
+ */
+extern unsigned long apc_epoch_retire(TSRMLS_D);
+
+/*
+ * apc_epoch_min_active returns the oldest epoch a read is still running in
+ * or pin which was taken in, or ULONG_MAX if there is none. Memory of the
+ * pin's cache retired with a tag of at most this value is unreachable.
+ */
+extern unsigned long apc_epoch_min_active(int which TSRMLS_DC);
+
+/*
+ * apc_epoch_synchronize waits until every read that began before the call
+ * has ended. Pins don't count.
+ */
+extern void apc_epoch_synchronize(TSRMLS_D);
+
+/*
+ * apc_epoch_reap drops the read and the pins of every worker that died while
+ * it held them, and frees its registry slot. It is called when reclamation
+ * is held back, and looks at most once a second.
+ */
+extern void apc_epoch_reap(TSRMLS_D);
+
+#endif
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
@@ -35,6 +35,8 @@
 #define APC_GLOBALS_H
 
 #include "apc_cache.h"
+#include "apc_epoch.h"
+#include "apc_sma.h"
 #include "apc_stack.h"
 #include "apc_php.h"
 #include "apc_main.h"
@@ -60,17 +62,39 @@ struct _apc_rfc1867_data {
 };
 /* }}} */
 
+/* {{{ struct apc_miss_t */
+
+#define APC_MISSES 16   /* user cache misses a request remembers, to time the rebuild of the keys */
+
+typedef struct _apc_miss_t apc_miss_t;
+
+struct _apc_miss_t {
+    unsigned long h;             /* hash of the key that missed, 0 if the entry is free */
+    struct timeval time;         /* when it missed */
+};
+/* }}} */
+
 
 ZEND_BEGIN_MODULE_GLOBALS(apc)
     /* configuration parameters */
     zend_bool enabled;      /* if true, apc is enabled (defaults to true) */
     long shm_segments;      /* number of shared memory segments to use */
     long shm_size;          /* size of each shared memory segment (in MB) */
+    zend_bool sma_magazines;    /* if true, workers keep blocks of common sizes to themselves during requests */
     long num_files_hint;    /* parameter to apc_cache_create */
     long user_entries_hint;
+    long lock_stripes;      /* number of slot locks per cache, parameter to apc_cache_create */
+    zend_bool user_index;   /* if true, user entries are looked up through an open addressing index */
+    zend_bool optimistic_reads; /* if true, lookups don't take the cache locks */
+    zend_bool write_free_hits;  /* if true, cache hits don't write to shared memory */
+    zend_bool user_admission;   /* if true, stores that need evictions pass a frequency filter */
+    zend_bool user_prefilter;   /* if true, user cache misses of keys never stored skip the table */
     long gc_ttl;            /* parameter to apc_cache_create */
     long ttl;               /* parameter to apc_cache_create */
     long user_ttl;
+    long janitor_interval;  /* seconds between the rounds of the janitor process, 0 for none */
+    long janitor_free;      /* percentage of shared memory the janitor keeps available */
+    long janitor_compact;   /* user entries the janitor relocates per round, 0 for none */
 #if APC_MMAP
     char *mmap_file_mask;   /* mktemp-style file-mask to pass to mmap */
 #endif
@@ -88,8 +112,9 @@ ZEND_BEGIN_MODULE_GLOBALS(apc)
     zend_bool fpstat;            /* true if fullpath includes should be stat'ed */
     zend_bool canonicalize;      /* true if relative paths should be canonicalized in no-stat mode */
     zend_bool stat_ctime;        /* true if ctime in addition to mtime should be checked */
-    zend_bool write_lock;        /* true for a global write lock */
-    zend_bool slam_defense;      /* true for user cache slam defense */ 
+    zend_bool write_lock;        /* true for leases on files that are being compiled */
+    zend_bool slam_defense;      /* true for leases on user cache keys that are being rebuilt */
+    long lease_ttl;              /* seconds a lease lasts unless it is given back */
     zend_bool report_autofilter; /* true for auto-filter warnings */
     zend_bool include_once;      /* Override the ZEND_INCLUDE_OR_EVAL opcode handler to avoid pointless fopen()s [still experimental] */
     apc_optimize_function_t apc_optimize_function;   /* optimizer function callback */
@@ -128,6 +153,18 @@ ZEND_BEGIN_MODULE_GLOBALS(apc)
     HashTable *compiler_hook_class_table;
     int compile_nesting;
     zend_bool enable_opcode_cache;
+    int epoch_worker;            /* our slot in the lock-free reader registry, < 0 if none */
+    long epoch_owner;            /* pid (thread id) epoch_worker was claimed for */
+    int epoch_holds[APC_EPOCH_PINS]; /* entries held through each epoch pin */
+    int stats_shard;             /* the cache stats shard this worker counts in */
+    zend_bool leased;            /* true once the request took a lease */
+    apc_miss_t misses[APC_MISSES]; /* recent misses of the request, by key hash */
+    int sma_home;                /* segment the worker allocates from first, -1 before its first request */
+    zend_bool sma_active;        /* true while the magazines are in use */
+    long sma_owner;              /* pid (thread id) the magazines were filled by */
+    int sma_victim;              /* next magazine to give to another size */
+    size_t sma_held;             /* bytes kept in the magazines */
+    apc_sma_magazine_t magazines[APC_SMA_MAGAZINES]; /* blocks the worker keeps, by size */
 ZEND_END_MODULE_GLOBALS(apc)
 
 /* (the following declaration is defined in php_apc.c) */
@@ -0,0 +1,248 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+   This software was contributed to PHP by Community Connect Inc. in 2002
+   and revised in 2005 by Yahoo! Inc. to add support for PHP 5.1.
+   Future revisions and derivatives of this source code must acknowledge
+   Community Connect Inc. as the original contributor of this module by
+   leaving this note intact in the source code.
+
+   All other licensing and usage conditions are those of the PHP Group.
+
+ */
+
+/* $Id$ */
+
+#include "apc_index.h"
+#include "apc_cache.h"
+
+#if APC_INDEX_SSE2
+# include <emmintrin.h>
+#endif
+
+#ifdef PHP_WIN32
+# include <intrin.h>
+#endif
+
+#define APC_INDEX_EMPTY    0x80
+#define APC_INDEX_DELETED  0xfe
+
+/* the low bits of h pick the stripe, so take the group and the fingerprint
+ * from bits the stripe doesn't depend on (for up to 256 stripes) */
+#define INDEX_GROUP(h)  ((unsigned int)((h) >> 8))
+#define INDEX_FP(h)     ((unsigned char)(((h) >> 24) & 0x7f))
+
+/* {{{ group_match
+ * Returns a bit mask of the control words of g equal to c. */
+static inline unsigned int group_match(const apc_index_group_t* g, unsigned char c)
+{
+#if APC_INDEX_SSE2
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)g->ctrl);
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)c)));
+#else
+    unsigned int mask = 0;
+    int i;
+
+    for (i = 0; i < APC_INDEX_GROUP_SIZE; i++) {
+        if (g->ctrl[i] == c) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+}
+/* }}} */
+
+/* {{{ group_free
+ * Returns a bit mask of the empty or deleted control words of g, which are
+ * the only ones with the high bit set. */
+static inline unsigned int group_free(const apc_index_group_t* g)
+{
+#if APC_INDEX_SSE2
+    return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)g->ctrl));
+#else
+    unsigned int mask = 0;
+    int i;
+
+    for (i = 0; i < APC_INDEX_GROUP_SIZE; i++) {
+        if (g->ctrl[i] & 0x80) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+}
+/* }}} */
+
+/* {{{ lowest_bit */
+static inline int lowest_bit(unsigned int mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#elif defined(PHP_WIN32)
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return (int)i;
+#else
+    int i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+/* }}} */
+
+/* {{{ apc_index_init */
+void apc_index_init(apc_index_t* idx, apc_index_group_t* groups, unsigned int num_groups)
+{
+    unsigned int i;
+
+    for (i = 0; i < num_groups; i++) {
+        memset(groups[i].ctrl, APC_INDEX_EMPTY, sizeof(groups[i].ctrl));
+    }
+#if APC_EPOCH_AVAILABLE
+    APC_WMB();
+#endif
+    idx->groups = groups;
+    idx->mask = num_groups - 1;
+    idx->used = 0;
+    idx->deleted = 0;
+}
+/* }}} */
+
+/* {{{ apc_index_find */
+slot_t* apc_index_find(apc_index_t* idx, unsigned long h, const char* key, int keylen)
+{
+    unsigned int g = INDEX_GROUP(h) & idx->mask;
+    unsigned char fp = INDEX_FP(h);
+    unsigned int probe, m;
+
+    /* triangular probing visits every group once when the count is a power of two */
+    for (probe = 0; probe <= idx->mask; g = (g + ++probe) & idx->mask) {
+        apc_index_group_t* group = &idx->groups[g];
+
+        for (m = group_match(group, fp); m; m &= m - 1) {
+            slot_t* slot = group->slots[lowest_bit(m)];
+            if (slot->key.h == h && !memcmp(slot->key.data.user.identifier, key, keylen)) {
+                return slot;
+            }
+        }
+        if (group_match(group, APC_INDEX_EMPTY)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+/* }}} */
+
+/* {{{ apc_index_insert */
+void apc_index_insert(apc_index_t* idx, unsigned long h, slot_t* slot)
+{
+    unsigned int g = INDEX_GROUP(h) & idx->mask;
+    unsigned int probe, m;
+    int i;
+
+    for (probe = 0; probe <= idx->mask; g = (g + ++probe) & idx->mask) {
+        apc_index_group_t* group = &idx->groups[g];
+
+        if ((m = group_free(group)) != 0) {
+            i = lowest_bit(m);
+            if (group->ctrl[i] == APC_INDEX_DELETED) {
+                idx->deleted--;
+            }
+            /* lock-free readers only follow slots whose word matches */
+            group->slots[i] = slot;
+#if APC_EPOCH_AVAILABLE
+            APC_WMB();
+#endif
+            group->ctrl[i] = INDEX_FP(h);
+            idx->used++;
+            return;
+        }
+    }
+}
+/* }}} */
+
+/* {{{ apc_index_remove */
+void apc_index_remove(apc_index_t* idx, unsigned long h, slot_t* slot)
+{
+    unsigned int g = INDEX_GROUP(h) & idx->mask;
+    unsigned char fp = INDEX_FP(h);
+    unsigned int probe, m;
+    int i;
+
+    for (probe = 0; probe <= idx->mask; g = (g + ++probe) & idx->mask) {
+        apc_index_group_t* group = &idx->groups[g];
+
+        for (m = group_match(group, fp); m; m &= m - 1) {
+            i = lowest_bit(m);
+            if (group->slots[i] == slot) {
+                /* A group that still has an empty word never had a probe run
+                 * past it, so the word can go back to empty. Otherwise later
+                 * groups may hold entries that probed through this one. */
+                if (group_match(group, APC_INDEX_EMPTY)) {
+                    group->ctrl[i] = APC_INDEX_EMPTY;
+                } else {
+                    group->ctrl[i] = APC_INDEX_DELETED;
+                    idx->deleted++;
+                }
+                idx->used--;
+                return;
+            }
+        }
+        if (group_match(group, APC_INDEX_EMPTY)) {
+            break;
+        }
+    }
+}
+/* }}} */
+
+/* {{{ apc_index_replace */
+void apc_index_replace(apc_index_t* idx, unsigned long h, slot_t* slot, slot_t* with)
+{
+    unsigned int g = INDEX_GROUP(h) & idx->mask;
+    unsigned char fp = INDEX_FP(h);
+    unsigned int probe, m;
+    int i;
+
+    for (probe = 0; probe <= idx->mask; g = (g + ++probe) & idx->mask) {
+        apc_index_group_t* group = &idx->groups[g];
+
+        for (m = group_match(group, fp); m; m &= m - 1) {
+            i = lowest_bit(m);
+            if (group->slots[i] == slot) {
+                /* the word stays, readers find either slot */
+                group->slots[i] = with;
+                return;
+            }
+        }
+        if (group_match(group, APC_INDEX_EMPTY)) {
+            break;
+        }
+    }
+}
+/* }}} */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
@@ -0,0 +1,117 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+   This software was contributed to PHP by Community Connect Inc. in 2002
+   and revised in 2005 by Yahoo! Inc. to add support for PHP 5.1.
+   Future revisions and derivatives of this source code must acknowledge
+   Community Connect Inc. as the original contributor of this module by
+   leaving this note intact in the source code.
+
+   All other licensing and usage conditions are those of the PHP Group.
+
+ */
+
+/* $Id$ */
+
+#ifndef APC_INDEX_H
+#define APC_INDEX_H
+
+/*
+ * An open addressing index over the user cache slots of one lock stripe.
+ * Each group holds 16 one byte control words next to the 16 slot pointers
+ * they describe: a lookup compares a 7 bit fingerprint of the hash against a
+ * whole group at once and only dereferences the slots that match, so hits and
+ * misses alike touch one or two groups instead of walking a chain.
+ *
+ * The index never owns anything, the slot chains stay authoritative. It is
+ * only written with its stripe locked, and its memory is managed by the cache
+ * (see index_rebuild in apc_cache.c). Lock-free readers may search it while
+ * it is written; a slot is stored before the control word announcing it.
+ */
+
+#include "apc.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define APC_INDEX_SSE2 1
+# define APC_INDEX_TYPE "sse2"
+#else
+# define APC_INDEX_SSE2 0
+# define APC_INDEX_TYPE "scalar"
+#endif
+
+#define APC_INDEX_GROUP_SIZE 16
+
+/* {{{ struct definition: apc_index_group_t */
+typedef struct apc_index_group_t apc_index_group_t;
+struct apc_index_group_t {
+    unsigned char ctrl[APC_INDEX_GROUP_SIZE];     /* fingerprint, or APC_INDEX_EMPTY / APC_INDEX_DELETED */
+    struct slot_t* slots[APC_INDEX_GROUP_SIZE];   /* slot described by ctrl[i] */
+};
+/* }}} */
+
+/* {{{ struct definition: apc_index_t */
+typedef struct apc_index_t apc_index_t;
+struct apc_index_t {
+    apc_index_group_t* groups;  /* NULL if the stripe has no index, lookups walk the chains */
+    unsigned int mask;          /* number of groups - 1, always a power of two - 1 */
+    unsigned int used;          /* live entries */
+    unsigned int deleted;       /* tombstones, reclaimed by the next rebuild */
+    time_t failed;              /* last time the index memory could not be allocated */
+};
+/* }}} */
+
+/* the index needs rebuilding once live entries and tombstones fill 7/8 of it */
+#define APC_INDEX_FULL(idx) \
+    ((idx)->used + (idx)->deleted + 1 > ((idx)->mask + 1) * (APC_INDEX_GROUP_SIZE / 8 * 7))
+
+/*
+ * apc_index_init sets up an empty index over num_groups groups (a power of
+ * two) of already allocated memory.
+ */
+extern void apc_index_init(apc_index_t* idx, apc_index_group_t* groups, unsigned int num_groups);
+
+/*
+ * apc_index_find returns the user slot for key, or NULL.
+ */
+extern struct slot_t* apc_index_find(apc_index_t* idx, unsigned long h, const char* key, int keylen);
+
+/*
+ * apc_index_insert adds slot, which must not be in the index yet. The caller
+ * checks APC_INDEX_FULL first.
+ */
+extern void apc_index_insert(apc_index_t* idx, unsigned long h, struct slot_t* slot);
+
+/*
+ * apc_index_remove drops slot from the index, if it is there.
+ */
+extern void apc_index_remove(apc_index_t* idx, unsigned long h, struct slot_t* slot);
+
+/*
+ * apc_index_replace puts with in the place of slot, if slot is there. Both
+ * must be for the same key, and with must be fully built: lock-free readers
+ * may find either.
+ */
+extern void apc_index_replace(apc_index_t* idx, unsigned long h, struct slot_t* slot, struct slot_t* with);
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
@@ -130,13 +130,13 @@ static apc_iterator_item_t* apc_iterator_item_ctor(apc_iterator_t *iterator, slo
         add_assoc_long(item->value, "mtime", slot->key.mtime);
     }
     if (APC_ITER_CTIME & iterator->format) {
-        add_assoc_long(item->value, "creation_time", slot->creation_time);
+        add_assoc_long(item->value, "creation_time", SLOT_CREATION_TIME(iterator->cache, slot));
     }
     if (APC_ITER_DTIME & iterator->format) {
         add_assoc_long(item->value, "deletion_time", slot->deletion_time);
     }
     if (APC_ITER_ATIME & iterator->format) {
-        add_assoc_long(item->value, "access_time", slot->access_time);
+        add_assoc_long(item->value, "access_time", SLOT_ACCESS_TIME(iterator->cache, slot));
     }
     if (APC_ITER_REFCOUNT & iterator->format) {
         add_assoc_long(item->value, "ref_count", slot->value->ref_count);
@@ -281,16 +281,16 @@ static int apc_iterator_search_match(apc_iterator_t *iterator, slot_t **slot) {
 static int apc_iterator_check_expiry(apc_cache_t* cache, slot_t **slot, time_t t)
 {
     if((*slot)->value->type == APC_CACHE_ENTRY_USER) {
-        if((*slot)->value->data.user.ttl) {
-            if((time_t) ((*slot)->creation_time + (*slot)->value->data.user.ttl) < t) {
+        if(SLOT_EXPIRES(cache, *slot)) {
+            if(SLOT_EXPIRES(cache, *slot) < t) {
                 return 0;
             }
         } else if(cache->ttl) {
-            if((*slot)->creation_time + cache->ttl < t) {
+            if(SLOT_CREATION_TIME(cache, *slot) + cache->ttl < t) {
                 return 0;
             }
         }
-    } else if((*slot)->access_time < (t - cache->ttl)) {
+    } else if(SLOT_ACCESS_TIME(cache, *slot) < (t - cache->ttl)) {
         return 0;
     }
 
@@ -301,6 +301,7 @@ static int apc_iterator_check_expiry(apc_cache_t* cache, slot_t **slot, time_t t
 /* {{{ apc_iterator_fetch_active */
 static int apc_iterator_fetch_active(apc_iterator_t *iterator TSRMLS_DC) {
     int count=0;
+    cache_header_t *header;
     slot_t **slot;
     apc_iterator_item_t *item;
     time_t t;
@@ -312,10 +313,17 @@ static int apc_iterator_fetch_active(apc_iterator_t *iterator TSRMLS_DC) {
     }
 
     CACHE_LOCK(iterator->cache);
-    while(count <= iterator->chunk_size && iterator->slot_idx < iterator->cache->num_slots) {
-        slot = &iterator->cache->slots[iterator->slot_idx];
+    header = iterator->cache->header;
+    /* the slots of the table a rehash is migrating count after the others */
+    while(count <= iterator->chunk_size && iterator->slot_idx < header->num_slots + header->old_num_slots) {
+        if (iterator->slot_idx < header->num_slots) {
+            slot = &header->slots[iterator->slot_idx];
+        } else {
+            slot = &header->old_slots[iterator->slot_idx - header->num_slots];
+        }
         while(*slot) {
-            if (apc_iterator_check_expiry(iterator->cache, slot, t)) {
+            /* slots of older generations were cleared, and are still to be reclaimed */
+            if ((*slot)->generation == header->generation && apc_iterator_check_expiry(iterator->cache, slot, t)) {
                 if (apc_iterator_search_match(iterator, slot)) {
                     count++;
                     item = apc_iterator_item_ctor(iterator, slot TSRMLS_CC);
@@ -340,7 +348,7 @@ static int apc_iterator_fetch_deleted(apc_iterator_t *iterator TSRMLS_DC) {
     slot_t **slot;
     apc_iterator_item_t *item;
 
-    CACHE_LOCK(iterator->cache);
+    CACHE_HEADER_LOCK(iterator->cache);
     slot = &iterator->cache->header->deleted_list;
     while ((*slot) && count <= iterator->slot_idx) {
         count++;
@@ -357,7 +365,7 @@ static int apc_iterator_fetch_deleted(apc_iterator_t *iterator TSRMLS_DC) {
         }
         slot = &(*slot)->next;
     }
-    CACHE_UNLOCK(iterator->cache);
+    CACHE_HEADER_UNLOCK(iterator->cache);
     iterator->slot_idx += count;
     iterator->stack_idx = 0;
     return count;
@@ -366,19 +374,30 @@ static int apc_iterator_fetch_deleted(apc_iterator_t *iterator TSRMLS_DC) {
 
 /* {{{ apc_iterator_totals */
 static void apc_iterator_totals(apc_iterator_t *iterator TSRMLS_DC) {
+    cache_header_t *header;
+    slot_t **table;
     slot_t **slot;
-    int i;
+    int i, n, pass;
 
     CACHE_LOCK(iterator->cache);
-    for (i=0; i < iterator->cache->num_slots; i++) {
-        slot = &iterator->cache->slots[i];
-        while((*slot)) {
-            if (apc_iterator_search_match(iterator, slot)) {
-                iterator->size += (*slot)->value->mem_size;
-                iterator->hits += (*slot)->num_hits;
-                iterator->count++;
+    header = iterator->cache->header;
+    /* both tables while a rehash is in progress */
+    for (pass = 0; pass < 2; pass++) {
+        table = pass ? header->old_slots : header->slots;
+        n = pass ? header->old_num_slots : header->num_slots;
+        if (!table) {
+            break;
+        }
+        for (i=0; i < n; i++) {
+            slot = &table[i];
+            while((*slot)) {
+                if ((*slot)->generation == header->generation && apc_iterator_search_match(iterator, slot)) {
+                    iterator->size += (*slot)->value->mem_size;
+                    iterator->hits += (*slot)->num_hits;
+                    iterator->count++;
+                }
+                slot = &(*slot)->next;
             }
-            slot = &(*slot)->next;
         }
     }
     CACHE_UNLOCK(iterator->cache);
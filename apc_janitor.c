@@ -0,0 +1,180 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+   This software was contributed to PHP by Community Connect Inc. in 2002
+   and revised in 2005 by Yahoo! Inc. to add support for PHP 5.1.
+   Future revisions and derivatives of this source code must acknowledge
+   Community Connect Inc. as the original contributor of this module by
+   leaving this note intact in the source code.
+
+   All other licensing and usage conditions are those of the PHP Group.
+
+ */
+
+/* $Id$ */
+
+#include "apc_janitor.h"
+#include "apc_cache.h"
+#include "apc_globals.h"
+#include "SAPI.h"
+
+#if APC_JANITOR_AVAILABLE
+# include <signal.h>
+# include <sys/types.h>
+# include <sys/wait.h>
+# include <unistd.h>
+# include <grp.h>
+# include <pwd.h>
+#endif
+#include <errno.h>
+
+#if APC_JANITOR_AVAILABLE
+
+static pid_t janitor_pid = 0;       /* the janitor, 0 if there is none */
+static pid_t janitor_parent = 0;    /* the process that started it */
+
+/* SAPIs whose master process outlives the requests and forks the workers;
+ * php-cgi is left out, it reports the same name when it serves only one
+ * request */
+static const char* janitor_sapis[] = {
+    "apache2handler",
+    "apache",
+    "fpm-fcgi",
+    "litespeed",
+    NULL
+};
+
+/* {{{ janitor_sapi_supported */
+static int janitor_sapi_supported(void)
+{
+    const char** name;
+
+    for (name = janitor_sapis; *name; name++) {
+        if (!strcmp(sapi_module.name, *name)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+/* }}} */
+
+/* {{{ janitor_run
+ * The janitor's loop. A master that runs as root hands in the user to go on
+ * as in pw: the janitor only needs the shared memory and the locks it
+ * inherited. */
+static void janitor_run(struct passwd* pw TSRMLS_DC)
+{
+    size_t keep_free = (size_t) ((double) APCG(shm_size) * APCG(shm_segments) * APCG(janitor_free) / 100);
+
+    if (pw && (setgroups(0, NULL) || setgid(pw->pw_gid) || setuid(pw->pw_uid))) {
+        _exit(1);
+    }
+
+    /* the signal handlers of the parent are of no use here */
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+
+    /* the janitor must never expunge on allocation, it has no cache to
+     * expunge on behalf of */
+    APCG(current_cache) = NULL;
+
+    while (getppid() == janitor_parent) {
+        sleep(APCG(janitor_interval));
+        apc_cache_maintain(apc_cache, keep_free TSRMLS_CC);
+        apc_cache_maintain(apc_user_cache, keep_free TSRMLS_CC);
+        if (APCG(janitor_compact) > 0) {
+            apc_cache_compact(apc_user_cache, APCG(janitor_compact) TSRMLS_CC);
+        }
+    }
+
+    _exit(0);
+}
+/* }}} */
+
+/* {{{ apc_janitor_start */
+int apc_janitor_start(TSRMLS_D)
+{
+    struct passwd* pw = NULL;
+    pid_t pid;
+
+    if (APCG(janitor_interval) <= 0 || janitor_pid) {
+        return janitor_pid != 0;
+    }
+    /* a CLI script or a CGI request would fork one for nothing */
+    if (!sapi_module.name || !janitor_sapi_supported()) {
+        return 0;
+    }
+    if (geteuid() == 0 && !(pw = getpwnam("nobody"))) {
+        apc_warning("The janitor won't run as root and there is no user nobody, apc.janitor_interval is disabled." TSRMLS_CC);
+        return 0;
+    }
+
+    janitor_parent = getpid();
+    pid = fork();
+    if (pid == -1) {
+        apc_warning("Unable to fork the janitor: %s, apc.janitor_interval is disabled." TSRMLS_CC, strerror(errno));
+        return 0;
+    }
+    if (pid == 0) {
+        janitor_run(pw TSRMLS_CC);
+    }
+    janitor_pid = pid;
+
+    return 1;
+}
+/* }}} */
+
+/* {{{ apc_janitor_stop */
+void apc_janitor_stop(TSRMLS_D)
+{
+    /* children of the parent inherit the pid, only the parent may end it */
+    if (!janitor_pid || getpid() != janitor_parent) {
+        return;
+    }
+    kill(janitor_pid, SIGTERM);
+    waitpid(janitor_pid, NULL, 0);
+    janitor_pid = 0;
+}
+/* }}} */
+
+#else
+
+/* {{{ apc_janitor_start */
+int apc_janitor_start(TSRMLS_D)
+{
+    if (APCG(janitor_interval) > 0) {
+        apc_warning("The janitor needs fork(), apc.janitor_interval is disabled." TSRMLS_CC);
+    }
+    return 0;
+}
+/* }}} */
+
+/* {{{ apc_janitor_stop */
+void apc_janitor_stop(TSRMLS_D)
+{
+}
+/* }}} */
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
@@ -0,0 +1,73 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+   This software was contributed to PHP by Community Connect Inc. in 2002
+   and revised in 2005 by Yahoo! Inc. to add support for PHP 5.1.
+   Future revisions and derivatives of this source code must acknowledge
+   Community Connect Inc. as the original contributor of this module by
+   leaving this note intact in the source code.
+
+   All other licensing and usage conditions are those of the PHP Group.
+
+ */
+
+/* $Id$ */
+
+#ifndef APC_JANITOR_H
+#define APC_JANITOR_H
+
+/*
+ * The janitor is a process forked at module startup that does the cache
+ * housekeeping in the background: every apc.janitor_interval seconds it
+ * frees the deleted lists, removes expired entries, and evicts until
+ * apc.janitor_free percent of the shared memory is available. Writers then
+ * leave the deleted lists and the timer wheel to it, for as long as it keeps
+ * up: each round stamps the cache header, and once the stamp is two
+ * intervals old they do the work themselves again. It exits with the process
+ * that started it.
+ *
+ * Only SAPIs with a master process that lives as long as the cache get a
+ * janitor. Forked from a master that runs as root, it goes on as nobody.
+ */
+
+#include "apc.h"
+
+#ifdef PHP_WIN32
+# define APC_JANITOR_AVAILABLE 0
+#else
+# define APC_JANITOR_AVAILABLE 1
+#endif
+
+/*
+ * apc_janitor_start forks the janitor if apc.janitor_interval is set and the
+ * SAPI has a master process. Returns 1 if it is running.
+ */
+extern int apc_janitor_start(TSRMLS_D);
+
+/*
+ * apc_janitor_stop ends the janitor, if this process started it.
+ */
+extern void apc_janitor_stop(TSRMLS_D);
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
@@ -0,0 +1,170 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+   This software was contributed to PHP by Community Connect Inc. in 2002
+   and revised in 2005 by Yahoo! Inc. to add support for PHP 5.1.
+   Future revisions and derivatives of this source code must acknowledge
+   Community Connect Inc. as the original contributor of this module by
+   leaving this note intact in the source code.
+
+   All other licensing and usage conditions are those of the PHP Group.
+
+ */
+
+/* $Id$ */
+
+#include "apc_lease.h"
+#include "apc_sma.h"
+
+#define LEASE_POS(h, i)  ((unsigned int)(((h) ^ ((h) >> 16)) + (i)) & (APC_LEASE_SLOTS - 1))
+
+/* {{{ lease_self */
+static inline long lease_self(void)
+{
+#ifdef ZTS
+    return (long)tsrm_thread_id();
+#else
+    return (long)getpid();
+#endif
+}
+/* }}} */
+
+/* {{{ apc_lease_create */
+apc_lease_table_t* apc_lease_create(int duration TSRMLS_DC)
+{
+    apc_lease_table_t* table;
+
+    table = (apc_lease_table_t*) apc_sma_malloc(sizeof(apc_lease_table_t) TSRMLS_CC);
+    if (!table) {
+        return NULL;
+    }
+    memset(table, 0, sizeof(apc_lease_table_t));
+    table->duration = duration > 0 ? duration : 1;
+    CREATE_LOCK(table->lock);
+
+    return table;
+}
+/* }}} */
+
+/* {{{ apc_lease_destroy */
+void apc_lease_destroy(apc_lease_table_t* table TSRMLS_DC)
+{
+    DESTROY_LOCK(table->lock);
+}
+/* }}} */
+
+/* {{{ lease_match */
+static inline int lease_match(apc_lease_t* lease, unsigned long h, const char* key, unsigned int keylen)
+{
+    return lease->h == h && lease->keylen == keylen && (!lease->key || !memcmp(lease->key, key, keylen));
+}
+/* }}} */
+
+/* {{{ lease_free */
+static inline void lease_free(apc_lease_t* lease TSRMLS_DC)
+{
+    lease->owner = 0;
+    if (lease->key) {
+        apc_sma_free(lease->key TSRMLS_CC);
+        lease->key = NULL;
+    }
+}
+/* }}} */
+
+/* {{{ apc_lease_acquire */
+int apc_lease_acquire(apc_lease_table_t* table, unsigned long h, const char* key, unsigned int keylen, time_t t TSRMLS_DC)
+{
+    long self = lease_self();
+    apc_lease_t* lease;
+    apc_lease_t* free = NULL;
+    int i;
+
+    LOCK(table->lock);
+    for (i = 0; i < APC_LEASE_PROBES; i++) {
+        lease = &table->leases[LEASE_POS(h, i)];
+        if (!lease->owner || lease->expires < t) {
+            if (!free) {
+                free = lease;
+            }
+            continue;
+        }
+        if (lease_match(lease, h, key, keylen)) {
+            UNLOCK(table->lock);
+            return lease->owner == self;
+        }
+    }
+    if (free) {
+        /* the key of a lease that ran out is still around */
+        lease_free(free TSRMLS_CC);
+        /* don't evict anything to make room for a lease, go by the hash
+         * alone instead */
+        free->key = apc_sma_malloc_noexpunge(keylen TSRMLS_CC);
+        if (free->key) {
+            memcpy(free->key, key, keylen);
+        }
+        free->h = h;
+        free->keylen = keylen;
+        free->owner = self;
+        free->expires = t + table->duration;
+    }
+    UNLOCK(table->lock);
+
+    return 1;
+}
+/* }}} */
+
+/* {{{ apc_lease_release */
+void apc_lease_release(apc_lease_table_t* table, unsigned long h, const char* key, unsigned int keylen TSRMLS_DC)
+{
+    long self = lease_self();
+    apc_lease_t* lease;
+    int i;
+
+    LOCK(table->lock);
+    for (i = 0; i < APC_LEASE_PROBES; i++) {
+        lease = &table->leases[LEASE_POS(h, i)];
+        if (lease->owner == self && lease_match(lease, h, key, keylen)) {
+            lease_free(lease TSRMLS_CC);
+            break;
+        }
+    }
+    UNLOCK(table->lock);
+}
+/* }}} */
+
+/* {{{ apc_lease_release_all */
+void apc_lease_release_all(apc_lease_table_t* table TSRMLS_DC)
+{
+    long self = lease_self();
+    int i;
+
+    LOCK(table->lock);
+    for (i = 0; i < APC_LEASE_SLOTS; i++) {
+        if (table->leases[i].owner == self) {
+            lease_free(&table->leases[i] TSRMLS_CC);
+        }
+    }
+    UNLOCK(table->lock);
+}
+/* }}} */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
@@ -0,0 +1,107 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+   This software was contributed to PHP by Community Connect Inc. in 2002
+   and revised in 2005 by Yahoo! Inc. to add support for PHP 5.1.
+   Future revisions and derivatives of this source code must acknowledge
+   Community Connect Inc. as the original contributor of this module by
+   leaving this note intact in the source code.
+
+   All other licensing and usage conditions are those of the PHP Group.
+
+ */
+
+/* $Id$ */
+
+#ifndef APC_LEASE_H
+#define APC_LEASE_H
+
+/*
+ * Leases on keys that are being (re)built. The first process to miss a key
+ * and ask for it takes a lease on it; while the lease lasts, the other
+ * processes that ask know the key is being rebuilt, and don't rebuild it
+ * themselves. The holder gives the lease back once it has stored the key, or
+ * at the end of the request; the lease of a process that dies runs out after
+ * the duration of the table.
+ *
+ * The table is a small open addressing hash table in shared memory, under a
+ * lock of its own. A lease keeps a copy of its key in shared memory, keys are
+ * told apart by their bytes. Without memory for the copy, the lease is
+ * recorded by the hash and length of the key alone. Leases that have run out
+ * are free again. When a key finds no free entry within APC_LEASE_PROBES, it
+ * is leased without being recorded, as if there was no table.
+ */
+
+#include "apc.h"
+#include "apc_lock.h"
+
+#define APC_LEASE_SLOTS  1024   /* entries of a table, a power of 2 */
+#define APC_LEASE_PROBES 16     /* entries a key is looked for in */
+
+/* {{{ struct definition: apc_lease_t */
+typedef struct apc_lease_t apc_lease_t;
+struct apc_lease_t {
+    unsigned long h;            /* hash of the leased key */
+    char* key;                  /* copy of the leased key, NULL if there was no memory for it */
+    unsigned int keylen;        /* length of the leased key */
+    long owner;                 /* pid (thread id under ZTS) of the holder, 0 if the entry is free */
+    time_t expires;             /* last second the lease lasts */
+};
+/* }}} */
+
+/* {{{ struct definition: apc_lease_table_t */
+typedef struct apc_lease_table_t apc_lease_table_t;
+struct apc_lease_table_t {
+    apc_lck_t lock;             /* taken for every change of a lease */
+    int duration;               /* seconds a lease lasts */
+    apc_lease_t leases[APC_LEASE_SLOTS];
+};
+/* }}} */
+
+/*
+ * apc_lease_create allocates a table in shared memory, whose leases last
+ * duration seconds. Returns NULL if it doesn't fit.
+ */
+extern apc_lease_table_t* apc_lease_create(int duration TSRMLS_DC);
+
+extern void apc_lease_destroy(apc_lease_table_t* table TSRMLS_DC);
+
+/*
+ * apc_lease_acquire takes the lease on the keylen bytes of key, whose hash is
+ * h, at time t. Returns 1 if the caller holds the lease now, 0 if another
+ * process does.
+ */
+extern int apc_lease_acquire(apc_lease_table_t* table, unsigned long h, const char* key, unsigned int keylen, time_t t TSRMLS_DC);
+
+/*
+ * apc_lease_release gives back the caller's lease on the key, if it has one.
+ */
+extern void apc_lease_release(apc_lease_table_t* table, unsigned long h, const char* key, unsigned int keylen TSRMLS_DC);
+
+/*
+ * apc_lease_release_all gives back every lease of the caller.
+ */
+extern void apc_lease_release_all(apc_lease_table_t* table TSRMLS_DC);
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
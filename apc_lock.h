@@ -58,9 +58,25 @@
 # ifdef PHP_WIN32
 #  define ATOMIC_INC(a) InterlockedIncrement(&a)
 #  define ATOMIC_DEC(a) InterlockedDecrement(&a)
+#  define ATOMIC_CAS(a, old, new) (InterlockedCompareExchange(&a, new, old) == (old))
+#  define APC_MB()  MemoryBarrier()
+#  define APC_RMB() _ReadWriteBarrier()
+#  define APC_WMB() _ReadWriteBarrier()
 # else
 #  define ATOMIC_INC(a) __sync_add_and_fetch(&a, 1)
 #  define ATOMIC_DEC(a) __sync_sub_and_fetch(&a, 1)
+#  define ATOMIC_ADD(a, n) __sync_add_and_fetch(&a, n)
+#  define ATOMIC_CAS(a, old, new) __sync_bool_compare_and_swap(&a, old, new)
+#  define APC_MB()  __sync_synchronize()
+/* x86 keeps loads in order with loads and stores with stores, the compiler
+ * is all that needs to be held back there */
+#  if defined(__i386__) || defined(__x86_64__)
+#   define APC_RMB() __asm__ __volatile__("" ::: "memory")
+#   define APC_WMB() __asm__ __volatile__("" ::: "memory")
+#  else
+#   define APC_RMB() __sync_synchronize()
+#   define APC_WMB() __sync_synchronize()
+#  endif
 # endif
 #endif
 
@@ -42,11 +42,17 @@
 #include "apc_zend.h"
 #include "apc_pool.h"
 #include "apc_string.h"
+#include "apc_epoch.h"
+#include "apc_janitor.h"
 #include "SAPI.h"
 #include "php_scandir.h"
 #include "ext/standard/php_var.h"
 #include "ext/standard/md5.h"
 
+#ifdef PHP_WIN32
+#include "win32/time.h"
+#endif
+
 #define APC_MAX_SERIALIZERS 16
 
 /* {{{ module variables */
@@ -410,6 +416,19 @@ void apc_compiler_class_table_dtor_hook(void *pDest) {
     } while (0);
 /* }}} */
 
+/* {{{ compile_cost
+ * Microseconds since start, what a file entry costs to rebuild. */
+static unsigned int compile_cost(struct timeval* start)
+{
+    struct timeval now;
+    long usec;
+
+    gettimeofday(&now, NULL);
+    usec = (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_usec - start->tv_usec);
+    return usec > 0 ? (unsigned int) usec : 0;
+}
+/* }}} */
+
 /* {{{ apc_compile_cache_entry  */
 zend_bool apc_compile_cache_entry(apc_cache_key_t *key, zend_file_handle* h, int type, time_t t, zend_op_array** op_array, apc_cache_entry_t** cache_entry TSRMLS_DC) {
     int num_functions, num_classes;
@@ -419,6 +438,9 @@ zend_bool apc_compile_cache_entry(apc_cache_key_t *key, zend_file_handle* h, int
     char *path;
     apc_context_t ctxt;
     HashTable *old_hook_class_table = NULL, *old_hook_func_table = NULL;
+    struct timeval start;
+
+    gettimeofday(&start, NULL);
 
     if (!(APCG(compile_nesting)++)) {
         CG(function_table)->pDestructor = apc_compiler_func_table_dtor_hook;
@@ -529,6 +551,7 @@ zend_bool apc_compile_cache_entry(apc_cache_key_t *key, zend_file_handle* h, int
     if(!(*cache_entry = apc_cache_make_file_entry(path, alloc_op_array, alloc_functions, alloc_classes, &ctxt TSRMLS_CC))) {
         goto freepool;
     }
+    (*cache_entry)->data.file.cost = compile_cost(&start);
         
     UNLOAD_COMPILER_TABLES_HOOKS();
     return SUCCESS;
@@ -649,9 +672,6 @@ static zend_op_array* my_compile_file(zend_file_handle* h,
                 zend_llist_add_element(&CG(open_files), h); 
             }
 
-            /* save this to free on rshutdown */
-            cache_entry->data.file.exec_refcount = op_array->refcount;
-
             return op_array;
         }
         if(APCG(report_autofilter)) {
@@ -686,14 +706,11 @@ static zend_op_array* my_compile_file(zend_file_handle* h,
 
     HANDLE_BLOCK_INTERRUPTIONS();
 
-#if NONBLOCKING_LOCK_AVAILABLE
-    if(APCG(write_lock)) {
-        if(!apc_cache_write_lock(apc_cache TSRMLS_CC)) {
-            HANDLE_UNBLOCK_INTERRUPTIONS();
-            return old_compile_file(h, type TSRMLS_CC);
-        }
+    if (!apc_cache_lease(apc_cache, &key TSRMLS_CC)) {
+        /* another process is compiling the file, run it uncached meanwhile */
+        HANDLE_UNBLOCK_INTERRUPTIONS();
+        return old_compile_file(h, type TSRMLS_CC);
     }
-#endif
 
     zend_try {
         if (apc_compile_cache_entry(&key, h, type, t, &op_array, &cache_entry TSRMLS_CC) == SUCCESS) {
@@ -710,11 +727,7 @@ static zend_op_array* my_compile_file(zend_file_handle* h,
 
     APCG(current_cache) = NULL;
 
-#if NONBLOCKING_LOCK_AVAILABLE
-    if(APCG(write_lock)) {
-        apc_cache_write_unlock(apc_cache TSRMLS_CC);
-    }
-#endif
+    apc_cache_lease_release(apc_cache, &key TSRMLS_CC);
     HANDLE_UNBLOCK_INTERRUPTIONS();
 
     if (bailout) zend_bailout();
@@ -725,7 +738,7 @@ static zend_op_array* my_compile_file(zend_file_handle* h,
 
 /* {{{ data preload */
 
-extern int _apc_store(char *strkey, int strkey_len, const zval *val, const unsigned int ttl, const int exclusive TSRMLS_DC);
+extern int _apc_store(char *strkey, int strkey_len, const zval *val, const unsigned int ttl, const unsigned int grace, const double beta, const int exclusive TSRMLS_DC);
 
 static zval* data_unserialize(const char *filename TSRMLS_DC)
 {
@@ -792,7 +805,7 @@ static int apc_load_data(const char *data_file TSRMLS_DC)
 
             data = data_unserialize(data_file TSRMLS_CC);
             if(data) {
-                _apc_store(key, key_len, data, 0, 1 TSRMLS_CC);
+                _apc_store(key, key_len, data, 0, 0, 0, 1 TSRMLS_CC);
             }
             return 1;
         }
@@ -903,9 +916,49 @@ int apc_module_init(int module_number TSRMLS_DC)
 #else
     apc_sma_init(APCG(shm_segments), APCG(shm_size), NULL TSRMLS_CC);
 #endif
-    apc_cache = apc_cache_create(APCG(num_files_hint), APCG(gc_ttl), APCG(ttl) TSRMLS_CC);
-    apc_user_cache = apc_cache_create(APCG(user_entries_hint), APCG(gc_ttl), APCG(user_ttl) TSRMLS_CC);
-
+    apc_cache = apc_cache_create(APCG(num_files_hint), APCG(gc_ttl), APCG(ttl), APCG(lock_stripes) TSRMLS_CC);
+    apc_user_cache = apc_cache_create(APCG(user_entries_hint), APCG(gc_ttl), APCG(user_ttl), APCG(lock_stripes) TSRMLS_CC);
+    apc_user_cache->use_index = APCG(user_index);
+#if APC_EPOCH_AVAILABLE
+    if (APCG(optimistic_reads)) {
+        apc_epoch = apc_epoch_create(APC_EPOCH_MAX_WORKERS TSRMLS_CC);
+        if (apc_epoch) {
+            apc_cache->optimistic_reads = 1;
+            apc_user_cache->optimistic_reads = 1;
+            apc_user_cache->epoch_pin = 1;
+        } else {
+            apc_warning("Unable to allocate the reader registry, apc.optimistic_reads is disabled." TSRMLS_CC);
+        }
+    }
+#endif
+    apc_cache->write_free_hits = APCG(write_free_hits);
+    apc_user_cache->write_free_hits = APCG(write_free_hits);
+    if (APCG(user_admission)) {
+        /* the slot table grows past the hint, the sketch can't: size it for
+         * as many entries as the memory may hold */
+        apc_user_cache->sketch = apc_sketch_create(MAX((size_t)APCG(user_entries_hint), apc_sma_get_avail_mem() / APC_SKETCH_ENTRY_BYTES) TSRMLS_CC);
+        if (!apc_user_cache->sketch) {
+            apc_warning("Unable to allocate the admission filter, apc.user_admission is disabled." TSRMLS_CC);
+        }
+    }
+    if (APCG(user_prefilter)) {
+        apc_user_cache->bloom = apc_bloom_create(APCG(user_entries_hint) TSRMLS_CC);
+        if (!apc_user_cache->bloom) {
+            apc_warning("Unable to allocate the key filter, apc.user_prefilter is disabled." TSRMLS_CC);
+        }
+    }
+    if (APCG(write_lock)) {
+        apc_cache->leases = apc_lease_create(APCG(lease_ttl) TSRMLS_CC);
+        if (!apc_cache->leases) {
+            apc_warning("Unable to allocate the lease table, apc.write_lock is disabled." TSRMLS_CC);
+        }
+    }
+    if (APCG(slam_defense)) {
+        apc_user_cache->leases = apc_lease_create(APCG(lease_ttl) TSRMLS_CC);
+        if (!apc_user_cache->leases) {
+            apc_warning("Unable to allocate the lease table, apc.slam_defense is disabled." TSRMLS_CC);
+        }
+    }
     /* override compilation */
     if (APCG(enable_opcode_cache)) {
         old_compile_file = zend_compile_file;
@@ -930,6 +983,14 @@ int apc_module_init(int module_number TSRMLS_DC)
 #endif
 
     apc_data_preload(TSRMLS_C);
+
+    /* last, so that the janitor knows the serializers and interned strings
+     * the entries it compacts may use */
+    if (apc_janitor_start(TSRMLS_C)) {
+        apc_cache->header->janitor_time = apc_user_cache->header->janitor_time = time(0);
+        apc_cache->janitor = APCG(janitor_interval);
+        apc_user_cache->janitor = APCG(janitor_interval);
+    }
     APCG(initialized) = 1;
     return 0;
 }
@@ -981,6 +1042,10 @@ int apc_module_shutdown(TSRMLS_D)
 #endif
 #endif
 
+    apc_janitor_stop(TSRMLS_C);
+#if APC_EPOCH_AVAILABLE
+    apc_epoch_release(TSRMLS_C);
+#endif
     apc_cache_destroy(apc_cache TSRMLS_CC);
     apc_cache_destroy(apc_user_cache TSRMLS_CC);
     apc_sma_cleanup(TSRMLS_C);
@@ -1066,16 +1131,6 @@ static void apc_deactivate(TSRMLS_D)
                 pfn = NULL;
             }
         }
-
-        /* This is a very special case of apc_free_op_array_after_execution.
-           File related op_array->refcount is allocated on unpool for execution
-           and would never be freed in zend_execute_scripts() */
-#ifdef ZEND_ENGINE_2_4
-		if (cache_entry->data.file.exec_refcount) {
-			apc_php_free(cache_entry->data.file.exec_refcount TSRMLS_CC);
-			cache_entry->data.file.exec_refcount = NULL;
-		}
-#endif
 #endif
 
         apc_cache_release(apc_cache, cache_entry TSRMLS_CC);
@@ -1088,6 +1143,14 @@ static void apc_deactivate(TSRMLS_D)
 int apc_request_init(TSRMLS_D)
 {
     apc_stack_clear(APCG(cache_stack));
+    apc_cache_stats_activate(TSRMLS_C);
+    memset(APCG(misses), 0, sizeof(APCG(misses)));
+#if APC_EPOCH_AVAILABLE
+    if (apc_epoch) {
+        apc_epoch_activate(TSRMLS_C);
+    }
+#endif
+    apc_sma_activate(TSRMLS_C);
     if (!APCG(compiled_filters) && APCG(filters)) {
         /* compile regex filters here to avoid race condition between MINIT of PCRE and APC.
          * This should be moved to apc_cache_create() if this race condition between modules is resolved */
@@ -1111,6 +1174,22 @@ int apc_request_shutdown(TSRMLS_D)
 {
     apc_deactivate(TSRMLS_C);
 
+#if APC_EPOCH_AVAILABLE
+    /* everything this request found has been released */
+    if (apc_epoch) {
+        apc_epoch_unpin_all(TSRMLS_C);
+    }
+#endif
+    apc_cache_flush_stats(apc_cache TSRMLS_CC);
+    apc_cache_flush_stats(apc_user_cache TSRMLS_CC);
+
+    /* leases the request took and never gave back, on keys it didn't store */
+    if (APCG(leased)) {
+        apc_cache_release_leases(apc_cache TSRMLS_CC);
+        apc_cache_release_leases(apc_user_cache TSRMLS_CC);
+        APCG(leased) = 0;
+    }
+
 #ifdef APC_FILEHITS
     zval_ptr_dtor(&APCG(filehits));
 #endif
@@ -1121,6 +1200,9 @@ int apc_request_shutdown(TSRMLS_D)
         APCG(compiled_filters) = NULL;
     }
 
+    /* last, after everything the request frees */
+    apc_sma_magazines_drain(TSRMLS_C);
+
     return 0;
 }
 
@@ -53,7 +53,8 @@ typedef enum _apc_copy_type {
     APC_COPY_IN_OPCODE,
     APC_COPY_OUT_OPCODE,
     APC_COPY_IN_USER,
-    APC_COPY_OUT_USER
+    APC_COPY_OUT_USER,
+    APC_COPY_MOVE_USER      /* a stored user value, from shared memory to shared memory */
 } apc_copy_type;
 
 typedef struct _apc_context_t
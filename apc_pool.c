@@ -36,10 +36,14 @@
 #endif
 
 /* {{{ forward references */
-static apc_pool* apc_unpool_create(apc_pool_type type, apc_malloc_t, apc_free_t, apc_protect_t, apc_unprotect_t TSRMLS_DC);
-static apc_pool* apc_realpool_create(apc_pool_type type, apc_malloc_t, apc_free_t, apc_protect_t, apc_unprotect_t TSRMLS_DC);
+static apc_pool* apc_unpool_create(apc_pool_type type, apc_malloc_t, apc_malloc_ctx_t, void*, apc_free_t, apc_protect_t, apc_unprotect_t TSRMLS_DC);
+static apc_pool* apc_realpool_create(apc_pool_type type, apc_malloc_t, apc_malloc_ctx_t, void*, apc_free_t, apc_protect_t, apc_unprotect_t TSRMLS_DC);
 /* }}} */
 
+/* allocates from the allocator of a pool, with its context if it has one */
+#define APC_POOL_ALLOCATE(allocate, allocate_ctx, ctx, size) \
+    ((allocate_ctx) ? (allocate_ctx)((size), (ctx) TSRMLS_CC) : (allocate)((size) TSRMLS_CC))
+
 /* {{{ apc_pool_create */
 apc_pool* apc_pool_create(apc_pool_type pool_type, 
                             apc_malloc_t allocate, 
@@ -49,11 +53,30 @@ apc_pool* apc_pool_create(apc_pool_type pool_type,
 			    TSRMLS_DC)
 {
     if(pool_type == APC_UNPOOL) {
-        return apc_unpool_create(pool_type, allocate, deallocate,
+        return apc_unpool_create(pool_type, allocate, NULL, NULL, deallocate,
                                             protect, unprotect TSRMLS_CC);
     }
 
-    return apc_realpool_create(pool_type, allocate, deallocate, 
+    return apc_realpool_create(pool_type, allocate, NULL, NULL, deallocate, 
+                                          protect,  unprotect TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ apc_pool_create_ctx */
+apc_pool* apc_pool_create_ctx(apc_pool_type pool_type,
+                            apc_malloc_ctx_t allocate,
+                            void* ctx,
+                            apc_free_t deallocate,
+                            apc_protect_t protect,
+                            apc_unprotect_t unprotect
+                            TSRMLS_DC)
+{
+    if(pool_type == APC_UNPOOL) {
+        return apc_unpool_create(pool_type, NULL, allocate, ctx, deallocate,
+                                            protect, unprotect TSRMLS_CC);
+    }
+
+    return apc_realpool_create(pool_type, NULL, allocate, ctx, deallocate,
                                           protect,  unprotect TSRMLS_CC);
 }
 /* }}} */
@@ -82,12 +105,10 @@ static void* apc_unpool_alloc(apc_pool* pool, size_t size TSRMLS_DC)
 {
     apc_unpool *upool = (apc_unpool*)pool;
 
-    apc_malloc_t allocate = upool->parent.allocate;
-
     upool->parent.size += size;
     upool->parent.used += size;
 
-    return allocate(size TSRMLS_CC);
+    return APC_POOL_ALLOCATE(upool->parent.allocate, upool->parent.allocate_ctx, upool->parent.ctx, size);
 }
 
 static void apc_unpool_free(apc_pool* pool, void *ptr TSRMLS_DC)
@@ -104,11 +125,12 @@ static void apc_unpool_cleanup(apc_pool* pool TSRMLS_DC)
 }
 
 static apc_pool* apc_unpool_create(apc_pool_type type, 
-                    apc_malloc_t allocate, apc_free_t deallocate,
+                    apc_malloc_t allocate, apc_malloc_ctx_t allocate_ctx, void* ctx,
+                    apc_free_t deallocate,
                     apc_protect_t protect, apc_unprotect_t unprotect
 		    TSRMLS_DC)
 {
-    apc_unpool* upool = allocate(sizeof(apc_unpool) TSRMLS_CC);
+    apc_unpool* upool = APC_POOL_ALLOCATE(allocate, allocate_ctx, ctx, sizeof(apc_unpool));
 
     if (!upool) {
         return NULL;
@@ -117,6 +139,8 @@ static apc_pool* apc_unpool_create(apc_pool_type type,
     upool->parent.type = type;
     upool->parent.allocate = allocate;
     upool->parent.deallocate = deallocate;
+    upool->parent.allocate_ctx = allocate_ctx;
+    upool->parent.ctx = ctx;
 
     upool->parent.protect = protect;
     upool->parent.unprotect = unprotect;
@@ -208,11 +232,9 @@ static const unsigned char decaff[] =  {
 /* {{{ create_pool_block */
 static pool_block* create_pool_block(apc_realpool *rpool, size_t size TSRMLS_DC)
 {
-    apc_malloc_t allocate = rpool->parent.allocate;
-
     size_t realsize = sizeof(pool_block) + ALIGNWORD(size);
 
-    pool_block* entry = allocate(realsize TSRMLS_CC);
+    pool_block* entry = APC_POOL_ALLOCATE(rpool->parent.allocate, rpool->parent.allocate_ctx, rpool->parent.ctx, realsize);
 
     if (!entry) {
         return NULL;
@@ -407,7 +429,9 @@ static void apc_realpool_cleanup(apc_pool *pool TSRMLS_DC)
 /* }}} */
 
 /* {{{ apc_realpool_create */
-static apc_pool* apc_realpool_create(apc_pool_type type, apc_malloc_t allocate, apc_free_t deallocate, 
+static apc_pool* apc_realpool_create(apc_pool_type type, apc_malloc_t allocate,
+                                                         apc_malloc_ctx_t allocate_ctx, void* ctx,
+                                                         apc_free_t deallocate, 
                                                          apc_protect_t protect, apc_unprotect_t unprotect
                                                          TSRMLS_DC)
 {
@@ -432,7 +456,7 @@ static apc_pool* apc_realpool_create(apc_pool_type type, apc_malloc_t allocate,
             return NULL;
     }
 
-    rpool = (apc_realpool*)allocate((sizeof(apc_realpool) + ALIGNWORD(dsize)) TSRMLS_CC);
+    rpool = (apc_realpool*)APC_POOL_ALLOCATE(allocate, allocate_ctx, ctx, sizeof(apc_realpool) + ALIGNWORD(dsize));
 
     if(!rpool) {
         return NULL;
@@ -442,6 +466,8 @@ static apc_pool* apc_realpool_create(apc_pool_type type, apc_malloc_t allocate,
 
     rpool->parent.allocate = allocate;
     rpool->parent.deallocate = deallocate;
+    rpool->parent.allocate_ctx = allocate_ctx;
+    rpool->parent.ctx = ctx;
 
     rpool->parent.size = sizeof(apc_realpool) + ALIGNWORD(dsize);
 
@@ -65,6 +65,9 @@ typedef void  (*apc_pcleanup_t)(apc_pool *pool TSRMLS_DC);
 typedef void* (*apc_palloc_t)(apc_pool *pool, size_t size TSRMLS_DC);
 typedef void  (*apc_pfree_t) (apc_pool *pool, void* p TSRMLS_DC);
 
+/* an allocator that is handed the context the pool was created with */
+typedef void* (*apc_malloc_ctx_t)(size_t size, void* ctx TSRMLS_DC);
+
 typedef void* (*apc_protect_t)  (void *p);
 typedef void* (*apc_unprotect_t)(void *p);
 
@@ -74,6 +77,9 @@ struct _apc_pool {
     apc_malloc_t    allocate;
     apc_free_t      deallocate;
 
+    apc_malloc_ctx_t allocate_ctx;  /* used instead of allocate if set */
+    void*           ctx;            /* handed to allocate_ctx */
+
     apc_palloc_t    palloc;
     apc_pfree_t     pfree;
 
@@ -106,6 +112,18 @@ extern apc_pool* apc_pool_create(apc_pool_type pool_type,
 							apc_unprotect_t unprotect
 							TSRMLS_DC);
 
+/*
+ * apc_pool_create_ctx creates a pool whose memory all comes from allocate,
+ * which is handed ctx with every call.
+ */
+extern apc_pool* apc_pool_create_ctx(apc_pool_type pool_type,
+                            apc_malloc_ctx_t allocate,
+                            void* ctx,
+                            apc_free_t deallocate,
+                            apc_protect_t protect,
+                            apc_unprotect_t unprotect
+                            TSRMLS_DC);
+
 extern void apc_pool_destroy(apc_pool* pool TSRMLS_DC);
 
 extern void* apc_pmemcpy(const void* p, size_t n, apc_pool* pool TSRMLS_DC);
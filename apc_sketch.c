@@ -0,0 +1,148 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+   This software was contributed to PHP by Community Connect Inc. in 2002
+   and revised in 2005 by Yahoo! Inc. to add support for PHP 5.1.
+   Future revisions and derivatives of this source code must acknowledge
+   Community Connect Inc. as the original contributor of this module by
+   leaving this note intact in the source code.
+
+   All other licensing and usage conditions are those of the PHP Group.
+
+ */
+
+/* $Id$ */
+
+#include "apc_sketch.h"
+#include "apc_sma.h"
+
+#define SKETCH_MIN_WIDTH  1024
+#define SKETCH_SAMPLE     10    /* accesses per counter of a row before the counters are halved */
+
+/* odd multipliers, one per row */
+static const unsigned int sketch_seeds[APC_SKETCH_DEPTH] = {
+    0x9e3779b1U, 0x85ebca77U, 0xc2b2ae3dU, 0x27d4eb2fU
+};
+
+/* {{{ sketch_pos
+ * The counter of the key with hash h in row i. */
+static inline unsigned char* sketch_pos(apc_sketch_t* sketch, unsigned long h, int i)
+{
+    unsigned int x = (unsigned int) (h ^ ((h >> 16) >> 16)) * sketch_seeds[i];
+
+    return &sketch->counters[i * sketch->width + (((x >> 16) ^ x) & (sketch->width - 1))];
+}
+/* }}} */
+
+/* {{{ apc_sketch_create */
+apc_sketch_t* apc_sketch_create(unsigned int entries TSRMLS_DC)
+{
+    apc_sketch_t* sketch;
+    unsigned int width = SKETCH_MIN_WIDTH;
+
+    while (width < entries * 4 && width < (1U << 24)) {
+        width <<= 1;
+    }
+
+    sketch = (apc_sketch_t*) apc_sma_malloc(sizeof(apc_sketch_t) + APC_SKETCH_DEPTH * width TSRMLS_CC);
+    if (!sketch) {
+        return NULL;
+    }
+    sketch->width = width;
+    sketch->sample = width * SKETCH_SAMPLE;
+    sketch->additions = 0;
+    sketch->aged = 0;
+    sketch->counters = (unsigned char*) (sketch + 1);
+    memset(sketch->counters, 0, APC_SKETCH_DEPTH * width);
+
+    return sketch;
+}
+/* }}} */
+
+/* {{{ apc_sketch_add */
+void apc_sketch_add(apc_sketch_t* sketch, unsigned long h)
+{
+    unsigned char* c[APC_SKETCH_DEPTH];
+    unsigned int min = APC_SKETCH_MAX;
+    int i;
+
+    for (i = 0; i < APC_SKETCH_DEPTH; i++) {
+        c[i] = sketch_pos(sketch, h, i);
+        if (*c[i] < min) {
+            min = *c[i];
+        }
+    }
+    if (min == APC_SKETCH_MAX) {
+        return;
+    }
+    /* conservative update: only the counters that make up the estimate */
+    for (i = 0; i < APC_SKETCH_DEPTH; i++) {
+        if (*c[i] == min) {
+            *c[i] = min + 1;
+        }
+    }
+    sketch->additions++;
+}
+/* }}} */
+
+/* {{{ apc_sketch_age */
+int apc_sketch_age(apc_sketch_t* sketch, unsigned int max)
+{
+    unsigned int i = sketch->aged, n = APC_SKETCH_DEPTH * sketch->width;
+    unsigned int end;
+
+    if (!i) {
+        if (sketch->additions < sketch->sample) {
+            return 0;
+        }
+        /* the next sample starts now */
+        sketch->additions = 0;
+    }
+    end = (max < n - i) ? i + max : n;
+    for (; i < end; i++) {
+        sketch->counters[i] >>= 1;
+    }
+    sketch->aged = (end < n) ? end : 0;
+
+    return sketch->aged != 0;
+}
+/* }}} */
+
+/* {{{ apc_sketch_estimate */
+unsigned int apc_sketch_estimate(apc_sketch_t* sketch, unsigned long h)
+{
+    unsigned int min = APC_SKETCH_MAX;
+    unsigned char c;
+    int i;
+
+    for (i = 0; i < APC_SKETCH_DEPTH; i++) {
+        c = *sketch_pos(sketch, h, i);
+        if (c < min) {
+            min = c;
+        }
+    }
+
+    return min;
+}
+/* }}} */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
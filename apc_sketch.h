@@ -0,0 +1,101 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+   This software was contributed to PHP by Community Connect Inc. in 2002
+   and revised in 2005 by Yahoo! Inc. to add support for PHP 5.1.
+   Future revisions and derivatives of this source code must acknowledge
+   Community Connect Inc. as the original contributor of this module by
+   leaving this note intact in the source code.
+
+   All other licensing and usage conditions are those of the PHP Group.
+
+ */
+
+/* $Id$ */
+
+#ifndef APC_SKETCH_H
+#define APC_SKETCH_H
+
+/*
+ * A count-min sketch that estimates how often user cache keys are asked for,
+ * over the last few times as many accesses as the cache holds entries (the
+ * TinyLFU admission filter). Each key hash selects one small counter in
+ * every row; the estimate is the smallest of them. Only the smallest
+ * counters are incremented, which keeps collisions from inflating the
+ * others, and every counter is halved once the sample is complete, so that
+ * old popularity fades.
+ *
+ * The counters are written without locks: a lost increment only makes an
+ * estimate a little low. Halving them all takes a while in a big sketch, so
+ * apc_sketch_add only notes that it is due, and the owner halves a slice at
+ * a time with apc_sketch_age, under a lock of its own.
+ */
+
+#include "apc.h"
+
+#define APC_SKETCH_DEPTH 4
+#define APC_SKETCH_MAX   15     /* counters saturate, as if they were 4 bits wide */
+#define APC_SKETCH_ENTRY_BYTES 1024 /* shared memory per user entry the sketch is sized for at least */
+
+/* {{{ struct definition: apc_sketch_t */
+typedef struct apc_sketch_t apc_sketch_t;
+struct apc_sketch_t {
+    unsigned int width;             /* counters per row, a power of 2 */
+    unsigned int sample;            /* increments between two halvings */
+    volatile unsigned int additions;/* increments since the last halving */
+    unsigned int aged;              /* counters halved so far, 0 unless a halving is under way */
+    unsigned char* counters;        /* APC_SKETCH_DEPTH rows of width counters */
+};
+/* }}} */
+
+/*
+ * apc_sketch_create allocates a sketch in shared memory, sized for a cache
+ * of about entries keys. Returns NULL if it doesn't fit.
+ */
+extern apc_sketch_t* apc_sketch_create(unsigned int entries TSRMLS_DC);
+
+/*
+ * apc_sketch_add records an access to the key with hash h.
+ */
+extern void apc_sketch_add(apc_sketch_t* sketch, unsigned long h);
+
+/*
+ * APC_SKETCH_AGING_DUE is true if the counters are due for halving, or a
+ * halving is under way. It needs no lock.
+ */
+#define APC_SKETCH_AGING_DUE(sketch) ((sketch)->aged || (sketch)->additions >= (sketch)->sample)
+
+/*
+ * apc_sketch_age halves up to max counters of a due halving. The caller
+ * serializes calls. Returns nonzero if the halving isn't complete yet.
+ */
+extern int apc_sketch_age(apc_sketch_t* sketch, unsigned int max);
+
+/*
+ * apc_sketch_estimate returns how often the key with hash h was accessed
+ * recently, 0 to APC_SKETCH_MAX.
+ */
+extern unsigned int apc_sketch_estimate(apc_sketch_t* sketch, unsigned long h);
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
@@ -49,16 +49,7 @@ static uint sma_numseg;     /* number of shm segments to allow */
 static size_t sma_segsize;          /* size of each shm segment */
 static apc_segment_t* sma_segments; /* array of shm segments */
 static int sma_lastseg = 0;         /* index of MRU segment */
-
-typedef struct sma_header_t sma_header_t;
-struct sma_header_t {
-    apc_lck_t sma_lock;     /* segment lock, MUST BE ALIGNED for futex locks */
-    size_t segsize;         /* size of entire segment */
-    size_t avail;           /* bytes available (not necessarily contiguous) */
-#if ALLOC_DISTRIBUTION
-    size_t adist[30];
-#endif
-};
+static size_t sma_magazine_cap;     /* bytes a worker may keep in its magazines */
 
 #define SMA_HDR(i)  ((sma_header_t*)((sma_segments[i]).shmaddr))
 #define SMA_ADDR(i) ((char*)(SMA_HDR(i)))
@@ -93,6 +84,41 @@ struct block_t {
 #endif
 };
 
+/*
+ * Free blocks are filed by size into segregated lists, SMA_SL_COUNT classes
+ * per power of two, so that an allocation doesn't have to walk every free
+ * block of the segment. Classes grow with the size: every block in a class
+ * fits anything that maps to a lower one. Each list is circular, with a
+ * sentinel in the segment header, and a bitmap tells which are non-empty.
+ *
+ * Blocks of SMA_TREE_MIN bytes and up are kept in an AVL tree ordered by
+ * size and then offset instead, so that large allocations take the tightest
+ * fit rather than carving up whatever comes first. A block in the tree has
+ * its node right behind its header, and fnext and fprev point at itself.
+ */
+#define SMA_SL_BITS   2
+#define SMA_SL_COUNT  (1 << SMA_SL_BITS)
+#define SMA_FL_MIN    5     /* anything below 32 bytes goes into the first class */
+#define SMA_FL_MAX    16    /* anything from 64K up goes into the tree */
+#define SMA_BINS      ((SMA_FL_MAX - SMA_FL_MIN) * SMA_SL_COUNT)
+#define SMA_TREE_MIN  ((size_t)1 << SMA_FL_MAX)
+#define SMA_MAP_BITS  (sizeof(unsigned int) * 8)
+#define SMA_MAP_WORDS ((SMA_BINS + SMA_MAP_BITS - 1) / SMA_MAP_BITS)
+#define SMA_BELOW_VISITS 256  /* free blocks of the bins sma_allocate_below looks at */
+
+typedef struct sma_header_t sma_header_t;
+struct sma_header_t {
+    apc_lck_t sma_lock;     /* segment lock, MUST BE ALIGNED for futex locks */
+    size_t segsize;         /* size of entire segment */
+    size_t avail;           /* bytes available (not necessarily contiguous) */
+    unsigned int binmap[SMA_MAP_WORDS];  /* bit set for every non-empty bin */
+    block_t bins[SMA_BINS]; /* sentinels of the free lists */
+    size_t tree;            /* offset of the root of the tree, 0 if it is empty */
+#if ALLOC_DISTRIBUTION
+    size_t adist[30];
+#endif
+};
+
 /* The macros BLOCKAT and OFFSET are used for convenience throughout this
  * module. Both assume the presence of a variable shmaddr that points to the
  * beginning of the shared memory segment in question. */
@@ -104,6 +130,19 @@ struct block_t {
 #define NEXT_SBLOCK(block) ((block_t*)((char*)block + block->size))
 #define PREV_SBLOCK(block) (block->prev_size ? ((block_t*)((char*)block - block->prev_size)) : NULL)
 
+/* tree node of a free block of at least SMA_TREE_MIN bytes */
+typedef struct sma_node_t sma_node_t;
+struct sma_node_t {
+    size_t left;        /* offset of the left child, 0 if none */
+    size_t right;       /* offset of the right child, 0 if none */
+    size_t height;      /* height of the subtree */
+};
+
+#define NODE(offset) ((sma_node_t*)((char*)BLOCKAT(offset) + ALIGNWORD(sizeof(block_t))))
+#define NODE_HEIGHT(offset) ((offset) ? NODE(offset)->height : 0)
+/* order of blocks in the tree: by size, then by position */
+#define NODE_LESS(a, b) (BLOCKAT(a)->size < BLOCKAT(b)->size || (BLOCKAT(a)->size == BLOCKAT(b)->size && (a) < (b)))
+
 /* Canary macros for setting, checking and resetting memory canaries */
 #ifdef APC_SMA_CANARIES
     #define SET_CANARY(v) (v)->canary = 0x42424242
@@ -119,119 +158,407 @@ struct block_t {
 #define MINBLOCKSIZE (ALIGNWORD(1) + ALIGNWORD(sizeof(block_t)))
 /* }}} */
 
+/* {{{ sma_fls: index of the highest bit set in x, which must not be 0 */
+static inline int sma_fls(size_t x)
+{
+#if defined(__GNUC__)
+    return (int)(sizeof(unsigned long long) * 8 - 1) - __builtin_clzll((unsigned long long)x);
+#else
+    int n = -1;
+
+    while (x) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+/* }}} */
+
+/* {{{ sma_ffs: index of the lowest bit set in x, which must not be 0 */
+static inline int sma_ffs(unsigned int x)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(x);
+#else
+    int n = 0;
+
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+/* }}} */
+
+/* {{{ sma_bin: the size class of a block of the given size */
+static inline int sma_bin(size_t size)
+{
+    int fl = sma_fls(size);
+
+    if (fl < SMA_FL_MIN) {
+        return 0;
+    }
+    return (fl - SMA_FL_MIN) * SMA_SL_COUNT + (int)((size >> (fl - SMA_SL_BITS)) & (SMA_SL_COUNT - 1));
+}
+/* }}} */
+
+/* {{{ sma_next_bin: the first non-empty bin from bin on, or -1 */
+static inline int sma_next_bin(sma_header_t* header, int bin)
+{
+    int i = bin / SMA_MAP_BITS;
+    unsigned int map;
+
+    if (bin >= SMA_BINS) {
+        return -1;
+    }
+    map = header->binmap[i] & (~0U << (bin % SMA_MAP_BITS));
+    while (!map) {
+        if (++i == SMA_MAP_WORDS) {
+            return -1;
+        }
+        map = header->binmap[i];
+    }
+    return i * SMA_MAP_BITS + sma_ffs(map);
+}
+/* }}} */
+
+/* {{{ sma_tree_rotate: turns the child on side right (or left) of a node
+ *     into the root of its subtree, and returns it */
+static size_t sma_tree_rotate(void* shmaddr, size_t off, int right)
+{
+    sma_node_t* node = NODE(off);
+    size_t child = right ? node->right : node->left;
+    sma_node_t* cnode = NODE(child);
+
+    if (right) {
+        node->right = cnode->left;
+        cnode->left = off;
+    } else {
+        node->left = cnode->right;
+        cnode->right = off;
+    }
+    node->height = 1 + MAX(NODE_HEIGHT(node->left), NODE_HEIGHT(node->right));
+    cnode->height = 1 + MAX(NODE_HEIGHT(cnode->left), NODE_HEIGHT(cnode->right));
+
+    return child;
+}
+/* }}} */
+
+/* {{{ sma_tree_balance: restores the balance of a subtree after one of its
+ *     children has changed, and returns its root */
+static size_t sma_tree_balance(void* shmaddr, size_t off)
+{
+    sma_node_t* node = NODE(off);
+    size_t lh = NODE_HEIGHT(node->left);
+    size_t rh = NODE_HEIGHT(node->right);
+
+    if (lh > rh + 1) {
+        sma_node_t* left = NODE(node->left);
+        if (NODE_HEIGHT(left->left) < NODE_HEIGHT(left->right)) {
+            node->left = sma_tree_rotate(shmaddr, node->left, 1);
+        }
+        return sma_tree_rotate(shmaddr, off, 0);
+    }
+    if (rh > lh + 1) {
+        sma_node_t* right = NODE(node->right);
+        if (NODE_HEIGHT(right->right) < NODE_HEIGHT(right->left)) {
+            node->right = sma_tree_rotate(shmaddr, node->right, 0);
+        }
+        return sma_tree_rotate(shmaddr, off, 1);
+    }
+    node->height = 1 + MAX(lh, rh);
+
+    return off;
+}
+/* }}} */
+
+/* {{{ sma_tree_insert: adds the block at offset cur to a subtree */
+static size_t sma_tree_insert(void* shmaddr, size_t root, size_t cur)
+{
+    if (!root) {
+        NODE(cur)->left = NODE(cur)->right = 0;
+        NODE(cur)->height = 1;
+        return cur;
+    }
+    if (NODE_LESS(cur, root)) {
+        NODE(root)->left = sma_tree_insert(shmaddr, NODE(root)->left, cur);
+    } else {
+        NODE(root)->right = sma_tree_insert(shmaddr, NODE(root)->right, cur);
+    }
+
+    return sma_tree_balance(shmaddr, root);
+}
+/* }}} */
+
+/* {{{ sma_tree_remove_min: detaches the smallest block of a subtree */
+static size_t sma_tree_remove_min(void* shmaddr, size_t root, size_t* min)
+{
+    if (!NODE(root)->left) {
+        *min = root;
+        return NODE(root)->right;
+    }
+    NODE(root)->left = sma_tree_remove_min(shmaddr, NODE(root)->left, min);
+
+    return sma_tree_balance(shmaddr, root);
+}
+/* }}} */
+
+/* {{{ sma_tree_remove: takes the block at offset cur out of a subtree */
+static size_t sma_tree_remove(void* shmaddr, size_t root, size_t cur)
+{
+    size_t min;
+
+    assert(root != 0);
+
+    if (root == cur) {
+        if (!NODE(cur)->right) {
+            return NODE(cur)->left;
+        }
+        NODE(cur)->right = sma_tree_remove_min(shmaddr, NODE(cur)->right, &min);
+        NODE(min)->left = NODE(cur)->left;
+        NODE(min)->right = NODE(cur)->right;
+        return sma_tree_balance(shmaddr, min);
+    }
+    if (NODE_LESS(cur, root)) {
+        NODE(root)->left = sma_tree_remove(shmaddr, NODE(root)->left, cur);
+    } else {
+        NODE(root)->right = sma_tree_remove(shmaddr, NODE(root)->right, cur);
+    }
+
+    return sma_tree_balance(shmaddr, root);
+}
+/* }}} */
+
+/* {{{ sma_tree_fit: the smallest block of at least realsize bytes in the
+ *     tree, the one nearest to the start of the segment among equals */
+static block_t* sma_tree_fit(sma_header_t* header, size_t realsize)
+{
+    void* shmaddr = header;
+    size_t off = header->tree;
+    block_t* fit = NULL;
+
+    while (off) {
+        if (BLOCKAT(off)->size >= realsize) {
+            fit = BLOCKAT(off);
+            off = NODE(off)->left;
+        } else {
+            off = NODE(off)->right;
+        }
+    }
+
+    return fit;
+}
+/* }}} */
+
+/* {{{ sma_tree_lowest: the block of a subtree nearest to the start of the
+ *     segment that has at least realsize bytes and starts below ceiling, or 0 */
+static size_t sma_tree_lowest(void* shmaddr, size_t off, size_t realsize, size_t ceiling)
+{
+    size_t lowest = 0, found;
+
+    while (off) {
+        if (BLOCKAT(off)->size < realsize) {
+            off = NODE(off)->right;
+            continue;
+        }
+        /* everything to the right is large enough, but may be anywhere */
+        if ((found = sma_tree_lowest(shmaddr, NODE(off)->right, realsize, ceiling)) != 0) {
+            lowest = ceiling = found;
+        }
+        if (off < ceiling) {
+            lowest = ceiling = off;
+        }
+        off = NODE(off)->left;
+    }
+
+    return lowest;
+}
+/* }}} */
+
+/* {{{ sma_largest: the size of the largest free block of a segment */
+static size_t sma_largest(sma_header_t* header)
+{
+    void* shmaddr = header;
+    size_t off = header->tree;
+    size_t largest = 0;
+    int bin, last = -1;
+
+    if (off) {
+        while (NODE(off)->right) {
+            off = NODE(off)->right;
+        }
+        return BLOCKAT(off)->size;
+    }
+    for (bin = sma_next_bin(header, 0); bin != -1; bin = sma_next_bin(header, bin + 1)) {
+        last = bin;
+    }
+    if (last != -1) {
+        for (off = header->bins[last].fnext; off != OFFSET(&header->bins[last]); off = BLOCKAT(off)->fnext) {
+            largest = MAX(largest, BLOCKAT(off)->size);
+        }
+    }
+
+    return largest;
+}
+/* }}} */
+
+/* {{{ sma_link: files a free block into its bin, or the tree */
+static inline void sma_link(sma_header_t* header, block_t* cur)
+{
+    void* shmaddr = header;
+    int bin;
+    block_t* head;
+
+    if (cur->size >= SMA_TREE_MIN) {
+        cur->fnext = cur->fprev = OFFSET(cur);
+        header->tree = sma_tree_insert(shmaddr, header->tree, OFFSET(cur));
+        return;
+    }
+
+    bin = sma_bin(cur->size);
+    head = &header->bins[bin];
+    cur->fnext = head->fnext;
+    cur->fprev = OFFSET(head);
+    BLOCKAT(cur->fnext)->fprev = OFFSET(cur);
+    head->fnext = OFFSET(cur);
+    header->binmap[bin / SMA_MAP_BITS] |= 1U << (bin % SMA_MAP_BITS);
+}
+/* }}} */
+
+/* {{{ sma_unlink: takes a free block out of its bin or the tree, before
+ *     its size changes */
+static inline void sma_unlink(sma_header_t* header, block_t* cur)
+{
+    void* shmaddr = header;
+    int bin;
+
+    if (cur->size >= SMA_TREE_MIN) {
+        header->tree = sma_tree_remove(shmaddr, header->tree, OFFSET(cur));
+        return;
+    }
+
+    BLOCKAT(cur->fnext)->fprev = cur->fprev;
+    BLOCKAT(cur->fprev)->fnext = cur->fnext;
+    if (cur->fnext == cur->fprev) {
+        /* both point at the sentinel: the bin is empty now */
+        bin = sma_bin(cur->size);
+        header->binmap[bin / SMA_MAP_BITS] &= ~(1U << (bin % SMA_MAP_BITS));
+    }
+}
+/* }}} */
+
 #if 0
+/* {{{ sma_debug_tree: checks the order and balance of a subtree, returns the
+ *     free bytes in it */
+static size_t sma_debug_tree(void* shmaddr, size_t off, size_t after, int canary_check, int verbose TSRMLS_DC) {
+    sma_node_t* node = NODE(off);
+    size_t avail = 0;
+
+    if (node->left) {
+        avail += sma_debug_tree(shmaddr, node->left, after, canary_check, verbose TSRMLS_CC);
+    }
+    if (verbose) apc_warning(" 0x%x[%d] (s%d)" TSRMLS_CC, BLOCKAT(off), off, BLOCKAT(off)->size);
+    if (canary_check) CHECK_CANARY(BLOCKAT(off));
+    if (BLOCKAT(off)->fnext != off || BLOCKAT(off)->size < SMA_TREE_MIN || (after && !NODE_LESS(after, off))) {
+        apc_warning("Tree is out of order!" TSRMLS_CC);
+        assert(0);
+    }
+    if (node->height != 1 + MAX(NODE_HEIGHT(node->left), NODE_HEIGHT(node->right)) ||
+        NODE_HEIGHT(node->left) > NODE_HEIGHT(node->right) + 1 || NODE_HEIGHT(node->right) > NODE_HEIGHT(node->left) + 1) {
+        apc_warning("Tree is out of balance!" TSRMLS_CC);
+        assert(0);
+    }
+    avail += BLOCKAT(off)->size;
+    if (node->right) {
+        avail += sma_debug_tree(shmaddr, node->right, off, canary_check, verbose TSRMLS_CC);
+    }
+
+    return avail;
+}
+/* }}} */
+
 /* {{{ sma_debug_state(apc_sma_segment_t *segment, int canary_check, int verbose)
  *        useful for debuging state of memory blocks and free list, and sanity checking
  */
 static void sma_debug_state(void* shmaddr, int canary_check, int verbose TSRMLS_DC) {
     sma_header_t *header = (sma_header_t*)shmaddr;
-    block_t *cur = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
+    block_t *cur, *head;
     block_t *prv = NULL;
-    size_t avail;
-
-    /* Verify free list */
-    if (verbose) apc_warning("Free List: " TSRMLS_CC);
-    while(1) {
-        if (verbose) apc_warning(" 0x%x[%d] (s%d)" TSRMLS_CC, cur, OFFSET(cur), cur->size);
-        if (canary_check) CHECK_CANARY(cur);
-        if (!cur->fnext) break;
-        cur = BLOCKAT(cur->fnext);
-        avail += cur->size;
-        if (prv == cur) {
-            apc_warning("Circular list detected!" TSRMLS_CC);
+    size_t avail = 0;
+    int bin;
+
+    /* Verify free lists */
+    for (bin = 0; bin < SMA_BINS; bin++) {
+        head = &header->bins[bin];
+        if (verbose) apc_warning("Free List %d: " TSRMLS_CC, bin);
+        if ((head->fnext != OFFSET(head)) != !!(header->binmap[bin / SMA_MAP_BITS] & (1U << (bin % SMA_MAP_BITS)))) {
+            apc_warning("Bitmap does not match the free list!" TSRMLS_CC);
             assert(0);
         }
-        if (prv && cur->fprev != OFFSET(prv)) {
-            apc_warning("Previous pointer does not point to previous!" TSRMLS_CC);
-            assert(0);
+        prv = head;
+        for (cur = BLOCKAT(head->fnext); cur != head; cur = BLOCKAT(cur->fnext)) {
+            if (verbose) apc_warning(" 0x%x[%d] (s%d)" TSRMLS_CC, cur, OFFSET(cur), cur->size);
+            if (canary_check) CHECK_CANARY(cur);
+            avail += cur->size;
+            if (sma_bin(cur->size) != bin) {
+                apc_warning("Block is in the wrong bin!" TSRMLS_CC);
+                assert(0);
+            }
+            if (cur->fprev != OFFSET(prv)) {
+                apc_warning("Previous pointer does not point to previous!" TSRMLS_CC);
+                assert(0);
+            }
+            prv = cur;
         }
-        prv = cur;
+    }
+    /* the tree is walked from its smallest block */
+    if (header->tree) {
+        if (verbose) apc_warning("Free Tree: " TSRMLS_CC);
+        avail += sma_debug_tree(shmaddr, header->tree, 0, canary_check, verbose TSRMLS_CC);
     }
     assert(avail == header->avail);
 
     /* Verify each block */
     if (verbose) apc_warning("Block List: " TSRMLS_CC);
     cur = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
+    prv = NULL;
     while(1) {
         if(!cur->fnext) {
             if (verbose) apc_warning(" 0x%x[%d] (s%d) (u)" TSRMLS_CC, cur, OFFSET(cur), cur->size);
         } else {
             if (verbose) apc_warning(" 0x%x[%d] (s%d) (f)" TSRMLS_CC, cur, OFFSET(cur), cur->size);
+            if (prv && prv->fnext) {
+                apc_warning("Adjacent free blocks were not coalesced!" TSRMLS_CC);
+                assert(0);
+            }
         }
         if (canary_check) CHECK_CANARY(cur);
-        if (!cur->size && !cur->fnext) break;
-        if (!cur->size) {
-            cur = BLOCKAT(OFFSET(cur) + ALIGNWORD(sizeof(block_t)));
-        } else {
-            cur = NEXT_SBLOCK(cur);
-        }
-        if (prv == cur) {
-            apc_warning("Circular list detected!" TSRMLS_CC);
-            assert(0);
-        }
+        if (!cur->size) break;
         prv = cur;
+        cur = NEXT_SBLOCK(cur);
     }
 }
 /* }}} */
 #endif
 
-/* {{{ sma_allocate: tries to allocate at least size bytes in a segment */
-static APC_HOTSPOT size_t sma_allocate(sma_header_t* header, size_t size, size_t fragment, size_t *allocated)
+/* {{{ sma_take: allocates realsize bytes from the start of the free block
+ *     cur, and files the rest back in if it is worth a block of its own */
+static inline size_t sma_take(sma_header_t* header, block_t* cur, size_t size, size_t realsize, size_t fragment, size_t *allocated)
 {
-    void* shmaddr;          /* header of shared memory segment */
-    block_t* prv;           /* block prior to working block */
-    block_t* cur;           /* working block in list */
-    block_t* prvnextfit;    /* block before next fit */
-    size_t realsize;        /* actual size of block needed, including header */
+    void* shmaddr = header;
     const size_t block_size = ALIGNWORD(sizeof(struct block_t));
 
-    realsize = ALIGNWORD(size + block_size);
-
-    /*
-     * First, insure that the segment contains at least realsize free bytes,
-     * even if they are not contiguous.
-     */
-    shmaddr = header;
-
-    if (header->avail < realsize) {
-        return -1;
-    }
-
-    prvnextfit = 0;     /* initially null (no fit) */
-    prv = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
-    CHECK_CANARY(prv);
-
-    while (prv->fnext != 0) {
-        cur = BLOCKAT(prv->fnext);
-#ifdef __APC_SMA_DEBUG__
-        CHECK_CANARY(cur);
-#endif
-        /* If it can fit realsize bytes in cur block, stop searching */
-        if (cur->size >= realsize) {
-            prvnextfit = prv;
-            break;
-        }
-        prv = cur;
-    }
-
-    if (prvnextfit == 0) {
-        return -1;
-    }
-
-    prv = prvnextfit;
-    cur = BLOCKAT(prv->fnext);
-
-    CHECK_CANARY(prv);
     CHECK_CANARY(cur);
+    sma_unlink(header, cur);
 
     if (cur->size == realsize || (cur->size > realsize && cur->size < (realsize + (MINBLOCKSIZE + fragment)))) {
-        /* cur is big enough for realsize, but too small to split - unlink it */
+        /* cur is big enough for realsize, but too small to split */
         *(allocated) = cur->size - block_size;
-        prv->fnext = cur->fnext;
-        BLOCKAT(cur->fnext)->fprev = OFFSET(prv);
         NEXT_SBLOCK(cur)->prev_size = 0;  /* block is alloc'd */
     } else {
-        /* nextfit is too big; split it into two smaller blocks */
+        /* cur is too big; split it into two smaller blocks */
         block_t* nxt;      /* the new block (chopped part of cur) */
         size_t oldsize;    /* size of cur before split */
 
@@ -244,11 +571,8 @@ static APC_HOTSPOT size_t sma_allocate(sma_header_t* header, size_t size, size_t
         NEXT_SBLOCK(nxt)->prev_size = nxt->size;  /* adjust size */
         SET_CANARY(nxt);
 
-        /* replace cur with next in free list */
-        nxt->fnext = cur->fnext;
-        nxt->fprev = cur->fprev;
-        BLOCKAT(nxt->fnext)->fprev = OFFSET(nxt);
-        BLOCKAT(nxt->fprev)->fnext = OFFSET(nxt);
+        /* the rest goes back into the bin of its size */
+        sma_link(header, nxt);
 #ifdef __APC_SMA_DEBUG__
         nxt->id = -1;
 #endif
@@ -272,6 +596,100 @@ static APC_HOTSPOT size_t sma_allocate(sma_header_t* header, size_t size, size_t
 }
 /* }}} */
 
+/* {{{ sma_allocate: tries to allocate at least size bytes in a segment */
+static APC_HOTSPOT size_t sma_allocate(sma_header_t* header, size_t size, size_t fragment, size_t *allocated)
+{
+    void* shmaddr;          /* header of shared memory segment */
+    block_t* head;          /* sentinel of the bin of realsize */
+    block_t* cur;           /* block to allocate from */
+    size_t realsize;        /* actual size of block needed, including header */
+    size_t off;
+    int bin;
+    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
+
+    realsize = ALIGNWORD(size + block_size);
+
+    /*
+     * First, insure that the segment contains at least realsize free bytes,
+     * even if they are not contiguous.
+     */
+    shmaddr = header;
+
+    if (header->avail < realsize) {
+        return -1;
+    }
+
+    if (realsize >= SMA_TREE_MIN) {
+        cur = sma_tree_fit(header, realsize);
+    } else {
+        bin = sma_bin(realsize);
+        head = &header->bins[bin];
+        cur = NULL;
+
+        if (head->fnext != OFFSET(head) && BLOCKAT(head->fnext)->size >= realsize) {
+            /* the first block of the own class will do */
+            cur = BLOCKAT(head->fnext);
+        } else if ((bin = sma_next_bin(header, bin + 1)) != -1) {
+            /* anything in a higher class fits */
+            cur = BLOCKAT(header->bins[bin].fnext);
+        } else if ((cur = sma_tree_fit(header, realsize)) == NULL) {
+            /* only the own class is left, where blocks may still be too small */
+            for (off = head->fnext; off != OFFSET(head); off = BLOCKAT(off)->fnext) {
+                if (BLOCKAT(off)->size >= realsize) {
+                    cur = BLOCKAT(off);
+                    break;
+                }
+            }
+        }
+    }
+
+    if (cur == NULL) {
+        return -1;
+    }
+
+    return sma_take(header, cur, size, realsize, fragment, allocated);
+}
+/* }}} */
+
+/* {{{ sma_allocate_below: allocates at least size bytes from a free block
+ *     that begins below the offset ceiling, the nearest to the start of the
+ *     segment among those looked at. This is meant for compaction, not for
+ *     the hot path: at most SMA_BELOW_VISITS blocks of the bins are looked
+ *     at, and the tree only holds blocks of 64K and more. */
+static size_t sma_allocate_below(sma_header_t* header, size_t size, size_t ceiling, size_t *allocated)
+{
+    void* shmaddr = header;
+    block_t* head;
+    size_t realsize = ALIGNWORD(size + ALIGNWORD(sizeof(struct block_t)));
+    size_t off, lowest = ceiling;
+    int bin, visits = SMA_BELOW_VISITS;
+
+    if (header->avail < realsize) {
+        return -1;
+    }
+
+    if (realsize < SMA_TREE_MIN) {
+        for (bin = sma_next_bin(header, sma_bin(realsize)); bin != -1 && visits; bin = sma_next_bin(header, bin + 1)) {
+            head = &header->bins[bin];
+            for (off = head->fnext; off != OFFSET(head) && visits; off = BLOCKAT(off)->fnext, visits--) {
+                if (off < lowest && BLOCKAT(off)->size >= realsize) {
+                    lowest = off;
+                }
+            }
+        }
+    }
+    if ((off = sma_tree_lowest(shmaddr, header->tree, realsize, lowest)) != 0) {
+        lowest = off;
+    }
+
+    if (lowest == ceiling) {
+        return -1;
+    }
+
+    return sma_take(header, BLOCKAT(lowest), size, realsize, MINBLOCKSIZE, allocated);
+}
+/* }}} */
+
 /* {{{ sma_deallocate: deallocates the block at the given offset */
 static APC_HOTSPOT size_t sma_deallocate(void* shmaddr, size_t offset)
 {
@@ -293,10 +711,9 @@ static APC_HOTSPOT size_t sma_deallocate(void* shmaddr, size_t offset)
     size = cur->size;
 
     if (cur->prev_size != 0) {
-        /* remove prv from list */
+        /* remove prv from its bin */
         prv = PREV_SBLOCK(cur);
-        BLOCKAT(prv->fnext)->fprev = prv->fprev;
-        BLOCKAT(prv->fprev)->fnext = prv->fnext;
+        sma_unlink(header, prv);
         /* cur and prv share an edge, combine them */
         prv->size +=cur->size;
         RESET_CANARY(cur);
@@ -307,8 +724,7 @@ static APC_HOTSPOT size_t sma_deallocate(void* shmaddr, size_t offset)
     if (nxt->fnext != 0) {
         assert(NEXT_SBLOCK(NEXT_SBLOCK(cur))->prev_size == nxt->size);
         /* cur and nxt shared an edge, combine them */
-        BLOCKAT(nxt->fnext)->fprev = nxt->fprev;
-        BLOCKAT(nxt->fprev)->fnext = nxt->fnext;
+        sma_unlink(header, nxt);
         cur->size += nxt->size;
 #ifdef __APC_SMA_DEBUG__
         CHECK_CANARY(nxt);
@@ -319,12 +735,8 @@ static APC_HOTSPOT size_t sma_deallocate(void* shmaddr, size_t offset)
 
     NEXT_SBLOCK(cur)->prev_size = cur->size;
 
-    /* insert new block after prv */
-    prv = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
-    cur->fnext = prv->fnext;
-    prv->fnext = OFFSET(cur);
-    cur->fprev = OFFSET(prv);
-    BLOCKAT(cur->fnext)->fprev = OFFSET(cur);
+    /* file the combined block into the bin of its size */
+    sma_link(header, cur);
 
     return size;
 }
@@ -358,6 +770,7 @@ void apc_sma_init(int numseg, size_t segsize, char *mmap_file_mask TSRMLS_DC)
 #endif
 
     sma_segsize = segsize > 0 ? segsize : DEFAULT_SEGSIZE;
+    sma_magazine_cap = MIN(APC_SMA_MAGAZINE_BYTES, sma_segsize * sma_numseg / APC_SMA_MAGAZINE_SHARE);
 
     sma_segments = (apc_segment_t*) apc_emalloc((sma_numseg * sizeof(apc_segment_t)) TSRMLS_CC);
 
@@ -365,6 +778,7 @@ void apc_sma_init(int numseg, size_t segsize, char *mmap_file_mask TSRMLS_DC)
         sma_header_t*   header;
         block_t     *first, *empty, *last;
         void*       shmaddr;
+        int         j;
 
 #if APC_MMAP
         sma_segments[i] = apc_mmap(mmap_file_mask, sma_segsize TSRMLS_CC);
@@ -387,33 +801,42 @@ void apc_sma_init(int numseg, size_t segsize, char *mmap_file_mask TSRMLS_DC)
            for(j=0; j<30; j++) header->adist[j] = 0;
         }
 #endif
+        memset(header->binmap, 0, sizeof(header->binmap));
+        header->tree = 0;
+        for (j = 0; j < SMA_BINS; j++) {
+            block_t* head = &header->bins[j];
+            head->size = 0;
+            head->prev_size = 0;
+            head->fnext = head->fprev = OFFSET(head);
+            SET_CANARY(head);
+        }
+        /* first is never free, so that nothing is ever combined with it */
         first = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
-        first->size = 0;
-        first->fnext = ALIGNWORD(sizeof(sma_header_t)) + ALIGNWORD(sizeof(block_t));
+        first->size = ALIGNWORD(sizeof(block_t));
+        first->fnext = 0;
         first->fprev = 0;
         first->prev_size = 0;
         SET_CANARY(first);
 #ifdef __APC_SMA_DEBUG__
         first->id = -1;
 #endif
-        empty = BLOCKAT(first->fnext);
+        empty = NEXT_SBLOCK(first);
         empty->size = header->avail - ALIGNWORD(sizeof(block_t));
-        empty->fnext = OFFSET(empty) + empty->size;
-        empty->fprev = ALIGNWORD(sizeof(sma_header_t));
         empty->prev_size = 0;
         SET_CANARY(empty);
 #ifdef __APC_SMA_DEBUG__
         empty->id = -1;
 #endif
-        last = BLOCKAT(empty->fnext);
+        last = NEXT_SBLOCK(empty);
         last->size = 0;
         last->fnext = 0;
-        last->fprev =  OFFSET(empty);
+        last->fprev = 0;
         last->prev_size = empty->size;
         SET_CANARY(last);
 #ifdef __APC_SMA_DEBUG__
         last->id = -1;
 #endif
+        sma_link(header, empty);
     }
 }
 /* }}} */
@@ -438,65 +861,270 @@ void apc_sma_cleanup(TSRMLS_D)
 }
 /* }}} */
 
-/* {{{ apc_sma_malloc_ex */
-void* apc_sma_malloc_ex(size_t n, size_t fragment, size_t* allocated TSRMLS_DC)
+/* {{{ sma_segment_of: the segment p points into, or -1 */
+static int sma_segment_of(void* p)
 {
-    size_t off;
     uint i;
-    int nuked = 0;
+    size_t offset;
 
-restart:
-    assert(sma_initialized);
-    LOCK(SMA_LCK(sma_lastseg));
+    for (i = 0; i < sma_numseg; i++) {
+        offset = (size_t)((char *)p - SMA_ADDR(i));
+        if (p >= (void*)SMA_ADDR(i) && offset < sma_segsize) {
+            return i;
+        }
+    }
+    return -1;
+}
+/* }}} */
 
-    off = sma_allocate(SMA_HDR(sma_lastseg), n, fragment, allocated);
+/* {{{ sma_self */
+static inline long sma_self(void)
+{
+#ifdef ZTS
+    return (long)tsrm_thread_id();
+#else
+    return (long)getpid();
+#endif
+}
+/* }}} */
 
-    if(off == -1 && APCG(current_cache)) { 
-        /* retry failed allocation after we expunge */
-        UNLOCK(SMA_LCK(sma_lastseg));
-        APCG(current_cache)->expunge_cb(APCG(current_cache), (n+fragment) TSRMLS_CC);
-        LOCK(SMA_LCK(sma_lastseg));
-        off = sma_allocate(SMA_HDR(sma_lastseg), n, fragment, allocated);
+/* {{{ sma_home: the segment the worker allocates from first; outside of
+ *     requests, the one the process allocated from last */
+static inline uint sma_home(TSRMLS_D)
+{
+    int home = APCG(sma_home);
+
+    return (home >= 0 && (uint)home < sma_numseg) ? (uint)home : (uint)sma_lastseg;
+}
+/* }}} */
+
+/* {{{ sma_magazine_drain: gives the blocks of a magazine back until keep are left */
+static void sma_magazine_drain(apc_sma_magazine_t* mag, int keep TSRMLS_DC)
+{
+    int i = -1, seg;
+    void* p;
+
+    while (mag->count > keep) {
+        p = mag->blocks[--mag->count];
+        APCG(sma_held) -= mag->size;
+        seg = sma_segment_of(p);
+        if (seg != i) {
+            if (i != -1) {
+                UNLOCK(SMA_LCK(i));
+            }
+            i = seg;
+            LOCK(SMA_LCK(i));
+        }
+        sma_deallocate(SMA_HDR(i), (size_t)((char *)p - SMA_ADDR(i)));
     }
+    if (i != -1) {
+        UNLOCK(SMA_LCK(i));
+    }
+}
+/* }}} */
 
-    if (off != -1) {
-        void* p = (void *)(SMA_ADDR(sma_lastseg) + off);
-        UNLOCK(SMA_LCK(sma_lastseg));
+/* {{{ sma_magazine_get
+ * Takes a block for n bytes from the magazine of its size, which is refilled
+ * first if it is empty. A size the worker doesn't keep yet takes over an
+ * empty magazine, or the first one the victim hand finds unreferenced, the
+ * way CLOCK evicts cache entries, so that one-off sizes don't push out the
+ * common ones. It starts out with a single block: only sizes that come back
+ * get refilled, to the full magazine at once, as far as the blocks kept by
+ * all the magazines of the worker stay within sma_magazine_cap. */
+static void* sma_magazine_get(size_t n, size_t* allocated TSRMLS_DC)
+{
+    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
+    size_t realsize = ALIGNWORD(n + block_size);
+    apc_sma_magazine_t* mag = NULL;
+    size_t off;
+    int i, want;
+    void* p;
+
+    for (i = 0; i < APC_SMA_MAGAZINES; i++) {
+        if (APCG(magazines)[i].size == realsize) {
+            mag = &APCG(magazines)[i];
+            break;
+        }
+    }
+
+    if (mag == NULL) {
+        for (i = 0; i < APC_SMA_MAGAZINES && APCG(magazines)[i].count; i++);
+        if (i == APC_SMA_MAGAZINES) {
+            for (;;) {
+                i = APCG(sma_victim);
+                APCG(sma_victim) = (i + 1) % APC_SMA_MAGAZINES;
+                if (!APCG(magazines)[i].referenced) {
+                    break;
+                }
+                APCG(magazines)[i].referenced = 0;
+            }
+            sma_magazine_drain(&APCG(magazines)[i], 0 TSRMLS_CC);
+        }
+        mag = &APCG(magazines)[i];
+        mag->size = realsize;
+        mag->max = MIN(APC_SMA_MAGAZINE_SIZE, sma_magazine_cap / realsize);
+        mag->referenced = 0;
+        want = 1;
+    } else {
+        mag->referenced = 1;
+        want = mag->max;
+    }
+
+    if (!mag->count) {
+        uint home = sma_home(TSRMLS_C);
+
+        /* the block handed out right away isn't kept */
+        want = MIN(want, 1 + (int)((sma_magazine_cap - APCG(sma_held)) / realsize));
+        LOCK(SMA_LCK(home));
+        while (mag->count < want) {
+            off = sma_allocate(SMA_HDR(home), n, MINBLOCKSIZE, allocated);
+            if (off == -1) {
+                break;
+            }
+            mag->blocks[mag->count++] = SMA_ADDR(home) + off;
+            APCG(sma_held) += realsize;
+        }
+        UNLOCK(SMA_LCK(home));
+        if (!mag->count) {
+            return NULL;
+        }
+    }
+
+    p = mag->blocks[--mag->count];
+    APCG(sma_held) -= realsize;
+    *allocated = ((block_t*)((char *)p - block_size))->size - block_size;
+
+    return p;
+}
+/* }}} */
+
+/* {{{ sma_magazine_put: keeps a freed block if there is a magazine of its
+ *     size, draining half of the magazine if it is full or the worker keeps
+ *     too much already */
+static int sma_magazine_put(void* p TSRMLS_DC)
+{
+    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
+    size_t size = ((block_t*)((char *)p - block_size))->size;
+    apc_sma_magazine_t* mag;
+    int i;
+
+    for (i = 0; i < APC_SMA_MAGAZINES; i++) {
+        mag = &APCG(magazines)[i];
+        if (mag->size == size) {
+            mag->referenced = 1;
+            if (mag->count == mag->max || APCG(sma_held) + size > sma_magazine_cap) {
+                sma_magazine_drain(mag, mag->count / 2 TSRMLS_CC);
+            }
+            if (APCG(sma_held) + size > sma_magazine_cap) {
+                /* the other magazines keep the rest */
+                return 0;
+            }
+            mag->blocks[mag->count++] = p;
+            APCG(sma_held) += size;
+            return 1;
+        }
+    }
+    return 0;
+}
+/* }}} */
+
+/* {{{ apc_sma_activate */
+void apc_sma_activate(TSRMLS_D)
+{
+    long self = sma_self();
+
+    /* spread the workers over the segments, so that they don't all wait
+     * for the same lock */
+    APCG(sma_home) = (int)((((unsigned long)self * 2654435761UL) >> 16) % sma_numseg);
+
+    if (!APCG(sma_magazines)) {
+        return;
+    }
+    if (APCG(sma_owner) != self) {
+        /* a forked worker must not hand out the blocks of its parent */
+        memset(APCG(magazines), 0, sizeof(APCG(magazines)));
+        APCG(sma_held) = 0;
+        APCG(sma_owner) = self;
+    }
+    APCG(sma_active) = 1;
+}
+/* }}} */
+
+/* {{{ apc_sma_magazines_drain */
+void apc_sma_magazines_drain(TSRMLS_D)
+{
+    int i;
+
+    for (i = 0; i < APC_SMA_MAGAZINES; i++) {
+        sma_magazine_drain(&APCG(magazines)[i], 0 TSRMLS_CC);
+        APCG(magazines)[i].size = 0;
+    }
+    APCG(sma_active) = 0;
+}
+/* }}} */
+
+/* {{{ sma_malloc_ex
+ * Allocates from the home segment of the worker first, and from the others
+ * only when it is full. With expunge set, an allocation that fails in every
+ * segment expunges the current cache (and as a last resort both caches) and
+ * retries. */
+static void* sma_malloc_ex(size_t n, size_t fragment, size_t* allocated, zend_bool expunge TSRMLS_DC)
+{
+    size_t off;
+    uint i, seg;
+    int expunged = 0, nuked = 0;
+    void* p;
+    zend_bool magazines = APCG(sma_active);
+
+    if (magazines && ALIGNWORD(n + ALIGNWORD(sizeof(struct block_t))) <= APC_SMA_MAGAZINE_BLOCK) {
+        if ((p = sma_magazine_get(n, allocated TSRMLS_CC)) != NULL) {
 #ifdef VALGRIND_MALLOCLIKE_BLOCK
-        VALGRIND_MALLOCLIKE_BLOCK(p, n, 0, 0);
+            VALGRIND_MALLOCLIKE_BLOCK(p, n, 0, 0);
 #endif
-        return p;
+            return p;
+        }
     }
-    
-    UNLOCK(SMA_LCK(sma_lastseg));
+
+restart:
+    assert(sma_initialized);
 
     for (i = 0; i < sma_numseg; i++) {
-        if (i == sma_lastseg) {
-            continue;
-        }
-        LOCK(SMA_LCK(i));
-        off = sma_allocate(SMA_HDR(i), n, fragment, allocated);
-        if(off == -1 && APCG(current_cache)) { 
-            /* retry failed allocation after we expunge */
-            UNLOCK(SMA_LCK(i));
-            APCG(current_cache)->expunge_cb(APCG(current_cache), (n+fragment) TSRMLS_CC);
-            LOCK(SMA_LCK(i));
-            off = sma_allocate(SMA_HDR(i), n, fragment, allocated);
+        seg = (sma_home(TSRMLS_C) + i) % sma_numseg;
+        LOCK(SMA_LCK(seg));
+
+        off = sma_allocate(SMA_HDR(seg), n, fragment, allocated);
+
+        if (off == -1 && APCG(sma_active)) {
+            /* short of memory, the worker keeps nothing to itself: whatever
+             * is freed meanwhile goes straight back to the segments */
+            UNLOCK(SMA_LCK(seg));
+            apc_sma_magazines_drain(TSRMLS_C);
+            LOCK(SMA_LCK(seg));
+            off = sma_allocate(SMA_HDR(seg), n, fragment, allocated);
         }
+
         if (off != -1) {
-            void* p = (void *)(SMA_ADDR(i) + off);
-            UNLOCK(SMA_LCK(i));
-            sma_lastseg = i;
+            p = (void *)(SMA_ADDR(seg) + off);
+            UNLOCK(SMA_LCK(seg));
+            sma_lastseg = seg;
+            APCG(sma_active) = magazines;
 #ifdef VALGRIND_MALLOCLIKE_BLOCK
             VALGRIND_MALLOCLIKE_BLOCK(p, n, 0, 0);
 #endif
             return p;
         }
-        UNLOCK(SMA_LCK(i));
+        UNLOCK(SMA_LCK(seg));
+    }
+
+    if (expunge && !expunged && APCG(current_cache)) {
+        /* retry failed allocation after we expunge */
+        APCG(current_cache)->expunge_cb(APCG(current_cache), (n+fragment) TSRMLS_CC);
+        expunged = 1;
+        goto restart;
     }
 
     /* I've tried being nice, but now you're just asking for it */
-    if(!nuked) {
+    if(expunge && !nuked) {
         apc_cache->expunge_cb(apc_cache, (n+fragment) TSRMLS_CC);
         apc_user_cache->expunge_cb(apc_user_cache, (n+fragment) TSRMLS_CC);
         nuked = 1;
@@ -504,11 +1132,55 @@ restart:
     }
 
     /* now, I've truly and well given up */
+    APCG(sma_active) = magazines;
 
     return NULL;
 }
 /* }}} */
 
+/* {{{ apc_sma_malloc_ex */
+void* apc_sma_malloc_ex(size_t n, size_t fragment, size_t* allocated TSRMLS_DC)
+{
+    return sma_malloc_ex(n, fragment, allocated, 1 TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ apc_sma_malloc_noexpunge */
+void* apc_sma_malloc_noexpunge(size_t n TSRMLS_DC)
+{
+    size_t allocated;
+
+    return sma_malloc_ex(n, MINBLOCKSIZE, &allocated, 0 TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ apc_sma_malloc_below */
+void* apc_sma_malloc_below(size_t n, void* ceiling TSRMLS_DC)
+{
+    size_t off, allocated;
+    int seg = sma_segment_of(ceiling);
+    void* p = NULL;
+
+    if (seg == -1) {
+        return NULL;
+    }
+
+    LOCK(SMA_LCK(seg));
+    off = sma_allocate_below(SMA_HDR(seg), n, (size_t)((char*)ceiling - SMA_ADDR(seg)), &allocated);
+    if (off != -1) {
+        p = (void *)(SMA_ADDR(seg) + off);
+    }
+    UNLOCK(SMA_LCK(seg));
+
+#ifdef VALGRIND_MALLOCLIKE_BLOCK
+    if (p) {
+        VALGRIND_MALLOCLIKE_BLOCK(p, n, 0, 0);
+    }
+#endif
+    return p;
+}
+/* }}} */
+
 /* {{{ apc_sma_malloc */
 void* apc_sma_malloc(size_t n TSRMLS_DC)
 {
@@ -555,7 +1227,13 @@ void apc_sma_free(void* p TSRMLS_DC)
 
     assert(sma_initialized);
 
-    
+    if (APCG(sma_active) && sma_segment_of(p) != -1 && sma_magazine_put(p TSRMLS_CC)) {
+#ifdef VALGRIND_FREELIKE_BLOCK
+        VALGRIND_FREELIKE_BLOCK(p, 0);
+#endif
+        return;
+    }
+
     for (i = 0; i < sma_numseg; i++) {
         offset = (size_t)((char *)p - SMA_ADDR(i));
         if (p >= (void*)SMA_ADDR(i) && offset < sma_segsize) {
@@ -641,6 +1319,24 @@ void* apc_sma_unprotect(void *p) { return p; }
 /* }}} */
 #endif
 
+/* {{{ sma_info_tree: adds the blocks of a subtree to the list at link */
+static apc_sma_link_t** sma_info_tree(void* shmaddr, size_t off, apc_sma_link_t** link TSRMLS_DC)
+{
+    if (!off) {
+        return link;
+    }
+    link = sma_info_tree(shmaddr, NODE(off)->left, link TSRMLS_CC);
+
+    *link = apc_emalloc(sizeof(apc_sma_link_t) TSRMLS_CC);
+    (*link)->size = BLOCKAT(off)->size;
+    (*link)->offset = off;
+    (*link)->next = NULL;
+    link = &(*link)->next;
+
+    return sma_info_tree(shmaddr, NODE(off)->right, link TSRMLS_CC);
+}
+/* }}} */
+
 /* {{{ apc_sma_info */
 apc_sma_info_t* apc_sma_info(zend_bool limited TSRMLS_DC)
 {
@@ -648,7 +1344,6 @@ apc_sma_info_t* apc_sma_info(zend_bool limited TSRMLS_DC)
     apc_sma_link_t** link;
     uint i;
     char* shmaddr;
-    block_t* prv;
 
     if (!sma_initialized) {
         return NULL;
@@ -659,41 +1354,46 @@ apc_sma_info_t* apc_sma_info(zend_bool limited TSRMLS_DC)
     info->seg_size = sma_segsize - (ALIGNWORD(sizeof(sma_header_t)) + ALIGNWORD(sizeof(block_t)) + ALIGNWORD(sizeof(block_t)));
 
     info->list = apc_emalloc(info->num_seg * sizeof(apc_sma_link_t*) TSRMLS_CC);
+    info->seg_avail = apc_emalloc(info->num_seg * sizeof(size_t) TSRMLS_CC);
     for (i = 0; i < sma_numseg; i++) {
         info->list[i] = NULL;
+        info->seg_avail[i] = SMA_HDR(i)->avail;
     }
 
     if(limited) return info;
 
     /* For each segment */
     for (i = 0; i < sma_numseg; i++) {
+        sma_header_t* header;
+        int bin;
+
         RDLOCK(SMA_LCK(i));
         shmaddr = SMA_ADDR(i);
-        prv = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
+        header = SMA_HDR(i);
 
         link = &info->list[i];
 
-        /* For each block in this segment */
-        while (BLOCKAT(prv->fnext)->fnext != 0) {
-            block_t* cur = BLOCKAT(prv->fnext);
+        /* For each free block in this segment */
+        for (bin = sma_next_bin(header, 0); bin != -1; bin = sma_next_bin(header, bin + 1)) {
+            block_t* head = &header->bins[bin];
+            block_t* cur;
+
+            for (cur = BLOCKAT(head->fnext); cur != head; cur = BLOCKAT(cur->fnext)) {
 #ifdef __APC_SMA_DEBUG__
-            CHECK_CANARY(cur);
+                CHECK_CANARY(cur);
 #endif
-
-            *link = apc_emalloc(sizeof(apc_sma_link_t) TSRMLS_CC);
-            (*link)->size = cur->size;
-            (*link)->offset = prv->fnext;
-            (*link)->next = NULL;
-            link = &(*link)->next;
-
-            prv = cur;
+                *link = apc_emalloc(sizeof(apc_sma_link_t) TSRMLS_CC);
+                (*link)->size = cur->size;
+                (*link)->offset = OFFSET(cur);
+                (*link)->next = NULL;
+                link = &(*link)->next;
+            }
+        }
+        link = sma_info_tree(shmaddr, header->tree, link TSRMLS_CC);
 
 #if ALLOC_DISTRIBUTION
-            sma_header_t* header = (sma_header_t*) segment->shmaddr;
-            memcpy(info->seginfo[i].adist, header->adist, sizeof(size_t) * 30);
+        memcpy(info->seginfo[i].adist, header->adist, sizeof(size_t) * 30);
 #endif
-
-        }
         RDUNLOCK(SMA_LCK(i));
     }
 
@@ -715,6 +1415,7 @@ void apc_sma_free_info(apc_sma_info_t* info TSRMLS_DC)
         }
     }
     apc_efree(info->list TSRMLS_CC);
+    apc_efree(info->seg_avail TSRMLS_CC);
     apc_efree(info TSRMLS_CC);
 }
 /* }}} */
@@ -748,6 +1449,23 @@ zend_bool apc_sma_get_avail_size(size_t size)
 }
 /* }}} */
 
+/* {{{ apc_sma_get_fragmentation */
+double apc_sma_get_fragmentation()
+{
+    size_t avail = 0, largest = 0;
+    uint i;
+
+    for (i = 0; i < sma_numseg; i++) {
+        LOCK(SMA_LCK(i));
+        avail += SMA_HDR(i)->avail;
+        largest += sma_largest(SMA_HDR(i));
+        UNLOCK(SMA_LCK(i));
+    }
+
+    return avail ? 1.0 - (double)largest / avail : 0;
+}
+/* }}} */
+
 #if ALLOC_DISTRIBUTION
 size_t *apc_sma_get_alloc_distribution(void) {
     sma_header_t* header = (sma_header_t*) segment->sma_shmaddr;
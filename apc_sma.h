@@ -50,6 +50,7 @@ extern void apc_sma_init(int numseg, size_t segsize, char *mmap_file_mask TSRMLS
 extern void apc_sma_cleanup(TSRMLS_D);
 extern void* apc_sma_malloc(size_t size TSRMLS_DC);
 extern void* apc_sma_malloc_ex(size_t size, size_t fragment, size_t* allocated TSRMLS_DC);
+extern void* apc_sma_malloc_noexpunge(size_t size TSRMLS_DC);
 extern void* apc_sma_realloc(void* p, size_t size TSRMLS_DC);
 extern char* apc_sma_strdup(const char *s TSRMLS_DC);
 extern void apc_sma_free(void* p TSRMLS_DC);
@@ -57,6 +58,52 @@ extern void apc_sma_free(void* p TSRMLS_DC);
 extern size_t *apc_sma_get_alloc_distribution();
 #endif
 
+/*
+ * Magazines keep a few blocks of the sizes a worker allocates most in its
+ * own memory, so that most apc_sma_malloc and apc_sma_free calls don't take
+ * the segment lock. They are refilled and drained in batches under a single
+ * acquisition. Blocks in a magazine count as allocated; they are only kept
+ * during a request and all go back to the segments at its end. All the
+ * magazines of a worker together keep at most APC_SMA_MAGAZINE_BYTES, and
+ * no more than 1/APC_SMA_MAGAZINE_SHARE of the shared memory, since every
+ * other worker may keep as much.
+ */
+#define APC_SMA_MAGAZINES      8        /* block sizes a worker keeps */
+#define APC_SMA_MAGAZINE_SIZE  32       /* blocks in a full magazine */
+#define APC_SMA_MAGAZINE_BYTES 131072   /* bytes a worker keeps at most */
+#define APC_SMA_MAGAZINE_SHARE 1024     /* ... and share of the shared memory */
+#define APC_SMA_MAGAZINE_BLOCK (APC_SMA_MAGAZINE_BYTES / 8) /* largest block kept */
+
+/* {{{ struct definition: apc_sma_magazine_t */
+typedef struct apc_sma_magazine_t apc_sma_magazine_t;
+struct apc_sma_magazine_t {
+    size_t size;            /* size of the blocks, including their header, 0 if unused */
+    int count;              /* blocks in the magazine */
+    int max;                /* blocks it may hold */
+    int referenced;         /* used since the victim hand last passed, see sma_magazine_get */
+    void* blocks[APC_SMA_MAGAZINE_SIZE];
+};
+/* }}} */
+
+/*
+ * apc_sma_activate picks the segment the worker allocates from first during
+ * the request, and enables its magazines; apc_sma_magazines_drain gives all
+ * their blocks back and disables them.
+ */
+extern void apc_sma_activate(TSRMLS_D);
+extern void apc_sma_magazines_drain(TSRMLS_D);
+
+/*
+ * apc_sma_malloc_below allocates from a free block of the segment ceiling
+ * points into, below that address and near the start of the segment; it
+ * never expunges. It is an apc_malloc_ctx_t, for pools created with the
+ * ceiling as their context. apc_sma_get_fragmentation is the share of the
+ * available memory that is not in the largest free block of its segment.
+ * Both are for compaction, see apc_cache_compact.
+ */
+extern void* apc_sma_malloc_below(size_t size, void* ceiling TSRMLS_DC);
+extern double apc_sma_get_fragmentation();
+
 extern void* apc_sma_protect(void *p);
 extern void* apc_sma_unprotect(void *p);
 
@@ -74,6 +121,7 @@ typedef struct apc_sma_info_t apc_sma_info_t;
 struct apc_sma_info_t {
     int num_seg;            /* number of shared memory segments */
     size_t seg_size;           /* size of each shared memory segment */
+    size_t* seg_avail;      /* bytes available in each segment */
     apc_sma_link_t** list;  /* there is one list per segment */
 };
 /* }}} */
@@ -304,6 +304,12 @@ if test "$PHP_APC" != "no"; then
                apc_pool.c \
                apc_iterator.c \
                apc_bin.c \
+               apc_index.c \
+               apc_epoch.c \
+               apc_sketch.c \
+               apc_bloom.c \
+               apc_lease.c \
+               apc_janitor.c \
                apc_string.c "
 
   PHP_CHECK_LIBRARY(rt, shm_open, [PHP_ADD_LIBRARY(rt,,APC_SHARED_LIBADD)])
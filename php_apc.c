@@ -72,6 +72,10 @@ PHP_FUNCTION(apc_bin_load);
 PHP_FUNCTION(apc_bin_dumpfile);
 PHP_FUNCTION(apc_bin_loadfile);
 PHP_FUNCTION(apc_exists);
+#if PHP_MAJOR_VERSION >= 6 || PHP_MAJOR_VERSION == 5 && PHP_MINOR_VERSION >= 3
+# define APC_HAVE_REMEMBER 1
+PHP_FUNCTION(apc_remember);
+#endif
 /* }}} */
 
 /* {{{ ZEND_DECLARE_MODULE_GLOBALS(apc) */
@@ -107,6 +111,18 @@ static void php_apc_init_globals(zend_apc_globals* apc_globals TSRMLS_DC)
     apc_globals->use_request_time = 1;
     apc_globals->lazy_class_table = NULL;
     apc_globals->lazy_function_table = NULL;
+    apc_globals->epoch_worker = -1;
+    apc_globals->epoch_owner = 0;
+    memset(apc_globals->epoch_holds, 0, sizeof(apc_globals->epoch_holds));
+    memset(apc_globals->misses, 0, sizeof(apc_globals->misses));
+    apc_globals->stats_shard = 0;
+    apc_globals->leased = 0;
+    apc_globals->sma_home = -1;
+    apc_globals->sma_active = 0;
+    apc_globals->sma_owner = 0;
+    apc_globals->sma_victim = 0;
+    apc_globals->sma_held = 0;
+    memset(apc_globals->magazines, 0, sizeof(apc_globals->magazines));
     apc_globals->serializer_name = NULL;
     apc_globals->serializer = NULL;
     apc_globals->compiler_hook_func_table = NULL;
@@ -242,15 +258,25 @@ PHP_INI_BEGIN()
 STD_PHP_INI_BOOLEAN("apc.enabled",      "1",    PHP_INI_SYSTEM, OnUpdateBool,              enabled,         zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.shm_segments",   "1",    PHP_INI_SYSTEM, OnUpdateShmSegments,       shm_segments,    zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.shm_size",       "32M",  PHP_INI_SYSTEM, OnUpdateShmSize,           shm_size,        zend_apc_globals, apc_globals)
+STD_PHP_INI_BOOLEAN("apc.sma_magazines", "0", PHP_INI_SYSTEM, OnUpdateBool,             sma_magazines,    zend_apc_globals, apc_globals)
 #ifdef ZEND_ENGINE_2_4
 STD_PHP_INI_ENTRY("apc.shm_strings_buffer", "4M",   PHP_INI_SYSTEM, OnUpdateLong,           shm_strings_buffer,        zend_apc_globals, apc_globals)
 #endif
 STD_PHP_INI_BOOLEAN("apc.include_once_override", "0", PHP_INI_SYSTEM, OnUpdateBool,     include_once,    zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.num_files_hint", "1000", PHP_INI_SYSTEM, OnUpdateLong,            num_files_hint,  zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.user_entries_hint", "4096", PHP_INI_SYSTEM, OnUpdateLong,          user_entries_hint, zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.lock_stripes",   "8",    PHP_INI_SYSTEM, OnUpdateLong,            lock_stripes,     zend_apc_globals, apc_globals)
+STD_PHP_INI_BOOLEAN("apc.user_index",   "0",    PHP_INI_SYSTEM, OnUpdateBool,            user_index,       zend_apc_globals, apc_globals)
+STD_PHP_INI_BOOLEAN("apc.optimistic_reads", "0", PHP_INI_SYSTEM, OnUpdateBool,            optimistic_reads, zend_apc_globals, apc_globals)
+STD_PHP_INI_BOOLEAN("apc.write_free_hits", "0", PHP_INI_SYSTEM, OnUpdateBool,             write_free_hits,  zend_apc_globals, apc_globals)
+STD_PHP_INI_BOOLEAN("apc.user_admission", "0", PHP_INI_SYSTEM, OnUpdateBool,              user_admission,   zend_apc_globals, apc_globals)
+STD_PHP_INI_BOOLEAN("apc.user_prefilter", "0", PHP_INI_SYSTEM, OnUpdateBool,              user_prefilter,   zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.gc_ttl",         "3600", PHP_INI_SYSTEM, OnUpdateLong,            gc_ttl,           zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.ttl",            "0",    PHP_INI_SYSTEM, OnUpdateLong,            ttl,              zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.user_ttl",       "0",    PHP_INI_SYSTEM, OnUpdateLong,            user_ttl,         zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.janitor_interval", "0",  PHP_INI_SYSTEM, OnUpdateLong,            janitor_interval, zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.janitor_free",   "10",   PHP_INI_SYSTEM, OnUpdateLong,            janitor_free,     zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.janitor_compact", "0",   PHP_INI_SYSTEM, OnUpdateLong,            janitor_compact,  zend_apc_globals, apc_globals)
 #if APC_MMAP
 STD_PHP_INI_ENTRY("apc.mmap_file_mask",  NULL,  PHP_INI_SYSTEM, OnUpdateString,         mmap_file_mask,   zend_apc_globals, apc_globals)
 #endif
@@ -264,6 +290,7 @@ STD_PHP_INI_BOOLEAN("apc.canonicalize", "1",    PHP_INI_SYSTEM, OnUpdateBool,
 STD_PHP_INI_BOOLEAN("apc.stat_ctime", "0",      PHP_INI_SYSTEM, OnUpdateBool,           stat_ctime,       zend_apc_globals, apc_globals)
 STD_PHP_INI_BOOLEAN("apc.write_lock", "1",      PHP_INI_SYSTEM, OnUpdateBool,           write_lock,       zend_apc_globals, apc_globals)
 STD_PHP_INI_BOOLEAN("apc.slam_defense", "1",    PHP_INI_SYSTEM, OnUpdateBool,           slam_defense,     zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.lease_ttl",      "2",    PHP_INI_SYSTEM, OnUpdateLong,           lease_ttl,        zend_apc_globals, apc_globals)
 STD_PHP_INI_BOOLEAN("apc.report_autofilter", "0", PHP_INI_SYSTEM, OnUpdateBool,         report_autofilter,zend_apc_globals, apc_globals)
 #ifdef MULTIPART_EVENT_FORMDATA
 STD_PHP_INI_BOOLEAN("apc.rfc1867", "0", PHP_INI_SYSTEM, OnUpdateBool, rfc1867, zend_apc_globals, apc_globals)
@@ -363,6 +390,8 @@ static PHP_MINIT_FUNCTION(apc)
 
         zend_register_long_constant("APC_BIN_VERIFY_MD5", sizeof("APC_BIN_VERIFY_MD5"), APC_BIN_VERIFY_MD5, (CONST_CS | CONST_PERSISTENT), module_number TSRMLS_CC);
         zend_register_long_constant("APC_BIN_VERIFY_CRC32", sizeof("APC_BIN_VERIFY_CRC32"), APC_BIN_VERIFY_CRC32, (CONST_CS | CONST_PERSISTENT), module_number TSRMLS_CC);
+        zend_register_long_constant("APC_FETCH_REBUILDING", sizeof("APC_FETCH_REBUILDING"), APC_FETCH_REBUILDING, (CONST_CS | CONST_PERSISTENT), module_number TSRMLS_CC);
+        zend_register_long_constant("APC_FETCH_STALE", sizeof("APC_FETCH_STALE"), APC_FETCH_STALE, (CONST_CS | CONST_PERSISTENT), module_number TSRMLS_CC);
     }
 
     return SUCCESS;
@@ -480,6 +509,7 @@ PHP_FUNCTION(apc_sma_info)
 {
     apc_sma_info_t* info;
     zval* block_lists;
+    zval* seg_avail;
     int i;
     zend_bool limited = 0;
 
@@ -499,6 +529,13 @@ PHP_FUNCTION(apc_sma_info)
     add_assoc_double(return_value, "seg_size", (double)info->seg_size);
     add_assoc_double(return_value, "avail_mem", (double)apc_sma_get_avail_mem());
 
+    ALLOC_INIT_ZVAL(seg_avail);
+    array_init(seg_avail);
+    for (i = 0; i < info->num_seg; i++) {
+        add_next_index_double(seg_avail, (double)info->seg_avail[i]);
+    }
+    add_assoc_zval(return_value, "seg_avail", seg_avail);
+
     if(limited) {
         apc_sma_free_info(info TSRMLS_CC);
         return;
@@ -570,10 +607,40 @@ int _apc_update(char *strkey, int strkey_len, apc_cache_updater_t updater, void*
 }
 /* }}} */
     
+/* {{{ apc_miss_record
+ * Remembers when the key with hash h missed, to time its rebuild. */
+static void apc_miss_record(unsigned long h TSRMLS_DC)
+{
+    apc_miss_t* miss = &APCG(misses)[h % APC_MISSES];
+
+    miss->h = h;
+    gettimeofday(&miss->time, NULL);
+}
+/* }}} */
+
+/* {{{ apc_miss_cost
+ * Microseconds since the key with hash h missed in this request, 0 if it
+ * didn't. */
+static unsigned int apc_miss_cost(unsigned long h TSRMLS_DC)
+{
+    apc_miss_t* miss = &APCG(misses)[h % APC_MISSES];
+    struct timeval now;
+    long usec;
+
+    if (miss->h != h) {
+        return 0;
+    }
+    miss->h = 0;
+    gettimeofday(&now, NULL);
+    usec = (now.tv_sec - miss->time.tv_sec) * 1000000L + (now.tv_usec - miss->time.tv_usec);
+    return usec > 0 ? (unsigned int) usec : 1;
+}
+/* }}} */
+
 /* {{{ _apc_store */
-int _apc_store(char *strkey, int strkey_len, const zval *val, const unsigned int ttl, const int exclusive TSRMLS_DC) {
+int _apc_store(char *strkey, int strkey_len, const zval *val, const unsigned int ttl, const unsigned int grace, const double beta, const int exclusive TSRMLS_DC) {
     apc_cache_entry_t *entry;
-    apc_cache_key_t key;
+    apc_cache_key_t key = {0,};
     time_t t;
     apc_context_t ctxt={0,};
     int ret = 1;
@@ -591,31 +658,48 @@ int _apc_store(char *strkey, int strkey_len, const zval *val, const unsigned int
 
     APCG(current_cache) = apc_user_cache;
 
-    ctxt.pool = apc_pool_create(APC_SMALL_POOL, apc_sma_malloc, apc_sma_free, apc_sma_protect, apc_sma_unprotect TSRMLS_CC);
-    if (!ctxt.pool) {
-        HANDLE_UNBLOCK_INTERRUPTIONS();
-        apc_warning("Unable to allocate memory for pool." TSRMLS_CC);
-        return 0;
+    if (!apc_cache_make_user_key(&key, strkey, strkey_len, t)) {
+        ret = 0;
+        goto nocache;
     }
     ctxt.copy = APC_COPY_IN_USER;
     ctxt.force_update = 0;
 
-    if(!ctxt.pool) {
+    /* with an admission filter, the entry is first copied without evicting
+     * anything; see below */
+    entry = NULL;
+    ctxt.pool = apc_pool_create(APC_SMALL_POOL, apc_user_cache->sketch ? apc_sma_malloc_noexpunge : apc_sma_malloc,
+                                apc_sma_free, apc_sma_protect, apc_sma_unprotect TSRMLS_CC);
+    if (!ctxt.pool && !apc_user_cache->sketch) {
+        apc_warning("Unable to allocate memory for pool." TSRMLS_CC);
         ret = 0;
-        goto nocache;
-    }
-
-    if (!apc_cache_make_user_key(&key, strkey, strkey_len, t)) {
-        goto freepool;
+        goto unlease;
     }
-
-    if (apc_cache_is_last_key(apc_user_cache, &key, t TSRMLS_CC)) {
-        goto freepool;
+    if (ctxt.pool && !(entry = apc_cache_make_user_entry(strkey, strkey_len, val, &ctxt, ttl TSRMLS_CC))) {
+        apc_pool_destroy(ctxt.pool TSRMLS_CC);
     }
 
-    if (!(entry = apc_cache_make_user_entry(strkey, strkey_len, val, &ctxt, ttl TSRMLS_CC))) {
-        goto freepool;
+    if (!entry) {
+        /* it doesn't fit, or not even the pool does: only make room if the
+         * key is wanted more than the entry that would be evicted */
+        if (!apc_user_cache->sketch || !apc_cache_user_admit(apc_user_cache, &key TSRMLS_CC)) {
+            ret = 0;
+            goto unlease;
+        }
+        ctxt.pool = apc_pool_create(APC_SMALL_POOL, apc_sma_malloc, apc_sma_free, apc_sma_protect, apc_sma_unprotect TSRMLS_CC);
+        if (!ctxt.pool) {
+            apc_warning("Unable to allocate memory for pool." TSRMLS_CC);
+            ret = 0;
+            goto unlease;
+        }
+        if (!(entry = apc_cache_make_user_entry(strkey, strkey_len, val, &ctxt, ttl TSRMLS_CC))) {
+            goto freepool;
+        }
     }
+    /* a grace period and early refreshes only mean something with a ttl */
+    entry->data.user.grace = ttl ? grace : 0;
+    entry->data.user.beta = ttl && beta > 0 ? beta : 0;
+    entry->data.user.cost = apc_miss_cost(key.h TSRMLS_CC);
 
     if (!apc_cache_user_insert(apc_user_cache, key, entry, &ctxt, t, exclusive TSRMLS_CC)) {
 freepool:
@@ -623,6 +707,10 @@ freepool:
         ret = 0;
     }
 
+unlease:
+    /* stored or not, the caller is done rebuilding the key */
+    apc_cache_lease_release(apc_user_cache, &key TSRMLS_CC);
+
 nocache:
 
     APCG(current_cache) = NULL;
@@ -640,6 +728,8 @@ static void apc_store_helper(INTERNAL_FUNCTION_PARAMETERS, const int exclusive)
     zval *key = NULL;
     zval *val = NULL;
     long ttl = 0L;
+    long grace = 0L;
+    double beta = 0;
     HashTable *hash;
     HashPosition hpos;
     zval **hentry;
@@ -647,7 +737,7 @@ static void apc_store_helper(INTERNAL_FUNCTION_PARAMETERS, const int exclusive)
     uint hkey_len;
     ulong hkey_idx;
 
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|zl", &key, &val, &ttl) == FAILURE) {
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|zlld", &key, &val, &ttl, &grace, &beta) == FAILURE) {
         return;
     }
 
@@ -660,7 +750,7 @@ static void apc_store_helper(INTERNAL_FUNCTION_PARAMETERS, const int exclusive)
         while(zend_hash_get_current_data_ex(hash, (void**)&hentry, &hpos) == SUCCESS) {
             zend_hash_get_current_key_ex(hash, &hkey, &hkey_len, &hkey_idx, 0, &hpos);
             if (hkey) {
-                if(!_apc_store(hkey, hkey_len, *hentry, (unsigned int)ttl, exclusive TSRMLS_CC)) {
+                if(!_apc_store(hkey, hkey_len, *hentry, (unsigned int)ttl, (unsigned int)grace, beta, exclusive TSRMLS_CC)) {
                     add_assoc_long_ex(return_value, hkey, hkey_len, -1);  /* -1: insertion error */
                 }
                 hkey = NULL;
@@ -672,7 +762,7 @@ static void apc_store_helper(INTERNAL_FUNCTION_PARAMETERS, const int exclusive)
         return;
     } else if (Z_TYPE_P(key) == IS_STRING) {
         if (!val) RETURN_FALSE;
-        if(_apc_store(Z_STRVAL_P(key), Z_STRLEN_P(key) + 1, val, (unsigned int)ttl, exclusive TSRMLS_CC))
+        if(_apc_store(Z_STRVAL_P(key), Z_STRLEN_P(key) + 1, val, (unsigned int)ttl, (unsigned int)grace, beta, exclusive TSRMLS_CC))
             RETURN_TRUE;
     } else {
         apc_warning("apc_store expects key parameter to be a string or an array of key/value pairs." TSRMLS_CC);
@@ -682,14 +772,14 @@ static void apc_store_helper(INTERNAL_FUNCTION_PARAMETERS, const int exclusive)
 }
 /* }}} */
 
-/* {{{ proto int apc_store(mixed key, mixed var [, long ttl ])
+/* {{{ proto int apc_store(mixed key, mixed var [, long ttl [, long grace [, float beta ]]])
  */
 PHP_FUNCTION(apc_store) {
     apc_store_helper(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
 }
 /* }}} */
 
-/* {{{ proto int apc_add(mixed key, mixed var [, long ttl ])
+/* {{{ proto int apc_add(mixed key, mixed var [, long ttl [, long grace [, float beta ]]])
  */
 PHP_FUNCTION(apc_add) {
     apc_store_helper(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
@@ -813,11 +903,34 @@ void *apc_erealloc_wrapper(void *ptr, size_t size) {
     return _erealloc(ptr, size, 0 ZEND_FILE_LINE_CC ZEND_FILE_LINE_EMPTY_CC);
 }
 
-/* {{{ proto mixed apc_fetch(mixed key[, bool &success])
+/* {{{ apc_fetch_miss
+ * On a miss, starts timing the rebuild of the key. With lease set, also
+ * leases the key to the caller, unless another process is already rebuilding
+ * it. */
+static long apc_fetch_miss(char *strkey, int strkey_len, time_t t, zend_bool lease TSRMLS_DC)
+{
+    apc_cache_key_t key;
+
+    if (!apc_cache_make_user_key(&key, strkey, strkey_len, t)) {
+        return 0;
+    }
+    apc_miss_record(key.h TSRMLS_CC);
+    if (!lease || !apc_user_cache->leases) {
+        return 0;
+    }
+
+    return apc_cache_lease(apc_user_cache, &key TSRMLS_CC) ? 0 : APC_FETCH_REBUILDING;
+}
+/* }}} */
+
+/* {{{ proto mixed apc_fetch(mixed key[, bool &success[, int &state]])
  */
 PHP_FUNCTION(apc_fetch) {
     zval *key;
     zval *success = NULL;
+    zval *state = NULL;
+    zend_bool stale;
+    long miss;
     HashTable *hash;
     HashPosition hpos;
     zval **hentry;
@@ -831,7 +944,7 @@ PHP_FUNCTION(apc_fetch) {
 
     if(!APCG(enabled)) RETURN_FALSE;
 
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|z", &key, &success) == FAILURE) {
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|zz", &key, &success, &state) == FAILURE) {
         return;
     }
 
@@ -840,6 +953,10 @@ PHP_FUNCTION(apc_fetch) {
     if (success) {
         ZVAL_BOOL(success, 0);
     }
+    if (state) {
+        zval_dtor(state);
+        ZVAL_LONG(state, 0);
+    }
 
     ctxt.pool = apc_pool_create(APC_UNPOOL, apc_php_malloc, apc_php_free, NULL, NULL TSRMLS_CC);
     if (!ctxt.pool) {
@@ -857,7 +974,21 @@ PHP_FUNCTION(apc_fetch) {
         strkey = Z_STRVAL_P(key);
         strkey_len = Z_STRLEN_P(key);
         if(!strkey_len) RETURN_FALSE;
-        entry = apc_cache_user_find(apc_user_cache, strkey, (strkey_len + 1), t TSRMLS_CC);
+        entry = apc_cache_user_find_stale(apc_user_cache, strkey, (strkey_len + 1), t, &stale TSRMLS_CC);
+        if (!entry || stale) {
+            /* the caller that wins the lease rebuilds the key, or refreshes
+             * the stale entry */
+            miss = apc_fetch_miss(strkey, strkey_len + 1, t, 1 TSRMLS_CC);
+            if (entry && miss != APC_FETCH_REBUILDING) {
+                /* elected to refresh the key, the others are served the
+                 * stale entry until it is stored again */
+                apc_cache_release(apc_user_cache, entry TSRMLS_CC);
+                entry = NULL;
+            }
+            if (state) {
+                ZVAL_LONG(state, entry ? APC_FETCH_STALE : miss);
+            }
+        }
         if(entry) {
             /* deep-copy returned shm zval to emalloc'ed return_value */
             apc_cache_fetch_zval(return_value, entry->data.user.val, &ctxt TSRMLS_CC);
@@ -875,7 +1006,16 @@ PHP_FUNCTION(apc_fetch) {
                 apc_warning("apc_fetch() expects a string or array of strings." TSRMLS_CC);
                 goto freepool;
             }
-            entry = apc_cache_user_find(apc_user_cache, Z_STRVAL_PP(hentry), (Z_STRLEN_PP(hentry) + 1), t TSRMLS_CC);
+            entry = apc_cache_user_find_stale(apc_user_cache, Z_STRVAL_PP(hentry), (Z_STRLEN_PP(hentry) + 1), t, &stale TSRMLS_CC);
+            if (!entry || stale) {
+                /* each stale key is refreshed by the caller that wins its
+                 * lease, the others get the stale value */
+                miss = apc_fetch_miss(Z_STRVAL_PP(hentry), Z_STRLEN_PP(hentry) + 1, t, entry != NULL TSRMLS_CC);
+                if (entry && miss != APC_FETCH_REBUILDING) {
+                    apc_cache_release(apc_user_cache, entry TSRMLS_CC);
+                    entry = NULL;
+                }
+            }
             if(entry) {
                 /* deep-copy returned shm zval to emalloc'ed return_value */
                 MAKE_STD_ZVAL(result_entry);
@@ -902,6 +1042,126 @@ freepool:
 }
 /* }}} */
 
+#ifdef APC_HAVE_REMEMBER
+#define APC_REMEMBER_POLL_MIN   1000    /* microseconds between the first polls of a waiter */
+#define APC_REMEMBER_POLL_MAX   50000   /* ... and at most, once it backed off */
+
+/* {{{ apc_remember_sleep */
+static void apc_remember_sleep(long usec)
+{
+#ifdef PHP_WIN32
+    Sleep(usec / 1000);
+#else
+    usleep(usec);
+#endif
+}
+/* }}} */
+
+/* {{{ proto mixed apc_remember(string key, callable producer [, long ttl [, long grace [, float beta ]]])
+ */
+PHP_FUNCTION(apc_remember) {
+    char *strkey;
+    int strkey_len;
+    long ttl = 0L;
+    long grace = 0L;
+    double beta = 0;
+    zend_fcall_info fci;
+    zend_fcall_info_cache fcc;
+    zval *arg;
+    zval **args[1];
+    zval *retval = NULL;
+    apc_cache_entry_t* entry = NULL;
+    apc_cache_key_t key;
+    apc_context_t ctxt = {0,};
+    zend_bool stale;
+    zend_bool missed = 0;
+    zend_bool leased = 0;
+    long waited = 0;
+    long poll = APC_REMEMBER_POLL_MIN;
+    time_t t;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sf|lld", &strkey, &strkey_len, &fci, &fcc, &ttl, &grace, &beta) == FAILURE) {
+        return;
+    }
+
+    if (!strkey_len) RETURN_FALSE;
+
+    t = apc_time();
+
+    if (APCG(enabled) && apc_cache_make_user_key(&key, strkey, strkey_len + 1, t)) {
+        /* the first process to miss the key produces it, the others wait for
+         * it to be stored. Once the lease of the producer runs out, the next
+         * one to poll takes it over; without slam_defense there are no
+         * leases, and every process that misses the key produces it */
+        for (;;) {
+            entry = apc_cache_user_find_stale(apc_user_cache, strkey, (strkey_len + 1), t, &stale TSRMLS_CC);
+            if (entry && !stale) {
+                break;
+            }
+            if (!missed) {
+                /* the rebuild is timed from the first miss, waits included */
+                apc_miss_record(key.h TSRMLS_CC);
+                missed = 1;
+            }
+            leased = apc_cache_lease(apc_user_cache, &key TSRMLS_CC);
+            if (entry && leased) {
+                /* elected to refresh a stale entry */
+                apc_cache_release(apc_user_cache, entry TSRMLS_CC);
+                entry = NULL;
+            }
+            /* a lease runs out after lease_ttl seconds, so past that others
+             * keep taking it: produce the key, but leave it to them to store */
+            if (entry || leased || waited > (APCG(lease_ttl) + 1) * 1000000L) {
+                break;
+            }
+            apc_remember_sleep(poll);
+            waited += poll;
+            poll = MIN(poll * 2, APC_REMEMBER_POLL_MAX);
+        }
+
+        if (entry) {
+            ctxt.pool = apc_pool_create(APC_UNPOOL, apc_php_malloc, apc_php_free, NULL, NULL TSRMLS_CC);
+            if (!ctxt.pool) {
+                apc_cache_release(apc_user_cache, entry TSRMLS_CC);
+                apc_warning("Unable to allocate memory for pool." TSRMLS_CC);
+                RETURN_FALSE;
+            }
+            ctxt.copy = APC_COPY_OUT_USER;
+            ctxt.force_update = 0;
+            apc_cache_fetch_zval(return_value, entry->data.user.val, &ctxt TSRMLS_CC);
+            apc_cache_release(apc_user_cache, entry TSRMLS_CC);
+            apc_pool_destroy(ctxt.pool TSRMLS_CC);
+            return;
+        }
+    }
+
+    MAKE_STD_ZVAL(arg);
+    ZVAL_STRINGL(arg, strkey, strkey_len, 1);
+    args[0] = &arg;
+    fci.retval_ptr_ptr = &retval;
+    fci.params = args;
+    fci.param_count = 1;
+
+    if (zend_call_function(&fci, &fcc TSRMLS_CC) == SUCCESS && retval && !EG(exception)) {
+        /* storing gives the lease back */
+        if (leased) {
+            _apc_store(strkey, strkey_len + 1, retval, (unsigned int)ttl, (unsigned int)grace, beta, 0 TSRMLS_CC);
+        }
+        RETVAL_ZVAL(retval, 1, 1);
+    } else {
+        if (retval) {
+            zval_ptr_dtor(&retval);
+        }
+        if (leased) {
+            apc_cache_lease_release(apc_user_cache, &key TSRMLS_CC);
+        }
+        RETVAL_FALSE;
+    }
+    zval_ptr_dtor(&arg);
+}
+/* }}} */
+#endif
+
 /* {{{ proto mixed apc_exists(mixed key)
  */
 PHP_FUNCTION(apc_exists) {
@@ -1122,7 +1382,7 @@ PHP_FUNCTION(apc_define_constants) {
     if(!strkey_len) RETURN_FALSE;
 
     _apc_define_constants(constants, case_sensitive TSRMLS_CC);
-    if(_apc_store(strkey, strkey_len + 1, constants, 0, 0 TSRMLS_CC)) RETURN_TRUE;
+    if(_apc_store(strkey, strkey_len + 1, constants, 0, 0, 0, 0 TSRMLS_CC)) RETURN_TRUE;
     RETURN_FALSE;
 } /* }}} */
 
@@ -1570,6 +1830,8 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_apc_store, 0, 0, 2)
     ZEND_ARG_INFO(0, key)
     ZEND_ARG_INFO(0, var)
     ZEND_ARG_INFO(0, ttl)
+    ZEND_ARG_INFO(0, grace)
+    ZEND_ARG_INFO(0, beta)
 ZEND_END_ARG_INFO()
 
 PHP_APC_ARGINFO
@@ -1609,6 +1871,7 @@ PHP_APC_ARGINFO
 ZEND_BEGIN_ARG_INFO_EX(arginfo_apc_fetch, 0, 0, 1)
     ZEND_ARG_INFO(0, key)
     ZEND_ARG_INFO(1, success)
+    ZEND_ARG_INFO(1, state)
 ZEND_END_ARG_INFO()
 
 PHP_APC_ARGINFO
@@ -1669,6 +1932,17 @@ PHP_APC_ARGINFO
 ZEND_BEGIN_ARG_INFO(arginfo_apc_exists, 0)
     ZEND_ARG_INFO(0, keys)
 ZEND_END_ARG_INFO()
+
+#ifdef APC_HAVE_REMEMBER
+PHP_APC_ARGINFO
+ZEND_BEGIN_ARG_INFO_EX(arginfo_apc_remember, 0, 0, 2)
+    ZEND_ARG_INFO(0, key)
+    ZEND_ARG_INFO(0, producer)
+    ZEND_ARG_INFO(0, ttl)
+    ZEND_ARG_INFO(0, grace)
+    ZEND_ARG_INFO(0, beta)
+ZEND_END_ARG_INFO()
+#endif
 /* }}} */
 
 /* {{{ apc_functions[] */
@@ -1692,6 +1966,9 @@ zend_function_entry apc_functions[] = {
     PHP_FE(apc_bin_dumpfile,        arginfo_apc_bin_dumpfile)
     PHP_FE(apc_bin_loadfile,        arginfo_apc_bin_loadfile)
     PHP_FE(apc_exists,              arginfo_apc_exists)
+#ifdef APC_HAVE_REMEMBER
+    PHP_FE(apc_remember,            arginfo_apc_remember)
+#endif
     {NULL, NULL, NULL}
 };
 /* }}} */
@@ -37,6 +37,10 @@
 
 #define PHP_APC_VERSION "3.1.15-dev"
 
+/* states apc_fetch() reports besides 0 */
+#define APC_FETCH_REBUILDING    1   /* missed, and another process is rebuilding the key */
+#define APC_FETCH_STALE         2   /* hit past the ttl, and another process is refreshing the key */
+
 extern zend_module_entry apc_module_entry;
 #define apc_module_ptr &apc_module_entry
 
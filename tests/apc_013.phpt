@@ -0,0 +1,48 @@
+--TEST--
+APC: user cache slots split across apc.lock_stripes locks
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.lock_stripes=3
+--FILE--
+<?php
+$info = apc_cache_info('user', true);
+var_dump($info['num_stripes']);
+var_dump($info['num_slots'] % $info['num_stripes']);
+
+for ($i = 0; $i < 100; $i++) {
+    apc_store("key$i", $i);
+}
+$sum = 0;
+for ($i = 0; $i < 100; $i++) {
+    $sum += apc_fetch("key$i");
+}
+var_dump($sum);
+var_dump(apc_add("key1", 'x'));
+var_dump(apc_inc("key2"));
+var_dump(apc_delete("key3"), apc_exists("key3"));
+
+$info = apc_cache_info('user');
+var_dump($info['num_entries'], count($info['cache_list']));
+
+apc_clear_cache('user');
+$info = apc_cache_info('user', true);
+var_dump($info['num_entries']);
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+int(3)
+int(0)
+int(4950)
+bool(false)
+int(3)
+bool(true)
+bool(false)
+int(99)
+int(99)
+int(0)
+===DONE===
@@ -0,0 +1,53 @@
+--TEST--
+APC: user cache slot table grows past apc.user_entries_hint
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.user_entries_hint=16
+--FILE--
+<?php
+$info = apc_cache_info('user', true);
+$initial = $info['num_slots'];
+var_dump($info['load_factor'], $info['rehashing']);
+
+for ($i = 0; $i < 2000; $i++) {
+    apc_store("key$i", $i);
+}
+
+$info = apc_cache_info('user', true);
+var_dump($info['num_slots'] > $initial);
+var_dump($info['num_slots'] % $info['num_stripes']);
+var_dump($info['load_factor'] <= 1);
+var_dump($info['used_slots'] > 0, $info['max_chain_length'] >= 1);
+var_dump(is_bool($info['rehashing']));
+
+$sum = 0;
+for ($i = 0; $i < 2000; $i++) {
+    $sum += apc_fetch("key$i");
+}
+var_dump($sum);
+var_dump(apc_delete("key1"), apc_exists("key1"));
+
+$info = apc_cache_info('user');
+var_dump($info['num_entries'], count($info['cache_list']));
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+float(0)
+bool(false)
+bool(true)
+int(0)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+int(1999000)
+bool(true)
+bool(false)
+int(1999)
+int(1999)
+===DONE===
@@ -0,0 +1,56 @@
+--TEST--
+APC: user cache with apc.optimistic_reads
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.optimistic_reads=1
+apc.user_entries_hint=16
+--FILE--
+<?php
+$info = apc_cache_info('user', true);
+var_dump(is_bool($info['optimistic_reads']));
+
+for ($i = 0; $i < 1000; $i++) {
+    apc_store("key$i", $i);
+}
+$sum = 0;
+$misses = 0;
+for ($i = 0; $i < 2000; $i++) {
+    $v = apc_fetch("key$i", $ok);
+    if ($ok) {
+        $sum += $v;
+    } else {
+        $misses++;
+    }
+}
+var_dump($sum, $misses);
+
+apc_store("key1", "replaced");
+var_dump(apc_fetch("key1"));
+var_dump(apc_delete("key4"), apc_exists("key4"), apc_fetch("key4"));
+apc_store("key4", "back");
+var_dump(apc_exists("key4"), apc_fetch("key4"));
+
+apc_clear_cache('user');
+var_dump(apc_fetch("key5"));
+apc_store("key5", 5);
+var_dump(apc_fetch("key5"));
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+int(499500)
+int(1000)
+string(8) "replaced"
+bool(true)
+bool(false)
+bool(false)
+bool(true)
+string(4) "back"
+bool(false)
+int(5)
+===DONE===
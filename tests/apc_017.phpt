@@ -0,0 +1,63 @@
+--TEST--
+APC: user cache with apc.write_free_hits
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.optimistic_reads=1
+apc.write_free_hits=1
+--FILE--
+<?php
+$info = apc_cache_info('user', true);
+var_dump($info['write_free_hits']);
+$hits = $info['num_hits'];
+$misses = $info['num_misses'];
+
+apc_store("foo", array(1, 2, 3));
+for ($i = 0; $i < 100; $i++) {
+    $v = apc_fetch("foo");
+}
+var_dump($v);
+for ($i = 0; $i < 5; $i++) {
+    apc_fetch("missing$i");
+}
+
+$info = apc_cache_info('user');
+var_dump($info['num_hits'] - $hits, $info['num_misses'] - $misses);
+foreach ($info['cache_list'] as $entry) {
+    if ($entry['info'] == "foo") {
+        var_dump($entry['num_hits'] % 16, $entry['num_hits'] <= 100);
+    }
+}
+
+apc_delete("foo");
+var_dump($v, apc_fetch("foo"));
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+array(3) {
+  [0]=>
+  int(1)
+  [1]=>
+  int(2)
+  [2]=>
+  int(3)
+}
+int(100)
+int(5)
+int(0)
+bool(true)
+array(3) {
+  [0]=>
+  int(1)
+  [1]=>
+  int(2)
+  [2]=>
+  int(3)
+}
+bool(false)
+===DONE===
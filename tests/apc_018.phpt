@@ -0,0 +1,47 @@
+--TEST--
+APC: apc_fetch() state of a miss with apc.slam_defense
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.slam_defense=1
+--FILE--
+<?php
+$info = apc_cache_info('user', true);
+var_dump($info['leases']);
+
+var_dump(apc_fetch("foo", $success, $state), $success, $state === 0);
+/* the lease is ours, a second miss doesn't report the key as being rebuilt */
+apc_fetch("foo", $success, $state);
+var_dump($state === 0);
+
+var_dump(apc_store("foo", "bar"));
+var_dump(apc_fetch("foo", $success, $state), $success, $state === 0);
+
+apc_fetch(array("a", "b"));
+var_dump(apc_store("a", 1), apc_store("b", 2));
+var_dump(apc_fetch(array("a", "b")));
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+bool(false)
+bool(false)
+bool(true)
+bool(true)
+bool(true)
+string(3) "bar"
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+array(2) {
+  ["a"]=>
+  int(1)
+  ["b"]=>
+  int(2)
+}
+===DONE===
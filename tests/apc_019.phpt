@@ -0,0 +1,45 @@
+--TEST--
+APC: apc_store() with a grace period
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.slam_defense=1
+apc.use_request_time=0
+--FILE--
+<?php
+var_dump(apc_store("foo", "bar", 1, 60));
+var_dump(apc_fetch("foo", $success, $state), $state);
+
+$info = apc_cache_info('user');
+foreach ($info['cache_list'] as $entry) {
+    if ($entry['info'] == "foo") {
+        var_dump($entry['ttl'], $entry['grace']);
+    }
+}
+
+sleep(2);
+/* the only process asking is elected to refresh the key: a miss */
+var_dump(apc_fetch("foo", $success, $state), $success, $state);
+var_dump(apc_exists("foo"));
+var_dump(apc_add("foo", "baz", 1, 60));
+var_dump(apc_fetch("foo", $success, $state), $state);
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+string(3) "bar"
+int(0)
+int(1)
+int(60)
+bool(false)
+bool(false)
+int(0)
+bool(false)
+bool(true)
+string(3) "baz"
+int(0)
+===DONE===
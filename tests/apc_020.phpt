@@ -0,0 +1,59 @@
+--TEST--
+APC: apc_remember()
+--SKIPIF--
+<?php
+    require_once(dirname(__FILE__) . '/skipif.inc'); 
+    if(version_compare(zend_version(), '2.3.0') < 0) {
+		echo "skip\n";
+	}
+?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.slam_defense=1
+--FILE--
+<?php
+$producer = function ($key) {
+    echo "producing $key\n";
+    return array($key, 42);
+};
+
+var_dump(apc_remember("foo", $producer, 60));
+var_dump(apc_remember("foo", $producer, 60));
+var_dump(apc_fetch("foo"));
+
+try {
+    apc_remember("bar", function ($key) { throw new Exception("failed $key"); });
+} catch (Exception $e) {
+    echo $e->getMessage(), "\n";
+}
+var_dump(apc_exists("bar"));
+var_dump(apc_remember("bar", function ($key) { return "ok"; }));
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+producing foo
+array(2) {
+  [0]=>
+  string(3) "foo"
+  [1]=>
+  int(42)
+}
+array(2) {
+  [0]=>
+  string(3) "foo"
+  [1]=>
+  int(42)
+}
+array(2) {
+  [0]=>
+  string(3) "foo"
+  [1]=>
+  int(42)
+}
+failed bar
+bool(false)
+string(2) "ok"
+===DONE===
@@ -0,0 +1,89 @@
+--TEST--
+APC: apc_store() with early refreshes
+--SKIPIF--
+<?php
+require_once(dirname(__FILE__) . '/skipif.inc');
+if (!function_exists('pcntl_fork') || !function_exists('posix_kill')) die("skip pcntl and posix needed");
+?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.slam_defense=1
+apc.lease_ttl=60
+--FILE--
+<?php
+function rebuild_time($key) {
+    $info = apc_cache_info('user');
+    foreach ($info['cache_list'] as $entry) {
+        if ($entry['info'] == $key) {
+            return $entry['rebuild_time'];
+        }
+    }
+}
+
+var_dump(apc_fetch("foo"));
+usleep(20000);
+var_dump(apc_store("foo", "bar", 3600, 0, 1.0));
+var_dump(rebuild_time("foo") >= 20000);
+
+/* far from its ttl, the entry is a hit */
+for ($i = 0; $i < 100; $i++) {
+    $v = apc_fetch("foo", $success, $state);
+}
+var_dump($v, $state);
+
+/* stored without a miss first, the rebuild time is unknown */
+var_dump(apc_store("bar", "baz", 3600, 0, 1.0));
+var_dump(rebuild_time("bar"));
+
+/* a child leases the key and dies without giving the lease back, so that
+ * the refreshes drawn ahead of the ttl are served the stale value */
+$pid = pcntl_fork();
+if ($pid == 0) {
+    apc_fetch("baz", $success, $state);
+    posix_kill(posix_getpid(), SIGKILL);
+}
+pcntl_waitpid($pid, $status);
+
+/* a rebuild of 0.2s with a beta of 100 draws nine in ten fetches of a key
+ * with a ttl of 2s early */
+apc_fetch("baz");
+usleep(200000);
+var_dump(apc_store("baz", "qux", 2, 0, 100.0));
+$early = 0;
+for ($i = 0; $i < 100; $i++) {
+    $v = apc_fetch("baz", $success, $state);
+    if ($v !== "qux" || !$success) {
+        echo "lost the stale value\n";
+    }
+    if ($state === APC_FETCH_STALE) {
+        $early++;
+    }
+}
+var_dump($early > 50);
+
+/* neither does a fetch without the state, nor one of an array of keys,
+ * lose the stale value to the lease of the child */
+for ($i = 0; $i < 100; $i++) {
+    if (apc_fetch("baz") !== "qux") {
+        echo "lost the stale value without the state\n";
+    }
+    if (apc_fetch(array("baz")) !== array("baz" => "qux")) {
+        echo "lost the stale value of an array\n";
+    }
+}
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(false)
+bool(true)
+bool(true)
+string(3) "bar"
+int(0)
+bool(true)
+int(0)
+bool(true)
+bool(true)
+===DONE===
@@ -0,0 +1,44 @@
+--TEST--
+APC: user cache with apc.user_prefilter
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.user_prefilter=1
+--FILE--
+<?php
+$info = apc_cache_info('user', true);
+var_dump($info['prefilter']);
+$misses = $info['num_misses'];
+
+for ($i = 0; $i < 100; $i++) {
+    apc_fetch("missing$i");
+}
+var_dump(apc_exists("foo"));
+var_dump(apc_store("foo", "bar"));
+var_dump(apc_fetch("foo"), apc_exists("foo"));
+var_dump(apc_delete("foo"));
+var_dump(apc_fetch("foo"), apc_exists("foo"));
+var_dump(apc_store("foo", "baz"));
+var_dump(apc_fetch("foo"));
+
+$info = apc_cache_info('user', true);
+var_dump($info['num_misses'] - $misses);
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+bool(false)
+bool(true)
+string(3) "bar"
+bool(true)
+bool(true)
+bool(false)
+bool(false)
+bool(true)
+string(3) "baz"
+int(101)
+===DONE===
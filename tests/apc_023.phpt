@@ -0,0 +1,39 @@
+--TEST--
+APC: user cache with apc.sma_magazines
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.sma_magazines=1
+--FILE--
+<?php
+for ($i = 0; $i < 1000; $i++) {
+    apc_store("key$i", array_fill(0, $i % 50 + 1, "value$i"));
+}
+for ($i = 0; $i < 1000; $i += 2) {
+    apc_delete("key$i");
+}
+for ($i = 0; $i < 1000; $i += 2) {
+    apc_store("key$i", str_repeat("x", $i));
+}
+
+$ok = 0;
+for ($i = 0; $i < 1000; $i++) {
+    $expected = $i % 2 ? array_fill(0, $i % 50 + 1, "value$i") : str_repeat("x", $i);
+    if (apc_fetch("key$i") === $expected) {
+        $ok++;
+    }
+}
+var_dump($ok);
+var_dump(apc_clear_cache('user'));
+var_dump(apc_fetch("key1"));
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+int(1000)
+bool(true)
+bool(false)
+===DONE===
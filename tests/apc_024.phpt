@@ -0,0 +1,68 @@
+--TEST--
+APC: user entries survive compaction by the stores
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.use_request_time=0
+apc.shm_size=8M
+apc.janitor_compact=1000
+--FILE--
+<?php
+class Point {
+    public $x, $y;
+    function __construct($x, $y) { $this->x = $x; $this->y = $y; }
+}
+
+function value($i) {
+    switch ($i % 3) {
+        case 0: return str_repeat(chr(ord('a') + $i % 26), 200 + $i % 1500);
+        case 1: return array_fill(0, $i % 40 + 1, "value$i");
+        case 2: return new Point($i, str_repeat("y", $i % 700));
+    }
+}
+
+$stored = array();
+for ($i = 0; $i < 6000; $i++) {
+    if (apc_store("key$i", value($i))) {
+        $stored[] = $i;
+    }
+}
+/* every other entry goes, which leaves the memory in pieces */
+foreach ($stored as $n => $i) {
+    if ($n % 2 == 0) {
+        apc_delete("key$i");
+    }
+}
+
+/* a CLI script has no janitor: the stores compact, once a second */
+for ($s = 0; $s < 3; $s++) {
+    sleep(1);
+    apc_store("tick", $s);
+}
+$info = apc_cache_info('user', true);
+var_dump($info['janitor'], $info['compacted'] > 0);
+
+$ok = $bad = 0;
+foreach ($stored as $n => $i) {
+    if ($n % 2 == 0) {
+        continue;
+    }
+    if (apc_fetch("key$i") == value($i)) {
+        $ok++;
+    } else {
+        $bad++;
+    }
+}
+var_dump($ok > 0, $bad);
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(false)
+bool(true)
+bool(true)
+int(0)
+===DONE===
@@ -0,0 +1,41 @@
+--TEST--
+APC: user cache keeps taking stores once its directory can't grow
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_size=4M
+apc.shm_strings_buffer=1M
+apc.user_entries_hint=16
+--FILE--
+<?php
+/* a few thousand small entries fill the segment while the directory grows
+ * with them; a store that finds no memory, or no id left and no memory for
+ * another chunk, expunges, so that storing the key again gets in */
+$lost = 0;
+for ($i = 0; $i < 20000; $i++) {
+    if (!apc_store("key$i", $i) && !apc_store("key$i", $i)) {
+        $lost++;
+    }
+}
+var_dump($lost);
+
+$info = apc_cache_info('user', true);
+var_dump($info['expunges'] > 0);
+var_dump($info['num_entries'] > 0, $info['num_entries'] < 20000);
+var_dump(apc_fetch("key19999"));
+var_dump(apc_store("foo", "bar"), apc_fetch("foo"));
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+int(0)
+bool(true)
+bool(true)
+bool(true)
+int(19999)
+bool(true)
+string(3) "bar"
+===DONE===
@@ -0,0 +1,49 @@
+--TEST--
+APC: user cache evicts with the clock hand under memory pressure
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_size=4M
+apc.shm_strings_buffer=1M
+apc.user_ttl=0
+--FILE--
+<?php
+/* the segment fills up many times over: entries nobody fetches make room,
+ * while the one that is fetched all along keeps getting a second chance.
+ * Until the hand has been round once every entry counts as used, so the hot
+ * one may go once. */
+apc_store("hot", "value");
+$misses = 0;
+for ($i = 0; $i < 20000; $i++) {
+    apc_store("key$i", $i);
+    if (apc_fetch("hot") !== "value") {
+        $misses++;
+        apc_store("hot", "value");
+    }
+}
+var_dump($misses < 3);
+
+$recent = 0;
+for ($i = 19900; $i < 20000; $i++) {
+    if (apc_fetch("key$i") === $i) {
+        $recent++;
+    }
+}
+var_dump($recent);
+
+/* nothing wiped the cache out */
+$info = apc_cache_info('user', true);
+var_dump($info['expunges'] > 0);
+var_dump($info['num_entries'] > 1000);
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+int(100)
+bool(true)
+bool(true)
+===DONE===
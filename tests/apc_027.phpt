@@ -0,0 +1,67 @@
+--TEST--
+APC: file cache evicts under memory pressure and keeps the file in use
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.cache_by_default=1
+apc.file_update_protection=0
+apc.stat=On
+apc.ttl=0
+apc.shm_size=4M
+apc.shm_strings_buffer=1M
+report_memleaks=0
+--FILE--
+<?php
+/* every cold file is compiled once and never run, the hot one is included
+ * between them; the cold files add up to several times the segment */
+$hot = __DIR__ . '/apc_027-hot.php';
+file_put_contents($hot, '<?php $hits++;');
+
+$body = "<?php\n";
+for ($j = 0; $j < 500; $j++) {
+    $body .= "\$a[] = 'statement $j of a file that is never run';\n";
+}
+
+$hits = 0;
+for ($i = 0; $i < 200; $i++) {
+    $cold = __DIR__ . "/apc_027-$i.php";
+    file_put_contents($cold, $body);
+    apc_compile_file($cold);
+    include $hot;
+}
+var_dump($hits);
+
+$info = apc_cache_info('file');
+var_dump($info['expunges'] > 0);
+var_dump($info['num_entries'] > 1);
+
+$found = false;
+$timed = true;
+foreach ($info['cache_list'] as $entry) {
+    if ($entry['filename'] == $hot) {
+        $found = true;
+    }
+    if (!is_int($entry['compile_time']) || $entry['compile_time'] < 0) {
+        $timed = false;
+    }
+}
+var_dump($found, $timed);
+?>
+===DONE===
+<?php exit(0); ?>
+--CLEAN--
+<?php
+@unlink(dirname(__FILE__) . '/apc_027-hot.php');
+for ($i = 0; $i < 200; $i++) {
+    @unlink(dirname(__FILE__) . "/apc_027-$i.php");
+}
+?>
+--EXPECTF--
+int(200)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+===DONE===
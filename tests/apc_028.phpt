@@ -0,0 +1,51 @@
+--TEST--
+APC: admission filter keeps one-off keys from pushing out a hot one
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_size=4M
+apc.shm_strings_buffer=1M
+apc.user_ttl=0
+apc.user_entries_hint=4096
+apc.user_admission=1
+--FILE--
+<?php
+/* the sketch only counts a sample of the fetches, so the hot key is asked
+ * for often; once the segment is full, keys stored a single time have to
+ * beat the entry the clock would evict, and some of them don't */
+apc_store("hot", "value");
+for ($i = 0; $i < 2000; $i++) {
+    apc_fetch("hot");
+}
+
+$rejected = 0;
+$misses = 0;
+for ($i = 0; $i < 20000; $i++) {
+    if (!apc_store("key$i", str_repeat("x", 100))) {
+        $rejected++;
+    }
+    if (apc_fetch("hot") !== "value") {
+        $misses++;
+        apc_store("hot", "value");
+    }
+}
+var_dump($rejected > 0);
+var_dump($misses < 3);
+var_dump(apc_fetch("hot"));
+
+$info = apc_cache_info('user', true);
+var_dump($info['admission_filter']);
+var_dump($info['num_entries'] > 1000);
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+bool(true)
+string(5) "value"
+bool(true)
+bool(true)
+===DONE===
@@ -0,0 +1,55 @@
+--TEST--
+APC: expunge of a user cache with a ttl only removes what makes room
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.use_request_time=0
+apc.shm_size=4M
+apc.shm_strings_buffer=1M
+apc.user_ttl=1
+--FILE--
+<?php
+/* the old entries outlive the cache ttl, the new ones need about as much
+ * memory again: the sweep removes old entries until each store fits, and
+ * leaves the rest alone rather than wiping the cache */
+$value = str_repeat("x", 100000);
+$old = 0;
+for ($i = 0; $i < 16; $i++) {
+    $old += apc_store("old$i", $value);
+}
+sleep(2);
+
+apc_store("keep", "value");
+$new = 0;
+for ($i = 0; $i < 16; $i++) {
+    $new += apc_store("new$i", $value);
+}
+var_dump($old > 10, $new);
+
+$left = 0;
+for ($i = 0; $i < 16; $i++) {
+    if (apc_fetch("old$i") !== false) {
+        $left++;
+    }
+}
+var_dump($left > 0, $left < $old);
+var_dump(apc_fetch("keep"));
+
+$info = apc_cache_info('user', true);
+var_dump($info['expunges'] > 0);
+var_dump($info['num_entries'] == 17 + $left);
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+int(16)
+bool(true)
+bool(true)
+string(5) "value"
+bool(true)
+bool(true)
+===DONE===
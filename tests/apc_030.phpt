@@ -0,0 +1,32 @@
+--TEST--
+APC: no janitor for a CLI script
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.use_request_time=0
+apc.janitor_interval=1
+--FILE--
+<?php
+/* the script would be gone before the first round; without a janitor the
+ * stores do the housekeeping themselves */
+$info = apc_cache_info('user', true);
+var_dump($info['janitor']);
+
+apc_store("foo", "bar", 1);
+sleep(2);
+apc_store("baz", "qux");
+var_dump(apc_fetch("foo"));
+
+$info = apc_cache_info('user', true);
+var_dump($info['num_entries']);
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(false)
+bool(false)
+int(1)
+===DONE===
@@ -0,0 +1,39 @@
+--TEST--
+APC: slots removed under lock-free reads are freed once no reader is left
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_size=4M
+apc.shm_strings_buffer=1M
+apc.optimistic_reads=1
+--FILE--
+<?php
+/* every store replaces the slot before it, the fetch in between is a
+ * lock-free read; the replaced slots add up to several times the segment,
+ * so they have to be freed along the way rather than expunged */
+$value = str_repeat("x", 1000);
+for ($i = 0; $i < 10000; $i++) {
+    apc_store("key", $value . $i);
+    if (apc_fetch("key") !== $value . $i) {
+        echo "wrong value at $i\n";
+        break;
+    }
+}
+var_dump(apc_fetch("key") === $value . 9999);
+
+$info = apc_cache_info('user');
+var_dump($info['expunges']);
+var_dump($info['num_entries']);
+var_dump(count($info['deleted_list']) < 512);
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+int(0)
+int(1)
+bool(true)
+===DONE===
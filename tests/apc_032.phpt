@@ -0,0 +1,55 @@
+--TEST--
+APC: apc_fetch() takes a lease on a miss, apc_store() always stores
+--SKIPIF--
+<?php
+require_once(dirname(__FILE__) . '/skipif.inc');
+if (!function_exists('pcntl_fork') || !function_exists('posix_kill')) die("skip pcntl and posix needed");
+?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.slam_defense=1
+apc.lease_ttl=60
+--FILE--
+<?php
+/* a child misses the keys and dies without giving back what it leased */
+function miss_in_child($key, $ask) {
+    $pid = pcntl_fork();
+    if ($pid == 0) {
+        if ($ask) {
+            apc_fetch($key, $success, $state);
+        } else {
+            apc_fetch($key);
+        }
+        posix_kill(posix_getpid(), SIGKILL);
+    }
+    pcntl_waitpid($pid, $status);
+}
+
+/* a plain fetch takes a lease, as does one with a state */
+miss_in_child("plain", false);
+apc_fetch("plain", $success, $state);
+var_dump($state === APC_FETCH_REBUILDING);
+
+/* the key is stored anyway */
+miss_in_child("leased", true);
+apc_fetch("leased", $success, $state);
+var_dump($state === APC_FETCH_REBUILDING);
+var_dump(apc_store("leased", "value"));
+var_dump(apc_fetch("leased", $success, $state), $state);
+
+/* another key of the same length isn't leased */
+apc_fetch("leasee", $success, $state);
+var_dump($state);
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+bool(true)
+bool(true)
+string(5) "value"
+int(0)
+int(0)
+===DONE===
@@ -0,0 +1,43 @@
+--TEST--
+APC: apc_remember() takes over a lease that ran out
+--SKIPIF--
+<?php
+require_once(dirname(__FILE__) . '/skipif.inc');
+if (!function_exists('pcntl_fork') || !function_exists('posix_kill')) die("skip pcntl and posix needed");
+?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.slam_defense=1
+apc.lease_ttl=1
+--FILE--
+<?php
+/* a child takes the lease on the key and dies without giving it back */
+$pid = pcntl_fork();
+if ($pid == 0) {
+    apc_fetch("foo", $success, $state);
+    posix_kill(posix_getpid(), SIGKILL);
+}
+pcntl_waitpid($pid, $status);
+
+apc_fetch("foo", $success, $state);
+var_dump($state === APC_FETCH_REBUILDING);
+
+$start = microtime(true);
+var_dump(apc_remember("foo", function ($key) {
+    echo "producing $key\n";
+    return "bar";
+}));
+var_dump(microtime(true) - $start > 0.5);
+var_dump(apc_fetch("foo"));
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+producing foo
+string(3) "bar"
+bool(true)
+string(3) "bar"
+===DONE===
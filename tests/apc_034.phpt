@@ -0,0 +1,61 @@
+--TEST--
+APC: freed blocks are reused from their size class before the rest of the segment
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_size=4M
+apc.shm_strings_buffer=1M
+apc.sma_magazines=0
+--FILE--
+<?php
+function free_blocks($min) {
+    $info = apc_sma_info();
+    $count = 0;
+    $largest = 0;
+    foreach ($info['block_lists'][0] as $block) {
+        if ($block['size'] >= $min) {
+            $count++;
+        }
+        $largest = max($largest, $block['size']);
+    }
+    return array($count, $largest);
+}
+
+/* deleting every other entry leaves holes between the ones that are left */
+$value = str_repeat('x', 20000);
+for ($i = 0; $i < 120; $i++) {
+    apc_store("key$i", $value);
+}
+list($before, ) = free_blocks(20000);
+for ($i = 0; $i < 120; $i += 2) {
+    apc_delete("key$i");
+}
+list($holes, $largest) = free_blocks(20000);
+var_dump($holes - $before >= 50);
+
+/* entries of the same size go into the holes, not at the end of the segment */
+for ($i = 0; $i < 120; $i += 2) {
+    apc_store("new$i", $value);
+}
+list($left, $after) = free_blocks(20000);
+var_dump($left - $before <= 5);
+var_dump($largest - $after < 5 * 20000);
+
+$info = apc_cache_info('user', true);
+var_dump($info['expunges'], $info['num_entries']);
+var_dump(apc_fetch("key1") === $value, apc_fetch("new118") === $value);
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+bool(true)
+bool(true)
+int(0)
+int(120)
+bool(true)
+bool(true)
+===DONE===
@@ -0,0 +1,52 @@
+--TEST--
+APC: large allocations take the free block that fits them best
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_size=4M
+apc.shm_strings_buffer=1M
+apc.sma_magazines=0
+--FILE--
+<?php
+function free_blocks($min, $max) {
+    $info = apc_sma_info();
+    $count = 0;
+    foreach ($info['block_lists'][0] as $block) {
+        if ($block['size'] >= $min && $block['size'] < $max) {
+            $count++;
+        }
+    }
+    return $count;
+}
+
+/* three large entries of different sizes, kept apart by small ones so that
+ * their blocks don't merge once they are deleted */
+$sizes = array("a" => 300000, "b" => 100000, "c" => 200000);
+foreach ($sizes as $key => $size) {
+    apc_store($key, str_repeat('x', $size));
+    apc_store("$key-fence", str_repeat('y', 20000));
+}
+foreach ($sizes as $key => $size) {
+    apc_delete($key);
+}
+var_dump(free_blocks(300000, 330000), free_blocks(100000, 130000), free_blocks(200000, 230000));
+
+/* a first fit would have split the hole of "a", the tightest is the one of "b" */
+apc_store("d", str_repeat('x', 100000));
+var_dump(free_blocks(300000, 330000), free_blocks(100000, 130000), free_blocks(200000, 230000));
+var_dump(strlen(apc_fetch("d")));
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+int(1)
+int(1)
+int(1)
+int(1)
+int(0)
+int(1)
+int(100000)
+===DONE===
@@ -0,0 +1,55 @@
+--TEST--
+APC: a worker allocates from its home segment first, and from the others when it is full
+--SKIPIF--
+<?php
+require_once(dirname(__FILE__) . '/skipif.inc');
+$info = apc_sma_info(true);
+if ($info['num_seg'] != 2) die("skip two segments needed");
+?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_segments=2
+apc.shm_size=4M
+apc.shm_strings_buffer=1M
+apc.mmap_file_mask=/tmp/apc.XXXXXX
+--FILE--
+<?php
+$start = apc_sma_info(true);
+var_dump(count($start['seg_avail']));
+var_dump(array_sum($start['seg_avail']) == $start['avail_mem']);
+
+/* the first megabyte all goes into one segment */
+$value = str_repeat('x', 100000);
+for ($i = 0; $i < 10; $i++) {
+    apc_store("key$i", $value);
+}
+$info = apc_sma_info(true);
+$used = array($start['seg_avail'][0] - $info['seg_avail'][0], $start['seg_avail'][1] - $info['seg_avail'][1]);
+$home = $used[0] > $used[1] ? 0 : 1;
+var_dump($used[$home] >= 1000000, $used[1 - $home] < 100000);
+
+/* more than the home segment holds spills over into the other one */
+for ($i = 10; $i < 45; $i++) {
+    apc_store("key$i", $value);
+}
+$info = apc_sma_info(true);
+var_dump($start['seg_avail'][1 - $home] - $info['seg_avail'][1 - $home] >= 100000);
+var_dump(array_sum($info['seg_avail']) == $info['avail_mem']);
+
+$cache = apc_cache_info('user', true);
+var_dump($cache['expunges'], $cache['num_entries']);
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+int(2)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+int(0)
+int(45)
+===DONE===
@@ -0,0 +1,47 @@
+--TEST--
+APC: slam_defense covers code that fetches and stores without the state
+--SKIPIF--
+<?php
+require_once(dirname(__FILE__) . '/skipif.inc');
+if (!function_exists('pcntl_fork') || !function_exists('posix_kill')) die("skip pcntl and posix needed");
+?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.slam_defense=1
+apc.lease_ttl=60
+--FILE--
+<?php
+/* the usual pattern, written before there were leases */
+function cached($key) {
+    $value = apc_fetch($key);
+    if ($value === false) {
+        usleep(500000);
+        $value = "rebuilt";
+        apc_store($key, $value);
+    }
+    return $value;
+}
+
+$pid = pcntl_fork();
+if ($pid == 0) {
+    cached("foo");
+    posix_kill(posix_getpid(), SIGKILL);
+}
+
+/* while the child rebuilds the key, others are told so */
+usleep(200000);
+var_dump(apc_fetch("foo", $success, $state), $state === APC_FETCH_REBUILDING);
+
+pcntl_waitpid($pid, $status);
+var_dump(apc_fetch("foo", $success, $state), $state);
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(false)
+bool(true)
+string(7) "rebuilt"
+int(0)
+===DONE===